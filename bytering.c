@@ -0,0 +1,608 @@
+/*
+ * A circular buffer of variable size records
+ *
+ * Where circular.c passes single integers, this passes arbitrary lumps of
+ * bytes (for instance, whole <mult>*188 byte datagrams), each prefixed by
+ * its length. The producer writes records directly into the buffer, and
+ * the consumer reads them directly from it, so nothing need be copied on
+ * the way through.
+ *
+ * As with circular.c, there must be exactly one producer and exactly one
+ * consumer, which may be in different processes if the buffer is in shared
+ * memory (as it is here).
+ *
+ * On Linux, the buffer's memory can optionally be mapped twice, one copy
+ * straight after the other (a "magic" ring buffer). Then a record that
+ * runs off the end of the buffer just carries on into the second copy,
+ * which is the same memory as the start of the first, so every record is
+ * contiguous, and can be passed as a single pointer to recv, send, etc.
+ *
+ * Author: Tony J. Ibbs <tibs@tonyibbs.co.uk>
+ * Released to the public domain (please be nice to it)
+ */
+
+#if defined(__linux__)
+#define _GNU_SOURCE     // for memfd_create
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+
+#include <errno.h>
+#include <string.h>
+
+#include <sys/mman.h>   // Memory mapping
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <signal.h>     // kill
+#include <sys/time.h>   // gettimeofday
+#include <unistd.h>
+
+#include <sched.h>      // sched_yield
+#include <stdatomic.h>  // C11 atomics, for sharing between processes
+
+#define CACHE_LINE   64  // bytes, on any machine we're likely to care about
+
+// Tell the CPU we're busy-waiting
+#if defined(__x86_64__) || defined(__i386__)
+#define CPU_RELAX()   __builtin_ia32_pause()
+#elif defined(__aarch64__) || defined(__arm__)
+#define CPU_RELAX()   __asm__ __volatile__("yield" ::: "memory")
+#else
+#define CPU_RELAX()   do {} while (0)
+#endif
+
+typedef unsigned char byte;
+
+// Each record starts with a header giving its length (not including the
+// header itself). Records are padded so that each header is 8 byte aligned.
+#define RECORD_HEADER   sizeof(uint32_t)
+#define RECORD_ALIGN    8
+#define RECORD_SPACE(len) \
+  (((len) + RECORD_HEADER + RECORD_ALIGN - 1) & ~(size_t)(RECORD_ALIGN - 1))
+
+// A record header with this "length" means "skip to the start of the
+// buffer" - the next record wouldn't fit before the end. This never
+// happens in a magic ring buffer.
+#define RECORD_PAD      0xFFFFFFFF
+
+// The buffer itself.
+//
+// `tail` is the total number of bytes the producer has ever committed, and
+// `head` the total number the consumer has ever released. They only ever
+// increase (64 bits will take rather a long time to wrap), so the number
+// of bytes in use is always `tail - head`, and the position of a byte in
+// `data` is just its count masked by `capacity - 1` - which is why the
+// capacity must be a power of two.
+//
+// As in circular.c, each side's shared index lives on its own cache line,
+// along with the things only that side uses - its cached copy of the other
+// side's index, and how far it has got privately (which it only tells the
+// other side about when it commits or releases, so that a whole batch of
+// records costs just one update of the shared index).
+struct byte_ring
+{
+  // Owned by the consumer
+  _Alignas(CACHE_LINE) atomic_uint_fast64_t  head;
+  uint64_t  cached_tail;
+  uint64_t  read_pos;     // start of the next record to peek at
+
+  // Owned by the producer
+  _Alignas(CACHE_LINE) atomic_uint_fast64_t  tail;
+  uint64_t  cached_head;
+  uint64_t  write_pos;    // end of the last record reserved
+  uint64_t  last_record;  // start of the last record reserved
+
+  // Fixed when the buffer is created
+  _Alignas(CACHE_LINE) size_t  capacity;
+  size_t    mask;
+  int       magic;        // is `data` mapped twice?
+  size_t    max_record;   // largest space a record may take
+  byte     *data;
+};
+typedef struct byte_ring *byte_ring_p;
+
+/*
+ * Map `capacity` bytes of shared memory twice, one copy directly after the
+ * other, so that data[capacity+n] is the same byte as data[n].
+ *
+ * `capacity` must be a multiple of the page size.
+ *
+ * Returns the address of the first copy, or NULL if something went wrong.
+ */
+static byte *map_twice(size_t  capacity)
+{
+#if defined(__linux__)
+  int   fd;
+  byte *addr;
+  byte *first;
+  byte *second;
+
+  fd = memfd_create("byte_ring",0);
+  if (fd == -1)
+  {
+    fprintf(stderr,"### Unable to create memory file for byte ring: %s\n",
+            strerror(errno));
+    return NULL;
+  }
+  if (ftruncate(fd,capacity) == -1)
+  {
+    fprintf(stderr,"### Unable to size memory file for byte ring: %s\n",
+            strerror(errno));
+    close(fd);
+    return NULL;
+  }
+
+  // First reserve enough address space for both copies, so that nothing
+  // else can sneak in between them, then map the file over each half
+  addr = mmap(NULL,2*capacity,PROT_NONE,MAP_PRIVATE | MAP_ANON,-1,0);
+  if (addr == MAP_FAILED)
+  {
+    fprintf(stderr,"### Unable to reserve %zu bytes for byte ring: %s\n",
+            2*capacity,strerror(errno));
+    close(fd);
+    return NULL;
+  }
+  first = mmap(addr,capacity,PROT_READ | PROT_WRITE,
+               MAP_SHARED | MAP_FIXED,fd,0);
+  second = mmap(addr+capacity,capacity,PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_FIXED,fd,0);
+  if (first == MAP_FAILED || second == MAP_FAILED)
+  {
+    fprintf(stderr,"### Unable to map byte ring twice: %s\n",strerror(errno));
+    (void) munmap(addr,2*capacity);
+    close(fd);
+    return NULL;
+  }
+
+  // The mappings keep the memory alive without the file descriptor
+  close(fd);
+  return addr;
+#else
+  fprintf(stderr,"### Magic ring buffers are only supported on Linux\n");
+  return NULL;
+#endif
+}
+
+/*
+ * Create a new, empty, byte ring in (anonymous) shared memory.
+ *
+ * - `capacity` is the size of its data area, in bytes. It must be a power
+ *   of two.
+ * - if `magic` is true, the data area will be mapped twice, so that records
+ *   never need to wrap (in which case `capacity` must also be a multiple of
+ *   the page size). A record may then be as large as the whole buffer,
+ *   whereas otherwise it may be no larger than half of it.
+ *
+ * Returns the new buffer, or NULL if something went wrong.
+ */
+byte_ring_p new_byte_ring(size_t  capacity,
+                          int     magic)
+{
+  byte_ring_p  ring;
+  byte        *data;
+  long         page_size = sysconf(_SC_PAGESIZE);
+
+  if (capacity < 2*RECORD_ALIGN || (capacity & (capacity - 1)) != 0)
+  {
+    fprintf(stderr,"### Byte ring capacity %zu is not a power of two"
+            " (or is too small)\n",capacity);
+    return NULL;
+  }
+  if (magic && capacity % page_size != 0)
+  {
+    fprintf(stderr,"### Magic byte ring capacity %zu is not a multiple"
+            " of the page size (%ld)\n",capacity,page_size);
+    return NULL;
+  }
+
+  ring = mmap(NULL,sizeof(struct byte_ring),PROT_READ | PROT_WRITE,
+              MAP_SHARED | MAP_ANON,-1,0);
+  if (ring == MAP_FAILED)
+  {
+    fprintf(stderr,"### Unable to map byte ring: %s\n",strerror(errno));
+    return NULL;
+  }
+
+  if (magic)
+    data = map_twice(capacity);
+  else
+  {
+    data = mmap(NULL,capacity,PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_ANON,-1,0);
+    if (data == MAP_FAILED)
+    {
+      fprintf(stderr,"### Unable to map %zu bytes for byte ring: %s\n",
+              capacity,strerror(errno));
+      data = NULL;
+    }
+  }
+  if (data == NULL)
+  {
+    (void) munmap(ring,sizeof(struct byte_ring));
+    return NULL;
+  }
+
+  atomic_init(&ring->head,0);
+  atomic_init(&ring->tail,0);
+  ring->cached_tail = 0;
+  ring->read_pos = 0;
+  ring->cached_head = 0;
+  ring->write_pos = 0;
+  ring->last_record = 0;
+  ring->capacity = capacity;
+  ring->mask = capacity - 1;
+  ring->magic = magic;
+  ring->max_record = (magic ? capacity : capacity / 2);
+  ring->data = data;
+  return ring;
+}
+
+/*
+ * Tidy up a byte ring when it is no longer needed.
+ */
+void free_byte_ring(byte_ring_p  ring)
+{
+  if (ring == NULL)
+    return;
+  (void) munmap(ring->data,(ring->magic ? 2 : 1) * ring->capacity);
+  (void) munmap(ring,sizeof(struct byte_ring));
+}
+
+/*
+ * Reserve room for a record of `len` bytes. Only the producer may call this.
+ *
+ * The record is not visible to the consumer until commit_byte_ring() is
+ * called, so several records may be reserved (and written) and then all
+ * committed at once. If fewer bytes than were reserved turn out to be
+ * needed (for instance, when receiving into the record), use
+ * trim_byte_ring() before committing.
+ *
+ * Returns a pointer to where the record data should be written, or NULL
+ * (with errno set to EAGAIN) if there is not yet room for it, or (with
+ * errno set to EMSGSIZE) if there never will be.
+ */
+byte *reserve_byte_ring(byte_ring_p  ring,
+                        size_t       len)
+{
+  uint64_t  pos    = ring->write_pos;
+  size_t    offset = pos & ring->mask;
+  size_t    space  = RECORD_SPACE(len);
+  size_t    pad    = 0;
+
+  if (space > ring->max_record)
+  {
+    fprintf(stderr,"### Record of %zu bytes is too big for byte ring"
+            " of %zu bytes\n",len,ring->capacity);
+    errno = EMSGSIZE;
+    return NULL;
+  }
+
+  // If it won't fit before the end of the buffer, we'll have to skip
+  // what's left there, and start again at the beginning - unless the
+  // buffer is magic, in which case it can just run on into the second copy
+  if (offset + space > ring->capacity && !ring->magic)
+    pad = ring->capacity - offset;
+
+  if (pos + pad + space - ring->cached_head > ring->capacity)
+  {
+    // Apparently full - but the consumer may have moved on since we looked
+    ring->cached_head = atomic_load_explicit(&ring->head,memory_order_acquire);
+    if (pos + pad + space - ring->cached_head > ring->capacity)
+    {
+      errno = EAGAIN;
+      return NULL;
+    }
+  }
+
+  if (pad)
+  {
+    *(uint32_t *)&ring->data[offset] = RECORD_PAD;
+    pos += pad;
+    offset = 0;
+  }
+  *(uint32_t *)&ring->data[offset] = len;
+  ring->last_record = pos;
+  ring->write_pos = pos + space;
+  return &ring->data[offset + RECORD_HEADER];
+}
+
+/*
+ * Shorten the most recently reserved (and not yet committed) record to
+ * `len` bytes, which must be no more than were reserved.
+ */
+void trim_byte_ring(byte_ring_p  ring,
+                    size_t       len)
+{
+  size_t  offset = ring->last_record & ring->mask;
+  *(uint32_t *)&ring->data[offset] = len;
+  ring->write_pos = ring->last_record + RECORD_SPACE(len);
+}
+
+/*
+ * Make all the records reserved so far visible to the consumer. Only the
+ * producer may call this.
+ */
+void commit_byte_ring(byte_ring_p  ring)
+{
+  atomic_store_explicit(&ring->tail,ring->write_pos,memory_order_release);
+}
+
+/*
+ * Look at the oldest record that hasn't yet been consumed. Only the
+ * consumer may call this.
+ *
+ * Returns a pointer to the record data (and its length in `len`), or NULL
+ * if there are no records waiting.
+ *
+ * The data remains valid (and unchanged) until release_byte_ring() is
+ * called, even if consume_byte_ring() has been called for it.
+ */
+byte *peek_byte_ring(byte_ring_p  ring,
+                     size_t      *len)
+{
+  size_t    offset;
+  uint32_t  header;
+
+  if (ring->read_pos == ring->cached_tail)
+  {
+    // Apparently empty - but the producer may have moved on since we looked
+    ring->cached_tail = atomic_load_explicit(&ring->tail,memory_order_acquire);
+    if (ring->read_pos == ring->cached_tail)
+      return NULL;
+  }
+
+  offset = ring->read_pos & ring->mask;
+  header = *(uint32_t *)&ring->data[offset];
+  if (header == RECORD_PAD)
+  {
+    // The producer always writes a real record straight after padding,
+    // and commits them together
+    ring->read_pos += ring->capacity - offset;
+    offset = 0;
+    header = *(uint32_t *)&ring->data[offset];
+  }
+  *len = header;
+  return &ring->data[offset + RECORD_HEADER];
+}
+
+/*
+ * Move on past the record most recently returned by peek_byte_ring().
+ * Only the consumer may call this.
+ *
+ * The space it occupies is not given back to the producer until
+ * release_byte_ring() is called, so several records may be consumed and
+ * then all released at once.
+ */
+void consume_byte_ring(byte_ring_p  ring)
+{
+  size_t  offset = ring->read_pos & ring->mask;
+  ring->read_pos += RECORD_SPACE(*(uint32_t *)&ring->data[offset]);
+}
+
+/*
+ * Give the space used by all the records consumed so far back to the
+ * producer. Only the consumer may call this.
+ */
+void release_byte_ring(byte_ring_p  ring)
+{
+  atomic_store_explicit(&ring->head,ring->read_pos,memory_order_release);
+}
+
+
+
+/*
+ * Test code...
+ */
+
+#define TS_PACKET_SIZE   188
+#define MAX_MULT         7
+#define SPIN_LIMIT       1000
+
+static void wait_a_bit(int  spins)
+{
+  if (spins < SPIN_LIMIT)
+    CPU_RELAX();
+  else
+    sched_yield();
+}
+
+/*
+ * Send `count` "datagrams" of varying size through the ring, committing
+ * them `batch` at a time. Each has its number in its first four bytes.
+ *
+ * Returns 0 if they were all sent, 1 if one could never fit.
+ */
+static int producer(byte_ring_p   ring,
+                    unsigned int  count,
+                    int           batch)
+{
+  unsigned int  ii;
+  int           pending = 0;
+  for (ii = 0; ii < count; ii++)
+  {
+    size_t  len = TS_PACKET_SIZE * (1 + ii % MAX_MULT);
+    byte   *data;
+    int     spins = 0;
+    while ((data = reserve_byte_ring(ring,len)) == NULL)
+    {
+      if (errno == EMSGSIZE)
+        return 1;
+      // Make sure the consumer can see what we've got so far
+      commit_byte_ring(ring);
+      pending = 0;
+      wait_a_bit(spins++);
+    }
+    memcpy(data,&ii,sizeof(ii));
+    data[len-1] = (byte)ii;
+    if (++pending >= batch)
+    {
+      commit_byte_ring(ring);
+      pending = 0;
+    }
+  }
+  commit_byte_ring(ring);
+  return 0;
+}
+
+/*
+ * Read `count` "datagrams" from the ring, releasing them `batch` at a time,
+ * and check they are what we expected.
+ *
+ * Returns 0 if they were, 1 if they weren't.
+ */
+static int consumer(byte_ring_p   ring,
+                    unsigned int  count,
+                    int           batch)
+{
+  unsigned int  ii;
+  int           pending = 0;
+  for (ii = 0; ii < count; ii++)
+  {
+    size_t        len;
+    unsigned int  number;
+    byte         *data;
+    int           spins = 0;
+    while ((data = peek_byte_ring(ring,&len)) == NULL)
+    {
+      release_byte_ring(ring);
+      pending = 0;
+      wait_a_bit(spins++);
+    }
+    memcpy(&number,data,sizeof(number));
+    if (number != ii || len != TS_PACKET_SIZE * (1 + ii % MAX_MULT) ||
+        data[len-1] != (byte)ii)
+    {
+      fprintf(stderr,"### Record %u: got record %u, length %zu\n",
+              ii,number,len);
+      return 1;
+    }
+    consume_byte_ring(ring);
+    if (++pending >= batch)
+    {
+      release_byte_ring(ring);
+      pending = 0;
+    }
+  }
+  release_byte_ring(ring);
+  return 0;
+}
+
+int main(int argc, char **argv)
+{
+  int           err;
+  int           ii;
+  size_t        capacity = 64*1024;
+  unsigned int  count = 1000000;
+  int           batch = 1;
+  int           magic = 0;
+  byte_ring_p   ring;
+  pid_t         pid, result;
+  struct timeval then;
+  struct timeval now;
+  double        elapsed;
+
+  ii = 1;
+  while (ii < argc)
+  {
+    if (!strcmp("-magic",argv[ii]))
+    {
+      magic = 1;
+      ii ++;
+      continue;
+    }
+    if (ii + 1 >= argc)
+    {
+      fprintf(stderr,"### %s needs a value\n",argv[ii]);
+      return 1;
+    }
+    if (!strcmp("-size",argv[ii]))
+      capacity = strtoul(argv[ii+1],NULL,0);
+    else if (!strcmp("-count",argv[ii]))
+      count = strtoul(argv[ii+1],NULL,0);
+    else if (!strcmp("-batch",argv[ii]))
+    {
+      batch = atoi(argv[ii+1]);
+      if (batch < 1)
+      {
+        fprintf(stderr,"### Batch size %s does not make sense\n",argv[ii+1]);
+        return 1;
+      }
+    }
+    else
+    {
+      fprintf(stderr,
+              "Usage: bytering [-size <bytes>] [-count <n>] [-batch <n>] [-magic]\n"
+              "\n"
+              "    Passes <n> records, of 188 to %d*188 bytes, from one process\n"
+              "    to another through a byte ring, and checks they arrive intact.\n"
+              "\n"
+              "    -size  is the ring capacity, a power of two, and big enough\n"
+              "           for two of the largest records (default 65536).\n"
+              "    -count is the number of records (default 1000000).\n"
+              "    -batch is how many records to commit (or release) at once\n"
+              "           (default 1).\n"
+              "    -magic maps the ring twice, so records never wrap.\n",
+              MAX_MULT);
+      return 1;
+    }
+    ii += 2;
+  }
+
+  ring = new_byte_ring(capacity,magic);
+  if (ring == NULL)
+    return 1;
+  if (ring->max_record < RECORD_SPACE(MAX_MULT*TS_PACKET_SIZE))
+  {
+    fprintf(stderr,"### Byte ring of %zu bytes is too small for records"
+            " of %d bytes\n",capacity,MAX_MULT*TS_PACKET_SIZE);
+    free_byte_ring(ring);
+    return 1;
+  }
+
+  printf("Passing %u records through a %zu byte%s ring, in batches of %d\n",
+         count,capacity,(magic?" magic":""),batch);
+  fflush(stdout);  // so the child doesn't inherit our output as well
+  gettimeofday(&then,NULL);
+
+  pid = fork();
+  if (pid == -1)
+  {
+    perror("Error forking");
+    return 1;
+  }
+  else if (pid == 0)
+  {
+    // We're the child, and thus the consumer
+    return consumer(ring,count,batch);
+  }
+
+  if (producer(ring,count,batch))
+  {
+    kill(pid,SIGTERM);  // as it would wait for ever
+    (void) wait(&err);
+    return 1;
+  }
+
+  result = wait(&err);
+  if (result == -1)
+  {
+    perror("Waiting for child to exit");
+    return 1;
+  }
+  gettimeofday(&now,NULL);
+  elapsed = (now.tv_sec - then.tv_sec) + (now.tv_usec - then.tv_usec) / 1e6;
+
+  if (!WIFEXITED(err) || WEXITSTATUS(err) != 0)
+  {
+    fprintf(stderr,"### Child reported an error\n");
+    return 1;
+  }
+  printf("All %u records received correctly in %.3f seconds"
+         " (%.0f records/second)\n",count,elapsed,count/elapsed);
+
+  free_byte_ring(ring);
+  return 0;
+}
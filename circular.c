@@ -7,7 +7,6 @@
  * $Date: 2004/03/10 16:33:20 $
  */
 
-#include <stdlib.h>
 #include <stdlib.h>
 #include <stdio.h>
 
@@ -20,83 +19,267 @@
 #include <sys/wait.h>
 #include <unistd.h>
 
-#include <time.h>       // Sleeping
+#include <sched.h>      // sched_yield
+#include <stdatomic.h>  // C11 atomics, for sharing between processes
 
-#define BUFFER_SIZE  11  // one more item than we actually need
+#if defined(__linux__)
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
 
-// A circular buffer, usable as a queue
+#define BUFFER_SIZE  11  // one more item than we actually need
+#define CACHE_LINE   64  // bytes, on any machine we're likely to care about
+
+// Tell the CPU we're busy-waiting (saves power, and lets a hyperthreaded
+// sibling get on with something useful)
+#if defined(__x86_64__) || defined(__i386__)
+#define CPU_RELAX()   __builtin_ia32_pause()
+#elif defined(__aarch64__) || defined(__arm__)
+#define CPU_RELAX()   __asm__ __volatile__("yield" ::: "memory")
+#else
+#define CPU_RELAX()   do {} while (0)
+#endif
+
+// A circular buffer, usable as a queue between a single producer (which
+// adds items) and a single consumer (which pops them). They may be in
+// different processes, as long as the buffer is in shared memory.
+//
 // We "waste" one buffer item so that we don't have to maintain a count
-// of items in the buffer
+// of items in the buffer. `front` is only ever written by the consumer,
+// and `back` only by the producer, so they don't need locking - but they
+// do need to be atomic, with release/acquire ordering, so that an item is
+// written before its index is published, and read before its slot is
+// handed back.
+//
+// Each index lives on its own cache line, together with its owner's copy
+// of the *other* index. The copy can only ever be out of date in the safe
+// direction (it makes the buffer look fuller, or emptier, than it really
+// is), so we only need to look at the other side's cache line when the
+// copy says we can't go on.
+//
+// If either side needs to wait for the other, it can sleep on the other
+// side's index (as a futex), having first said it is doing so. The other
+// side only makes the system call to wake it if it has said so, which
+// means that as long as neither side is waiting, there are no system
+// calls at all.
 struct circular_buffer
 {
-  int front;
-  int back;
-  int buffer[BUFFER_SIZE];
+  // Owned by the consumer
+  _Alignas(CACHE_LINE) atomic_int  front;
+  int  cached_back;
+
+  // Owned by the producer
+  _Alignas(CACHE_LINE) atomic_int  back;
+  int  cached_front;
+
+  // Set (rarely) by a side that is about to sleep, read by the other side
+  // every time it changes its index
+  _Alignas(CACHE_LINE) atomic_int  consumer_waiting;
+  atomic_int  producer_waiting;
+
+  _Alignas(CACHE_LINE) int  buffer[BUFFER_SIZE];
 };
 typedef struct circular_buffer *circular_buffer_p;
 #define SIZEOF_CIRCULAR_BUFFER sizeof(struct circular_buffer)
 
 /*
  * Initialise our buffer
+ *
+ * This must be done before either the producer or consumer start to use it.
  */
 void init_buffer(circular_buffer_p  buf)
 {
-  buf->front = 1;
-  buf->back = 0;
+  atomic_init(&buf->front,1);
+  atomic_init(&buf->back,0);
+  buf->cached_back = 0;
+  buf->cached_front = 1;
+  atomic_init(&buf->consumer_waiting,0);
+  atomic_init(&buf->producer_waiting,0);
+}
+
+/*
+ * Sleep until `*word` is (probably) no longer `value`.
+ *
+ * We may return early, so the caller must always check again.
+ *
+ * Note that we can't use the "private" futex operations, as the buffer
+ * is (normally) shared between processes.
+ */
+static void sleep_on_word(atomic_int  *word,
+                          int          value)
+{
+#if defined(__linux__)
+  long err = syscall(SYS_futex,word,FUTEX_WAIT,value,NULL,NULL,0);
+  if (err == -1 && errno != EAGAIN && errno != EINTR)
+    fprintf(stderr,"### Error waiting on futex: %s\n",strerror(errno));
+#else
+  sched_yield();
+#endif
+}
+
+/*
+ * Wake whoever is sleeping on `*word`
+ */
+static void wake_word(atomic_int  *word)
+{
+#if defined(__linux__)
+  long err = syscall(SYS_futex,word,FUTEX_WAKE,1,NULL,NULL,0);
+  if (err == -1)
+    fprintf(stderr,"### Error waking futex: %s\n",strerror(errno));
+#endif
 }
 
 /*
- * Add a new item to the queue.
+ * Return true if the buffer is empty, false otherwise.
+ *
+ * (If called by anyone other than the consumer, the answer may be out
+ * of date by the time it is returned)
+ */
+int buffer_empty(circular_buffer_p  buf)
+{
+  int front = atomic_load_explicit(&buf->front,memory_order_acquire);
+  int back  = atomic_load_explicit(&buf->back,memory_order_acquire);
+  return (front == (back + 1) % BUFFER_SIZE);
+}
+
+/*
+ * Return true if the buffer is full, false otherwise
+ *
+ * (If called by anyone other than the producer, the answer may be out
+ * of date by the time it is returned)
+ */
+int buffer_full(circular_buffer_p  buf)
+{
+  int front = atomic_load_explicit(&buf->front,memory_order_acquire);
+  int back  = atomic_load_explicit(&buf->back,memory_order_acquire);
+  return ((back + 2) % BUFFER_SIZE == front);
+}
+
+/*
+ * Add a new item to the queue. Only the producer may call this.
  *
  * Returns 0 if it successfully adds the item, 1 if the buffer was full.
  */
 int add_to_buffer(circular_buffer_p  buf,
                   int                item)
 {
-  if (buffer_full(buf))
-    return 1;
+  int back = atomic_load_explicit(&buf->back,memory_order_relaxed);
+  int next = (back + 1) % BUFFER_SIZE;
 
-  buf->back = (buf->back + 1) % BUFFER_SIZE;
-  buf->buffer[buf->back] = item;
+  if ((next + 1) % BUFFER_SIZE == buf->cached_front)
+  {
+    // Apparently full - but the consumer may have moved on since we looked
+    buf->cached_front = atomic_load_explicit(&buf->front,memory_order_acquire);
+    if ((next + 1) % BUFFER_SIZE == buf->cached_front)
+      return 1;
+  }
+
+  buf->buffer[next] = item;
+  atomic_store_explicit(&buf->back,next,memory_order_release);
+
+  // The consumer sets its flag *before* it checks `back` for the last time,
+  // and we check the flag *after* we've changed `back`, so at least one of
+  // us is bound to see what the other did.
+  atomic_thread_fence(memory_order_seq_cst);
+  if (atomic_load_explicit(&buf->consumer_waiting,memory_order_relaxed))
+    wake_word(&buf->back);
 
   return 0;
 }
 
 /*
- * Remove (pop) the oldest item from the queue
+ * Remove (pop) the oldest item from the queue. Only the consumer may call
+ * this.
  *
  * Returns 0 if it successfully retrieves the item, 1 if the buffer was empty.
  */
 int pop_from_buffer(circular_buffer_p  buf,
                     int               *item)
 {
-  if (buffer_empty(buf))
-    return 1;
+  int front = atomic_load_explicit(&buf->front,memory_order_relaxed);
+
+  if (front == (buf->cached_back + 1) % BUFFER_SIZE)
+  {
+    // Apparently empty - but the producer may have moved on since we looked
+    buf->cached_back = atomic_load_explicit(&buf->back,memory_order_acquire);
+    if (front == (buf->cached_back + 1) % BUFFER_SIZE)
+      return 1;
+  }
 
-  *item = buf->buffer[buf->front];
+  *item = buf->buffer[front];
 
   // Not needed for any reason except my printing out
-  buf->buffer[buf->front] = -1;
+  buf->buffer[front] = -1;
+
+  atomic_store_explicit(&buf->front,(front + 1) % BUFFER_SIZE,
+                        memory_order_release);
 
-  buf->front = (buf->front + 1) % BUFFER_SIZE;
+  atomic_thread_fence(memory_order_seq_cst);
+  if (atomic_load_explicit(&buf->producer_waiting,memory_order_relaxed))
+    wake_word(&buf->front);
 
   return 0;
 }
 
 /*
- * Return true if the buffer is empty, false otherwise.
+ * Add a new item to the queue, waiting for room if the buffer is full.
+ * Only the producer may call this.
+ *
+ * If `spin_limit` is greater than zero, then we spin (checking the buffer)
+ * that many times before going to sleep. This costs CPU, but avoids the
+ * system calls to sleep and wake (and the time it takes to be scheduled
+ * again) if the consumer is only a little behind us.
  */
-int buffer_empty(circular_buffer_p  buf)
+void wait_add_to_buffer(circular_buffer_p  buf,
+                        int                item,
+                        int                spin_limit)
 {
-  return (buf->front == (buf->back + 1) % BUFFER_SIZE);
+  int  spins = 0;
+  while (add_to_buffer(buf,item))
+  {
+    int front, back;
+    if (spins < spin_limit)
+    {
+      spins ++;
+      CPU_RELAX();
+      continue;
+    }
+    atomic_store(&buf->producer_waiting,1);
+    front = atomic_load(&buf->front);
+    back  = atomic_load_explicit(&buf->back,memory_order_relaxed);
+    if ((back + 2) % BUFFER_SIZE == front)
+      sleep_on_word(&buf->front,front);
+    atomic_store_explicit(&buf->producer_waiting,0,memory_order_relaxed);
+  }
 }
 
 /*
- * Return true if the buffer is full, false otherwise
+ * Remove (pop) the oldest item from the queue, waiting for one if the
+ * buffer is empty. Only the consumer may call this.
+ *
+ * `spin_limit` is as for wait_add_to_buffer().
  */
-int buffer_full(circular_buffer_p  buf)
+void wait_pop_from_buffer(circular_buffer_p   buf,
+                          int                *item,
+                          int                 spin_limit)
 {
-  return ((buf->back + 2) % BUFFER_SIZE == buf->front);
+  int  spins = 0;
+  while (pop_from_buffer(buf,item))
+  {
+    int front, back;
+    if (spins < spin_limit)
+    {
+      spins ++;
+      CPU_RELAX();
+      continue;
+    }
+    atomic_store(&buf->consumer_waiting,1);
+    back  = atomic_load(&buf->back);
+    front = atomic_load_explicit(&buf->front,memory_order_relaxed);
+    if (front == (back + 1) % BUFFER_SIZE)
+      sleep_on_word(&buf->back,back);
+    atomic_store_explicit(&buf->consumer_waiting,0,memory_order_relaxed);
+  }
 }
 
 /*
@@ -117,8 +300,9 @@ void print_buffer(circular_buffer_p  buf)
  * Test code...
  */
 
-// Ten milliseconds, in nanoseconds
-#define TEN_MS  10000000
+// How many times to spin before going to sleep, when we're waiting for
+// the other side. Zero means go straight to sleep.
+static int spin_limit = 0;
 
 void print_circular_buffer(circular_buffer_p  circular)
 {
@@ -136,45 +320,17 @@ void print_circular_buffer(circular_buffer_p  circular)
 void parent_add_to_buffer(circular_buffer_p  buf,
                           int                item)
 {
-  struct timespec   time = {0,5*TEN_MS};  // The parent can wait longer
-  int  full;
-  // Keep trying until we actually get to put the item into the buffer
-  for (;;)
-  {
-    full = add_to_buffer(buf,item);
-    if (full)
-    {
-      int err;
-      printf("Parent: waiting\n");
-      err = nanosleep(&time,NULL);
-      if (err == -1 && errno == EINVAL)
-        fprintf(stderr,"Parent: bad value for wait time\n");
-    }
-    else
-      break;
-  }
+  if (buffer_full(buf))
+    printf("Parent: waiting\n");
+  wait_add_to_buffer(buf,item,spin_limit);
 }
-
+
 void child_pop_from_buffer(circular_buffer_p   buf,
                            int                *item)
 {
-  struct timespec   time = {0,TEN_MS};  // Aim for about 10ms
-  int  empty;
-  // Keep trying until we actually get to take an item from the buffer
-  for (;;)
-  {
-    empty = pop_from_buffer(buf,item);
-    if (empty)
-    {
-      int err;
-      printf("Child: waiting\n");
-      err = nanosleep(&time,NULL);
-      if (err == -1 && errno == EINVAL)
-        fprintf(stderr,"Child: bad value for wait time\n");
-    }
-    else
-      break;
-  }
+  if (buffer_empty(buf))
+    printf("Child: waiting\n");
+  wait_pop_from_buffer(buf,item,spin_limit);
 }
 
 
@@ -185,6 +341,17 @@ int main(int argc, char **argv)
   circular_buffer_p  bufptr;
   pid_t  pid, result;
 
+  if (argc == 3 && !strcmp(argv[1],"-spin"))
+    spin_limit = atoi(argv[2]);
+  else if (argc != 1)
+  {
+    fprintf(stderr,"Usage: circular [-spin <n>]\n"
+            "\n"
+            "    If '-spin' is given, spin <n> times waiting for the other\n"
+            "    process before going to sleep. The default is not to spin.\n");
+    return 1;
+  }
+
   // Rather than map a file, we'll map anonymous memory
   // BSD supports the MAP_ANON flag as is,
   // Linux (bless it) deprecates MAP_ANON and would prefer us to use
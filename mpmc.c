@@ -0,0 +1,514 @@
+/*
+ * A bounded queue for many producers and many consumers
+ *
+ * circular.c only works with one producer and one consumer. This is the
+ * equivalent for any number of each (for instance, several threads each
+ * receiving from a UDP socket, feeding several threads each writing to a
+ * TCP socket). It is lock-free, after Dmitry Vyukov's bounded MPMC queue:
+ * each slot has a sequence number which says whose turn it is to use it,
+ * so producers (and consumers) only contend with each other to claim a
+ * position, with a single compare-and-swap, and never with the other side.
+ *
+ * Running it compares its throughput with that of an ordinary mutex and
+ * condition variable queue, for various numbers of producers and consumers.
+ *
+ * Author: Tony J. Ibbs <tibs@tonyibbs.co.uk>
+ * Released to the public domain (please be nice to it)
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+
+#include <errno.h>
+#include <string.h>
+
+#include <sys/time.h>   // gettimeofday
+#include <unistd.h>
+
+#include <pthread.h>
+#include <sched.h>      // sched_yield
+#include <stdatomic.h>
+
+#define CACHE_LINE   64  // bytes, on any machine we're likely to care about
+
+// Tell the CPU we're busy-waiting
+#if defined(__x86_64__) || defined(__i386__)
+#define CPU_RELAX()   __builtin_ia32_pause()
+#elif defined(__aarch64__) || defined(__arm__)
+#define CPU_RELAX()   __asm__ __volatile__("yield" ::: "memory")
+#else
+#define CPU_RELAX()   do {} while (0)
+#endif
+
+// A slot in the queue.
+//
+// If `sequence` equals the position a producer is trying to add at, the
+// slot is free for it. If it equals that position plus one, the slot has
+// been filled, and is ready for the consumer trying to pop at that
+// position. Once popped, it is set to the position plus the capacity, which
+// is the position the next producer to get round to it will be using.
+struct mpmc_cell
+{
+  atomic_size_t  sequence;
+  int            item;
+};
+
+struct mpmc_queue
+{
+  // Shared by all the producers
+  _Alignas(CACHE_LINE) atomic_size_t  add_pos;
+
+  // Shared by all the consumers
+  _Alignas(CACHE_LINE) atomic_size_t  pop_pos;
+
+  // Fixed when the queue is created
+  _Alignas(CACHE_LINE) size_t  mask;
+  struct mpmc_cell  *cells;
+};
+typedef struct mpmc_queue *mpmc_queue_p;
+
+/*
+ * Create a new, empty, queue
+ *
+ * - `capacity` is the number of items it can hold. It must be a power
+ *   of two.
+ *
+ * Returns the new queue, or NULL if something went wrong.
+ */
+mpmc_queue_p new_mpmc_queue(size_t  capacity)
+{
+  mpmc_queue_p  queue;
+  size_t        ii;
+
+  if (capacity < 2 || (capacity & (capacity - 1)) != 0)
+  {
+    fprintf(stderr,"### Queue capacity %zu is not a power of two\n",capacity);
+    return NULL;
+  }
+
+  queue = aligned_alloc(CACHE_LINE,sizeof(struct mpmc_queue));
+  if (queue == NULL)
+  {
+    fprintf(stderr,"### Unable to allocate queue\n");
+    return NULL;
+  }
+  // (aligned_alloc wants a whole number of alignments)
+  queue->cells = aligned_alloc(CACHE_LINE,
+                               (capacity*sizeof(struct mpmc_cell) + CACHE_LINE - 1)
+                               & ~(size_t)(CACHE_LINE - 1));
+  if (queue->cells == NULL)
+  {
+    fprintf(stderr,"### Unable to allocate %zu queue slots\n",capacity);
+    free(queue);
+    return NULL;
+  }
+
+  for (ii = 0; ii < capacity; ii++)
+    atomic_init(&queue->cells[ii].sequence,ii);
+  atomic_init(&queue->add_pos,0);
+  atomic_init(&queue->pop_pos,0);
+  queue->mask = capacity - 1;
+  return queue;
+}
+
+/*
+ * Tidy up a queue when it is no longer needed.
+ */
+void free_mpmc_queue(mpmc_queue_p  queue)
+{
+  if (queue == NULL)
+    return;
+  free(queue->cells);
+  free(queue);
+}
+
+/*
+ * Add a new item to the queue. Any thread may call this.
+ *
+ * Returns 0 if it successfully adds the item, 1 if the queue was full.
+ */
+int add_to_queue(mpmc_queue_p  queue,
+                 int           item)
+{
+  struct mpmc_cell  *cell;
+  size_t  pos = atomic_load_explicit(&queue->add_pos,memory_order_relaxed);
+
+  for (;;)
+  {
+    size_t    seq;
+    intptr_t  diff;
+    cell = &queue->cells[pos & queue->mask];
+    seq  = atomic_load_explicit(&cell->sequence,memory_order_acquire);
+    diff = (intptr_t)seq - (intptr_t)pos;
+    if (diff == 0)
+    {
+      // The slot is free - try to claim it (if we fail, `pos` is updated
+      // to where the other producer left it)
+      if (atomic_compare_exchange_weak_explicit(&queue->add_pos,&pos,pos + 1,
+                                                memory_order_relaxed,
+                                                memory_order_relaxed))
+        break;
+    }
+    else if (diff < 0)
+      return 1;  // Still has an item from last time round - we're full
+    else
+      pos = atomic_load_explicit(&queue->add_pos,memory_order_relaxed);
+  }
+
+  cell->item = item;
+  atomic_store_explicit(&cell->sequence,pos + 1,memory_order_release);
+  return 0;
+}
+
+/*
+ * Remove (pop) the oldest item from the queue. Any thread may call this.
+ *
+ * Returns 0 if it successfully retrieves the item, 1 if the queue was empty.
+ */
+int pop_from_queue(mpmc_queue_p  queue,
+                   int          *item)
+{
+  struct mpmc_cell  *cell;
+  size_t  pos = atomic_load_explicit(&queue->pop_pos,memory_order_relaxed);
+
+  for (;;)
+  {
+    size_t    seq;
+    intptr_t  diff;
+    cell = &queue->cells[pos & queue->mask];
+    seq  = atomic_load_explicit(&cell->sequence,memory_order_acquire);
+    diff = (intptr_t)seq - (intptr_t)(pos + 1);
+    if (diff == 0)
+    {
+      if (atomic_compare_exchange_weak_explicit(&queue->pop_pos,&pos,pos + 1,
+                                                memory_order_relaxed,
+                                                memory_order_relaxed))
+        break;
+    }
+    else if (diff < 0)
+      return 1;  // Not filled yet - we're empty
+    else
+      pos = atomic_load_explicit(&queue->pop_pos,memory_order_relaxed);
+  }
+
+  *item = cell->item;
+  atomic_store_explicit(&cell->sequence,pos + queue->mask + 1,
+                        memory_order_release);
+  return 0;
+}
+
+/*
+ * Return true if the queue is empty, false otherwise.
+ *
+ * (With other threads at work, the answer may be out of date by the time
+ * it is returned)
+ */
+int queue_empty(mpmc_queue_p  queue)
+{
+  size_t  pos = atomic_load_explicit(&queue->pop_pos,memory_order_acquire);
+  size_t  seq = atomic_load_explicit(&queue->cells[pos & queue->mask].sequence,
+                                     memory_order_acquire);
+  return ((intptr_t)seq - (intptr_t)(pos + 1) < 0);
+}
+
+/*
+ * Return true if the queue is full, false otherwise.
+ *
+ * (With other threads at work, the answer may be out of date by the time
+ * it is returned)
+ */
+int queue_full(mpmc_queue_p  queue)
+{
+  size_t  pos = atomic_load_explicit(&queue->add_pos,memory_order_acquire);
+  size_t  seq = atomic_load_explicit(&queue->cells[pos & queue->mask].sequence,
+                                     memory_order_acquire);
+  return ((intptr_t)seq - (intptr_t)pos < 0);
+}
+
+
+
+/*
+ * Test code...
+ *
+ * A conventional queue, protected by a mutex, for comparison
+ */
+
+struct locked_queue
+{
+  pthread_mutex_t  lock;
+  pthread_cond_t   not_empty;
+  pthread_cond_t   not_full;
+  size_t           capacity;
+  size_t           count;
+  size_t           front;
+  int             *items;
+};
+typedef struct locked_queue *locked_queue_p;
+
+static locked_queue_p new_locked_queue(size_t  capacity)
+{
+  locked_queue_p  queue = malloc(sizeof(struct locked_queue));
+  if (queue == NULL)
+    return NULL;
+  queue->items = malloc(capacity*sizeof(int));
+  if (queue->items == NULL)
+  {
+    free(queue);
+    return NULL;
+  }
+  pthread_mutex_init(&queue->lock,NULL);
+  pthread_cond_init(&queue->not_empty,NULL);
+  pthread_cond_init(&queue->not_full,NULL);
+  queue->capacity = capacity;
+  queue->count = 0;
+  queue->front = 0;
+  return queue;
+}
+
+static void free_locked_queue(locked_queue_p  queue)
+{
+  pthread_mutex_destroy(&queue->lock);
+  pthread_cond_destroy(&queue->not_empty);
+  pthread_cond_destroy(&queue->not_full);
+  free(queue->items);
+  free(queue);
+}
+
+static void add_to_locked_queue(locked_queue_p  queue,
+                                int             item)
+{
+  pthread_mutex_lock(&queue->lock);
+  while (queue->count == queue->capacity)
+    pthread_cond_wait(&queue->not_full,&queue->lock);
+  queue->items[(queue->front + queue->count) % queue->capacity] = item;
+  queue->count ++;
+  pthread_cond_signal(&queue->not_empty);
+  pthread_mutex_unlock(&queue->lock);
+}
+
+static int pop_from_locked_queue(locked_queue_p  queue)
+{
+  int  item;
+  pthread_mutex_lock(&queue->lock);
+  while (queue->count == 0)
+    pthread_cond_wait(&queue->not_empty,&queue->lock);
+  item = queue->items[queue->front];
+  queue->front = (queue->front + 1) % queue->capacity;
+  queue->count --;
+  pthread_cond_signal(&queue->not_full);
+  pthread_mutex_unlock(&queue->lock);
+  return item;
+}
+
+/*
+ * The benchmark itself.
+ *
+ * Each producer adds the numbers 0..count-1 to the queue, then each
+ * consumer is sent -1 to tell it to stop. Each consumer adds up what it
+ * receives, so we can check that everything arrived exactly once.
+ */
+
+#define SPIN_LIMIT  100
+
+struct bench
+{
+  int              lock_free;
+  mpmc_queue_p     queue;
+  locked_queue_p   locked;
+  int              count;
+  atomic_llong     total;
+};
+
+static void wait_a_bit(int  spins)
+{
+  if (spins < SPIN_LIMIT)
+    CPU_RELAX();
+  else
+    sched_yield();
+}
+
+static void bench_add(struct bench *bench,
+                      int           item)
+{
+  if (bench->lock_free)
+  {
+    int  spins = 0;
+    while (add_to_queue(bench->queue,item))
+      wait_a_bit(spins++);
+  }
+  else
+    add_to_locked_queue(bench->locked,item);
+}
+
+static int bench_pop(struct bench *bench)
+{
+  int  item;
+  if (bench->lock_free)
+  {
+    int  spins = 0;
+    while (pop_from_queue(bench->queue,&item))
+      wait_a_bit(spins++);
+  }
+  else
+    item = pop_from_locked_queue(bench->locked);
+  return item;
+}
+
+static void *producer(void *arg)
+{
+  struct bench *bench = arg;
+  int  ii;
+  for (ii = 0; ii < bench->count; ii++)
+    bench_add(bench,ii);
+  return NULL;
+}
+
+static void *consumer(void *arg)
+{
+  struct bench *bench = arg;
+  long long     sum = 0;
+  for (;;)
+  {
+    int  item = bench_pop(bench);
+    if (item == -1)
+      break;
+    sum += item;
+  }
+  atomic_fetch_add(&bench->total,sum);
+  return NULL;
+}
+
+/*
+ * Run the benchmark once.
+ *
+ * Returns the number of items per second passed through the queue, or -1
+ * if something went wrong.
+ */
+static double run_bench(struct bench *bench,
+                        int           num_producers,
+                        int           num_consumers)
+{
+  pthread_t      threads[num_producers + num_consumers];
+  struct timeval then;
+  struct timeval now;
+  double         elapsed;
+  long long      expected;
+  int            ii;
+
+  atomic_init(&bench->total,0);
+  gettimeofday(&then,NULL);
+  for (ii = 0; ii < num_consumers; ii++)
+    if (pthread_create(&threads[ii],NULL,consumer,bench) != 0)
+    {
+      fprintf(stderr,"### Unable to start consumer thread\n");
+      return -1;
+    }
+  for (ii = 0; ii < num_producers; ii++)
+    if (pthread_create(&threads[num_consumers+ii],NULL,producer,bench) != 0)
+    {
+      fprintf(stderr,"### Unable to start producer thread\n");
+      return -1;
+    }
+
+  for (ii = 0; ii < num_producers; ii++)
+    pthread_join(threads[num_consumers+ii],NULL);
+  for (ii = 0; ii < num_consumers; ii++)
+    bench_add(bench,-1);
+  for (ii = 0; ii < num_consumers; ii++)
+    pthread_join(threads[ii],NULL);
+  gettimeofday(&now,NULL);
+
+  expected = (long long)num_producers * bench->count * (bench->count - 1) / 2;
+  if (atomic_load(&bench->total) != expected)
+  {
+    fprintf(stderr,"### %s queue, %d producers, %d consumers: total %lld,"
+            " expected %lld\n",(bench->lock_free?"Lock-free":"Locked"),
+            num_producers,num_consumers,atomic_load(&bench->total),expected);
+    return -1;
+  }
+  elapsed = (now.tv_sec - then.tv_sec) + (now.tv_usec - then.tv_usec) / 1e6;
+  return (double)num_producers * bench->count / elapsed;
+}
+
+int main(int argc, char **argv)
+{
+  int           ii;
+  int           max_producers = 4;
+  int           max_consumers = 4;
+  size_t        capacity = 1024;
+  int           num_producers, num_consumers;
+  struct bench  bench;
+
+  bench.count = 1000000;
+
+  ii = 1;
+  while (ii < argc)
+  {
+    if (ii + 1 >= argc)
+    {
+      fprintf(stderr,"### %s needs a value\n",argv[ii]);
+      return 1;
+    }
+    if (!strcmp("-producers",argv[ii]))
+      max_producers = atoi(argv[ii+1]);
+    else if (!strcmp("-consumers",argv[ii]))
+      max_consumers = atoi(argv[ii+1]);
+    else if (!strcmp("-size",argv[ii]))
+      capacity = strtoul(argv[ii+1],NULL,0);
+    else if (!strcmp("-count",argv[ii]))
+      bench.count = atoi(argv[ii+1]);
+    else
+    {
+      fprintf(stderr,
+              "Usage: mpmc [-producers <n>] [-consumers <n>] [-size <n>] [-count <n>]\n"
+              "\n"
+              "    Measures the throughput of a lock-free and a locked queue,\n"
+              "    for 1..<n> producers against 1..<n> consumers (the defaults\n"
+              "    are 4 of each).\n"
+              "\n"
+              "    -size  is the queue capacity, a power of two (default 1024).\n"
+              "    -count is the number of items each producer sends\n"
+              "           (default 1000000).\n");
+      return 1;
+    }
+    ii += 2;
+  }
+  if (max_producers < 1 || max_consumers < 1 || bench.count < 1)
+  {
+    fprintf(stderr,"### Need at least one producer, one consumer and one item\n");
+    return 1;
+  }
+
+  bench.queue = new_mpmc_queue(capacity);
+  if (bench.queue == NULL)
+    return 1;
+  bench.locked = new_locked_queue(capacity);
+  if (bench.locked == NULL)
+  {
+    fprintf(stderr,"### Unable to allocate locked queue\n");
+    return 1;
+  }
+
+  printf("# producers consumers lockfree_items_per_sec locked_items_per_sec\n");
+  for (num_producers = 1; num_producers <= max_producers; num_producers++)
+  {
+    for (num_consumers = 1; num_consumers <= max_consumers; num_consumers++)
+    {
+      double  lock_free_rate, locked_rate;
+      bench.lock_free = 1;
+      lock_free_rate = run_bench(&bench,num_producers,num_consumers);
+      bench.lock_free = 0;
+      locked_rate = run_bench(&bench,num_producers,num_consumers);
+      if (lock_free_rate < 0 || locked_rate < 0)
+        return 1;
+      printf("%d %d %.0f %.0f\n",num_producers,num_consumers,
+             lock_free_rate,locked_rate);
+      fflush(stdout);
+    }
+  }
+
+  free_mpmc_queue(bench.queue);
+  free_locked_queue(bench.locked);
+  return 0;
+}
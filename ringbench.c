@@ -0,0 +1,698 @@
+/*
+ * Benchmarks for a single producer, single consumer ring buffer
+ *
+ * This uses the same scheme as circular.c (release/acquire indices, each on
+ * its own cache line with a cached copy of the other), generalised to
+ * elements of any size and to adding or removing a batch of elements at a
+ * time, and measures
+ *
+ * - throughput: how many elements per second one thread can pass to another
+ * - latency: how long it takes to send a batch to another thread and get it
+ *   back again (through a second ring), as percentiles
+ *
+ * for each combination of element size, capacity, batch size and placement
+ * of the two threads (on the same CPU, on two hyperthreads of the same
+ * core, on two cores of the same socket, or on two sockets).
+ *
+ * The results are written as CSV, one line per combination, so that they
+ * can be kept and compared between versions.
+ *
+ * Author: Tony J. Ibbs <tibs@tonyibbs.co.uk>
+ * Released to the public domain (please be nice to it)
+ */
+
+#if defined(__linux__)
+#define _GNU_SOURCE     // for pthread_setaffinity_np
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+
+#include <errno.h>
+#include <string.h>
+#include <time.h>       // clock_gettime
+#include <unistd.h>
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+
+#define CACHE_LINE   64  // bytes, on any machine we're likely to care about
+
+// Tell the CPU we're busy-waiting
+#if defined(__x86_64__) || defined(__i386__)
+#define CPU_RELAX()   __builtin_ia32_pause()
+#elif defined(__aarch64__) || defined(__arm__)
+#define CPU_RELAX()   __asm__ __volatile__("yield" ::: "memory")
+#else
+#define CPU_RELAX()   do {} while (0)
+#endif
+
+typedef unsigned char byte;
+
+struct spsc_ring
+{
+  // Owned by the consumer
+  _Alignas(CACHE_LINE) atomic_size_t  head;
+  size_t  cached_tail;
+
+  // Owned by the producer
+  _Alignas(CACHE_LINE) atomic_size_t  tail;
+  size_t  cached_head;
+
+  // Fixed when the ring is created
+  _Alignas(CACHE_LINE) size_t  capacity;   // in elements, a power of two
+  size_t  element_size;
+  byte   *data;
+};
+typedef struct spsc_ring *spsc_ring_p;
+
+static spsc_ring_p new_spsc_ring(size_t  capacity,
+                                 size_t  element_size)
+{
+  spsc_ring_p  ring = aligned_alloc(CACHE_LINE,sizeof(struct spsc_ring));
+  if (ring == NULL)
+    return NULL;
+  ring->data = aligned_alloc(CACHE_LINE,
+                             (capacity*element_size + CACHE_LINE - 1)
+                             & ~(size_t)(CACHE_LINE - 1));
+  if (ring->data == NULL)
+  {
+    free(ring);
+    return NULL;
+  }
+  memset(ring->data,0,capacity*element_size);
+  atomic_init(&ring->head,0);
+  atomic_init(&ring->tail,0);
+  ring->cached_tail = 0;
+  ring->cached_head = 0;
+  ring->capacity = capacity;
+  ring->element_size = element_size;
+  return ring;
+}
+
+static void free_spsc_ring(spsc_ring_p  ring)
+{
+  free(ring->data);
+  free(ring);
+}
+
+/*
+ * Copy up to `count` elements from `items` into the ring.
+ *
+ * Returns how many were added (which is 0 if the ring was full).
+ */
+static size_t push_spsc_ring(spsc_ring_p  ring,
+                             const byte  *items,
+                             size_t       count)
+{
+  size_t  tail = atomic_load_explicit(&ring->tail,memory_order_relaxed);
+  size_t  room = ring->capacity - (tail - ring->cached_head);
+  size_t  offset, first;
+
+  if (room < count)
+  {
+    ring->cached_head = atomic_load_explicit(&ring->head,memory_order_acquire);
+    room = ring->capacity - (tail - ring->cached_head);
+    if (room == 0)
+      return 0;
+    if (count > room)
+      count = room;
+  }
+
+  // The batch may wrap around the end of the buffer
+  offset = tail & (ring->capacity - 1);
+  first = ring->capacity - offset;
+  if (first > count)
+    first = count;
+  memcpy(ring->data + offset*ring->element_size,items,first*ring->element_size);
+  memcpy(ring->data,items + first*ring->element_size,
+         (count - first)*ring->element_size);
+
+  atomic_store_explicit(&ring->tail,tail + count,memory_order_release);
+  return count;
+}
+
+/*
+ * Copy up to `count` elements out of the ring into `items`.
+ *
+ * Returns how many were removed (which is 0 if the ring was empty).
+ */
+static size_t pop_spsc_ring(spsc_ring_p  ring,
+                            byte        *items,
+                            size_t       count)
+{
+  size_t  head = atomic_load_explicit(&ring->head,memory_order_relaxed);
+  size_t  avail = ring->cached_tail - head;
+  size_t  offset, first;
+
+  if (avail < count)
+  {
+    ring->cached_tail = atomic_load_explicit(&ring->tail,memory_order_acquire);
+    avail = ring->cached_tail - head;
+    if (avail == 0)
+      return 0;
+    if (count > avail)
+      count = avail;
+  }
+
+  offset = head & (ring->capacity - 1);
+  first = ring->capacity - offset;
+  if (first > count)
+    first = count;
+  memcpy(items,ring->data + offset*ring->element_size,first*ring->element_size);
+  memcpy(items + first*ring->element_size,ring->data,
+         (count - first)*ring->element_size);
+
+  atomic_store_explicit(&ring->head,head + count,memory_order_release);
+  return count;
+}
+
+
+
+/*
+ * Timing and thread placement
+ */
+
+static inline uint64_t now_ns(void)
+{
+  struct timespec  ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// How many times to spin before yielding the CPU, when waiting for the
+// other thread. If both threads are on the same CPU, spinning just wastes
+// our turn, so then we don't.
+#define SPIN_LIMIT  1000
+static int spin_limit = SPIN_LIMIT;
+
+static inline void wait_a_bit(int  *spins)
+{
+  if ((*spins)++ < spin_limit)
+    CPU_RELAX();
+  else
+    sched_yield();
+}
+
+/*
+ * Read an integer from a file in /sys (or return -1 if we can't)
+ */
+static int read_sys_int(const char *format,
+                        int         cpu)
+{
+  char  path[256];
+  int   value = -1;
+  FILE *file;
+  snprintf(path,sizeof(path),format,cpu);
+  file = fopen(path,"r");
+  if (file == NULL)
+    return -1;
+  if (fscanf(file,"%d",&value) != 1)
+    value = -1;
+  fclose(file);
+  return value;
+}
+
+#define CORE_ID    "/sys/devices/system/cpu/cpu%d/topology/core_id"
+#define SOCKET_ID  "/sys/devices/system/cpu/cpu%d/topology/physical_package_id"
+
+// The ways we know of arranging our two threads
+enum layout
+{
+  LAYOUT_NONE,    // let the scheduler decide
+  LAYOUT_SAME,    // both on the same CPU
+  LAYOUT_SMT,     // on two hyperthreads of one core
+  LAYOUT_CORE,    // on two cores of one socket
+  LAYOUT_SOCKET,  // on two sockets
+  NUM_LAYOUTS
+};
+static const char *layout_names[NUM_LAYOUTS] =
+  { "none", "same", "smt", "core", "socket" };
+
+/*
+ * Choose a pair of CPUs for `layout`, starting from the first CPU we're
+ * allowed to use.
+ *
+ * Returns 0 if there is such a pair, 1 if there isn't.
+ */
+static int choose_cpus(enum layout  layout,
+                       int         *cpu_a,
+                       int         *cpu_b)
+{
+#if defined(__linux__)
+  cpu_set_t  allowed;
+  int        first = -1;
+  int        core, socket;
+  int        cpu;
+
+  *cpu_a = *cpu_b = -1;
+  if (layout == LAYOUT_NONE)
+    return 0;
+
+  if (sched_getaffinity(0,sizeof(allowed),&allowed) == -1)
+    return 1;
+  for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+    if (CPU_ISSET(cpu,&allowed))
+    {
+      first = cpu;
+      break;
+    }
+  if (first == -1)
+    return 1;
+  *cpu_a = first;
+  if (layout == LAYOUT_SAME)
+  {
+    *cpu_b = first;
+    return 0;
+  }
+
+  core = read_sys_int(CORE_ID,first);
+  socket = read_sys_int(SOCKET_ID,first);
+  for (cpu = first + 1; cpu < CPU_SETSIZE; cpu++)
+  {
+    int this_core, this_socket;
+    if (!CPU_ISSET(cpu,&allowed))
+      continue;
+    this_core = read_sys_int(CORE_ID,cpu);
+    this_socket = read_sys_int(SOCKET_ID,cpu);
+    if ((layout == LAYOUT_SMT    && this_socket == socket && this_core == core) ||
+        (layout == LAYOUT_CORE   && this_socket == socket && this_core != core) ||
+        (layout == LAYOUT_SOCKET && this_socket != socket))
+    {
+      *cpu_b = cpu;
+      return 0;
+    }
+  }
+  return 1;
+#else
+  *cpu_a = *cpu_b = -1;
+  return (layout != LAYOUT_NONE);
+#endif
+}
+
+static void pin_to_cpu(int  cpu)
+{
+#if defined(__linux__)
+  cpu_set_t  set;
+  int        err;
+  if (cpu < 0)
+    return;
+  CPU_ZERO(&set);
+  CPU_SET(cpu,&set);
+  err = pthread_setaffinity_np(pthread_self(),sizeof(set),&set);
+  if (err)
+    fprintf(stderr,"!!! Warning: unable to pin thread to CPU %d: %s\n",
+            cpu,strerror(err));
+#endif
+}
+
+
+
+/*
+ * The benchmarks
+ */
+
+struct run
+{
+  spsc_ring_p  there;       // from the first thread to the second
+  spsc_ring_p  back;        // and back again (for the latency test)
+  size_t       batch;
+  size_t       count;       // elements for the throughput test
+  size_t       samples;     // round trips for the latency test
+  int          cpu_b;
+  int          failed;
+};
+
+/*
+ * Send `count` elements down `ring`, a batch at a time. Each has its
+ * sequence number in its first few bytes (so elements must be at least
+ * as big as a size_t).
+ */
+static void send_elements(spsc_ring_p  ring,
+                          byte        *items,
+                          size_t       batch,
+                          size_t       count,
+                          size_t       first)
+{
+  size_t  sent = 0;
+  while (sent < count)
+  {
+    size_t  ii;
+    size_t  this_batch = (count - sent < batch ? count - sent : batch);
+    size_t  done = 0;
+    int     spins = 0;
+    for (ii = 0; ii < this_batch; ii++)
+    {
+      size_t  seq = first + sent + ii;
+      memcpy(items + ii*ring->element_size,&seq,sizeof(seq));
+    }
+    while (done < this_batch)
+    {
+      size_t  added = push_spsc_ring(ring,items + done*ring->element_size,
+                                     this_batch - done);
+      if (added == 0)
+        wait_a_bit(&spins);
+      done += added;
+    }
+    sent += this_batch;
+  }
+}
+
+/*
+ * Receive `count` elements from `ring`, a batch at a time, checking their
+ * sequence numbers.
+ *
+ * Returns 0 if all was well, 1 if not.
+ */
+static int receive_elements(spsc_ring_p  ring,
+                            byte        *items,
+                            size_t       batch,
+                            size_t       count,
+                            size_t       first)
+{
+  size_t  received = 0;
+  while (received < count)
+  {
+    size_t  ii;
+    size_t  this_batch = (count - received < batch ? count - received : batch);
+    size_t  got = pop_spsc_ring(ring,items,this_batch);
+    int     spins = 0;
+    while (got == 0)
+    {
+      wait_a_bit(&spins);
+      got = pop_spsc_ring(ring,items,this_batch);
+    }
+    for (ii = 0; ii < got; ii++)
+    {
+      size_t  seq;
+      memcpy(&seq,items + ii*ring->element_size,sizeof(seq));
+      if (seq != first + received + ii)
+      {
+        fprintf(stderr,"### Element %zu arrived as %zu\n",
+                first + received + ii,seq);
+        return 1;
+      }
+    }
+    received += got;
+  }
+  return 0;
+}
+
+static void *throughput_consumer(void *arg)
+{
+  struct run *run = arg;
+  byte       *items = malloc(run->batch * run->there->element_size);
+  pin_to_cpu(run->cpu_b);
+  if (items == NULL)
+  {
+    run->failed = 1;
+    return NULL;
+  }
+  run->failed = receive_elements(run->there,items,run->batch,run->count,0);
+  free(items);
+  return NULL;
+}
+
+static void *latency_echo(void *arg)
+{
+  struct run *run = arg;
+  byte       *items = malloc(run->batch * run->there->element_size);
+  size_t      ii;
+  pin_to_cpu(run->cpu_b);
+  if (items == NULL)
+  {
+    run->failed = 1;
+    return NULL;
+  }
+  for (ii = 0; ii < run->samples; ii++)
+  {
+    if (receive_elements(run->there,items,run->batch,run->batch,ii*run->batch))
+    {
+      run->failed = 1;
+      break;
+    }
+    send_elements(run->back,items,run->batch,run->batch,ii*run->batch);
+  }
+  free(items);
+  return NULL;
+}
+
+static int compare_u64(const void *a,
+                       const void *b)
+{
+  uint64_t  aa = *(const uint64_t *)a;
+  uint64_t  bb = *(const uint64_t *)b;
+  return (aa > bb) - (aa < bb);
+}
+
+/*
+ * Run both tests for one combination, and print the results.
+ *
+ * Returns 0 if all went well, 1 if something went wrong.
+ */
+static int run_one(enum layout  layout,
+                   size_t       element_size,
+                   size_t       capacity,
+                   size_t       batch,
+                   size_t       count,
+                   size_t       samples)
+{
+  struct run  run;
+  pthread_t   thread;
+  byte       *items;
+  uint64_t   *round_trips;
+  uint64_t    start, elapsed;
+  int         cpu_a, cpu_b;
+  size_t      ii;
+
+  if (choose_cpus(layout,&cpu_a,&cpu_b))
+    return 0;  // Not possible on this machine, so just don't report it
+  spin_limit = (layout == LAYOUT_SAME ? 0 : SPIN_LIMIT);
+
+  run.there = new_spsc_ring(capacity,element_size);
+  run.back = new_spsc_ring(capacity,element_size);
+  items = malloc(batch * element_size);
+  round_trips = malloc(samples * sizeof(uint64_t));
+  if (run.there == NULL || run.back == NULL || items == NULL ||
+      round_trips == NULL)
+  {
+    fprintf(stderr,"### Unable to allocate rings of %zu*%zu bytes\n",
+            capacity,element_size);
+    return 1;
+  }
+  run.batch = batch;
+  run.count = count;
+  run.samples = samples;
+  run.cpu_b = cpu_b;
+  run.failed = 0;
+
+  // We are the first thread - but remember where we were allowed to run
+  // before, so we can go back there afterwards
+#if defined(__linux__)
+  cpu_set_t  original;
+  (void) sched_getaffinity(0,sizeof(original),&original);
+#endif
+  pin_to_cpu(cpu_a);
+
+  // Throughput
+  if (pthread_create(&thread,NULL,throughput_consumer,&run) != 0)
+  {
+    fprintf(stderr,"### Unable to start thread\n");
+    return 1;
+  }
+  start = now_ns();
+  send_elements(run.there,items,batch,count,0);
+  pthread_join(thread,NULL);
+  elapsed = now_ns() - start;
+  if (run.failed)
+    return 1;
+
+  // Latency
+  free_spsc_ring(run.there);
+  run.there = new_spsc_ring(capacity,element_size);
+  if (run.there == NULL)
+    return 1;
+  if (pthread_create(&thread,NULL,latency_echo,&run) != 0)
+  {
+    fprintf(stderr,"### Unable to start thread\n");
+    return 1;
+  }
+  for (ii = 0; ii < samples; ii++)
+  {
+    uint64_t  then = now_ns();
+    send_elements(run.there,items,batch,batch,ii*batch);
+    if (receive_elements(run.back,items,batch,batch,ii*batch))
+    {
+      run.failed = 1;
+      break;
+    }
+    round_trips[ii] = now_ns() - then;
+  }
+  pthread_join(thread,NULL);
+  if (run.failed)
+    return 1;
+
+#if defined(__linux__)
+  (void) pthread_setaffinity_np(pthread_self(),sizeof(original),&original);
+#endif
+
+  qsort(round_trips,samples,sizeof(uint64_t),compare_u64);
+  printf("%s,%d,%d,%zu,%zu,%zu,%.0f,%llu,%llu,%llu,%llu\n",
+         layout_names[layout],cpu_a,cpu_b,element_size,capacity,batch,
+         count / (elapsed / 1e9),
+         (unsigned long long)round_trips[samples/2],
+         (unsigned long long)round_trips[samples*99/100],
+         (unsigned long long)round_trips[samples*999/1000],
+         (unsigned long long)round_trips[samples-1]);
+  fflush(stdout);
+
+  free_spsc_ring(run.there);
+  free_spsc_ring(run.back);
+  free(items);
+  free(round_trips);
+  return 0;
+}
+
+/*
+ * Parse a comma separated list of numbers into `values`.
+ *
+ * Returns how many there were, or -1 if they didn't make sense.
+ */
+#define MAX_VALUES  16
+static int parse_list(char    *text,
+                      size_t   values[])
+{
+  int   count = 0;
+  char *ptr = text;
+  while (*ptr && count < MAX_VALUES)
+  {
+    char *end;
+    values[count] = strtoul(ptr,&end,0);
+    if (end == ptr || values[count] == 0 || (*end != ',' && *end != '\0'))
+    {
+      fprintf(stderr,"### Cannot make sense of list '%s'\n",text);
+      return -1;
+    }
+    count ++;
+    ptr = (*end == ',' ? end + 1 : end);
+  }
+  return count;
+}
+
+static void print_usage(void)
+{
+  fprintf(stderr,
+          "Usage: ringbench [<switches>]\n"
+          "\n"
+          "Measures throughput and round trip latency of a single producer,\n"
+          "single consumer ring buffer, between two threads, and writes the\n"
+          "results as CSV.\n"
+          "\n"
+          "  -sizes <n,...>      element sizes in bytes (default 8,64,188,1316)\n"
+          "  -capacities <n,...> ring capacities in elements, powers of two\n"
+          "                      (default 256,4096)\n"
+          "  -batches <n,...>    elements added/removed at a time (default 1,16)\n"
+          "  -layouts <l,...>    where to put the two threads: none (unpinned),\n"
+          "                      same (one CPU), smt (hyperthreads of one core),\n"
+          "                      core (two cores), socket (two sockets).\n"
+          "                      Layouts this machine can't do are skipped.\n"
+          "                      (default none,same,smt,core,socket)\n"
+          "  -count <n>          elements for the throughput test (default 1000000)\n"
+          "  -samples <n>        round trips for the latency test (default 100000)\n"
+          "\n"
+          "Latency is the time to send one batch to the other thread and have\n"
+          "it sent back, in nanoseconds.\n");
+}
+
+int main(int argc, char **argv)
+{
+  size_t  sizes[MAX_VALUES] = {8, 64, 188, 1316};
+  size_t  capacities[MAX_VALUES] = {256, 4096};
+  size_t  batches[MAX_VALUES] = {1, 16};
+  int     use_layout[NUM_LAYOUTS] = {1, 1, 1, 1, 1};
+  int     num_sizes = 4, num_capacities = 2, num_batches = 2;
+  size_t  count = 1000000;
+  size_t  samples = 100000;
+  int     ii, jj, kk, ll;
+
+  ii = 1;
+  while (ii < argc)
+  {
+    if (ii + 1 >= argc)
+    {
+      print_usage();
+      return 1;
+    }
+    if (!strcmp("-sizes",argv[ii]))
+      num_sizes = parse_list(argv[ii+1],sizes);
+    else if (!strcmp("-capacities",argv[ii]))
+      num_capacities = parse_list(argv[ii+1],capacities);
+    else if (!strcmp("-batches",argv[ii]))
+      num_batches = parse_list(argv[ii+1],batches);
+    else if (!strcmp("-count",argv[ii]))
+      count = strtoul(argv[ii+1],NULL,0);
+    else if (!strcmp("-samples",argv[ii]))
+      samples = strtoul(argv[ii+1],NULL,0);
+    else if (!strcmp("-layouts",argv[ii]))
+    {
+      char *name = strtok(argv[ii+1],",");
+      memset(use_layout,0,sizeof(use_layout));
+      for (; name != NULL; name = strtok(NULL,","))
+      {
+        for (jj = 0; jj < NUM_LAYOUTS; jj++)
+          if (!strcmp(name,layout_names[jj]))
+            break;
+        if (jj == NUM_LAYOUTS)
+        {
+          fprintf(stderr,"### Unknown layout '%s'\n",name);
+          return 1;
+        }
+        use_layout[jj] = 1;
+      }
+    }
+    else
+    {
+      print_usage();
+      return 1;
+    }
+    ii += 2;
+  }
+  if (num_sizes < 1 || num_capacities < 1 || num_batches < 1 ||
+      count < 1 || samples < 1)
+  {
+    print_usage();
+    return 1;
+  }
+  for (ii = 0; ii < num_sizes; ii++)
+    if (sizes[ii] < sizeof(size_t))
+    {
+      fprintf(stderr,"### Elements must be at least %zu bytes\n",sizeof(size_t));
+      return 1;
+    }
+  for (ii = 0; ii < num_capacities; ii++)
+    if ((capacities[ii] & (capacities[ii] - 1)) != 0)
+    {
+      fprintf(stderr,"### Capacity %zu is not a power of two\n",capacities[ii]);
+      return 1;
+    }
+
+  printf("layout,cpu_a,cpu_b,element_size,capacity,batch,"
+         "elements_per_sec,rtt_p50_ns,rtt_p99_ns,rtt_p999_ns,rtt_max_ns\n");
+  for (ll = 0; ll < NUM_LAYOUTS; ll++)
+  {
+    if (!use_layout[ll])
+      continue;
+    for (ii = 0; ii < num_sizes; ii++)
+      for (jj = 0; jj < num_capacities; jj++)
+        for (kk = 0; kk < num_batches; kk++)
+        {
+          if (batches[kk] > capacities[jj])
+            continue;
+          if (run_one(ll,sizes[ii],capacities[jj],batches[kk],count,samples))
+            return 1;
+        }
+  }
+  return 0;
+}
@@ -0,0 +1,806 @@
+/*
+ * A circular buffer of packets in named shared memory
+ *
+ * circular.c and bytering.c only work between a parent and its child,
+ * because their memory is anonymous. This puts the buffer in a named
+ * shared memory segment (from shm_open, or a file on hugetlbfs), with a
+ * header describing it, so that unrelated processes can find it by name,
+ * and attach to it while it is in use.
+ *
+ * One process creates the buffer and fills it with datagrams received
+ * over UDP, directly into the shared memory. Another (which may come and
+ * go) attaches to it by name, and reads the datagrams from the same
+ * shared memory, either recording them to a file or checking the packet
+ * numbers put there by udpserve. Nothing goes through loopback sockets,
+ * and nothing is copied between the two processes.
+ *
+ * As with circular.c, there may only be one producer and one consumer
+ * at a time.
+ *
+ * Author: Tony J. Ibbs <tibs@tonyibbs.co.uk>
+ * Released to the public domain (please be nice to it)
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <signal.h>     // kill, to see if a process is still there
+
+#include <sys/mman.h>   // Memory mapping, shm_open
+#include <sys/stat.h>
+#include <sys/statfs.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netdb.h>
+#include <unistd.h>
+
+#include <stdatomic.h>
+
+#if defined(__linux__)
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
+
+#define CACHE_LINE      64  // bytes, on any machine we're likely to care about
+#define TS_PACKET_SIZE  188
+
+typedef unsigned char byte;
+
+// The header at the start of the shared memory says what follows it.
+// If the layout of the header or the slots ever changes, so must the
+// version number.
+#define SHM_RING_MAGIC    0x474E4952  // "RING" when dumped on little-endian
+#define SHM_RING_VERSION  1
+
+// Each slot starts with the length of the datagram in it
+#define SLOT_HEADER       sizeof(uint32_t)
+
+struct shm_ring
+{
+  // Only set (last of all) when the rest of the header is ready
+  atomic_uint  magic;
+  uint32_t     version;
+  uint32_t     header_size;   // sizeof(struct shm_ring), as a sanity check
+  uint32_t     element_size;  // the largest datagram a slot can hold
+  uint64_t     capacity;      // number of slots, a power of two
+  uint64_t     slot_size;     // bytes from one slot to the next
+  uint64_t     map_size;      // total size of the segment
+
+  // Who is using the buffer (0 if nobody)
+  atomic_int   producer_pid;
+  atomic_int   consumer_pid;
+
+  // How many datagrams the producer has had to throw away because the
+  // buffer was full
+  atomic_uint_fast64_t  dropped;
+
+  // Owned by the consumer - the number of slots ever released
+  _Alignas(CACHE_LINE) atomic_uint_fast64_t  head;
+  uint64_t     cached_tail;
+
+  // Owned by the producer - the number of slots ever committed
+  _Alignas(CACHE_LINE) atomic_uint_fast64_t  tail;
+  uint64_t     cached_head;
+
+  // Set by the consumer when it is about to sleep on `tail`
+  _Alignas(CACHE_LINE) atomic_int  consumer_waiting;
+
+  // The slots start on the next cache line
+  _Alignas(CACHE_LINE) byte  slots[];
+};
+typedef struct shm_ring *shm_ring_p;
+
+/*
+ * Return the start of slot `index` (which may be any slot count - it will
+ * be wrapped around the buffer)
+ */
+static inline byte *ring_slot(shm_ring_p  ring,
+                              uint64_t    index)
+{
+  return ring->slots + (index & (ring->capacity - 1)) * ring->slot_size;
+}
+
+/*
+ * Open the named segment.
+ *
+ * A `name` that is just "/" followed by a name is taken to be a POSIX
+ * shared memory object (normally in /dev/shm). Anything else is taken to be
+ * a path to a file, which is how to use a hugetlbfs mount (for instance,
+ * /dev/hugepages/ring).
+ *
+ * Returns the file descriptor, or -1 if something went wrong.
+ */
+static int open_segment(char *name,
+                        int   flags)
+{
+  int fd;
+  if (name[0] == '/' && strchr(name+1,'/') == NULL)
+    fd = shm_open(name,flags,0666);
+  else
+    fd = open(name,flags,0666);
+  if (fd == -1)
+    fprintf(stderr,"### Unable to open shared memory %s: %s\n",
+            name,strerror(errno));
+  return fd;
+}
+
+/*
+ * Return true if process `pid` is still running
+ */
+static int process_alive(int  pid)
+{
+  return (pid != 0 && (kill(pid,0) == 0 || errno == EPERM));
+}
+
+/*
+ * Create a named buffer of packets (or reuse an existing one of the same
+ * shape, if nobody else is producing into it), and become its producer.
+ *
+ * - `name` is the name of the shared memory (see open_segment())
+ * - `capacity` is the number of slots, a power of two
+ * - `element_size` is the largest datagram each slot can hold
+ *
+ * Returns the mapped buffer, or NULL if something went wrong.
+ */
+shm_ring_p create_shm_ring(char     *name,
+                           uint64_t  capacity,
+                           uint32_t  element_size)
+{
+  int            fd;
+  shm_ring_p     ring;
+  struct stat    st;
+  struct statfs  fs;
+  uint64_t       slot_size;
+  uint64_t       map_size;
+
+  if (capacity < 2 || (capacity & (capacity - 1)) != 0)
+  {
+    fprintf(stderr,"### Ring capacity %llu is not a power of two\n",
+            (unsigned long long)capacity);
+    return NULL;
+  }
+
+  fd = open_segment(name,O_RDWR | O_CREAT);
+  if (fd == -1)
+    return NULL;
+
+  // Round everything up so that each slot starts on a cache line, and
+  // the whole is a number of pages (on hugetlbfs, huge pages, which is
+  // what statfs reports as the block size)
+  slot_size = (SLOT_HEADER + element_size + CACHE_LINE - 1) & ~(uint64_t)(CACHE_LINE - 1);
+  map_size = sizeof(struct shm_ring) + capacity * slot_size;
+  if (fstatfs(fd,&fs) == 0 && fs.f_bsize > 0)
+    map_size = (map_size + fs.f_bsize - 1) / fs.f_bsize * fs.f_bsize;
+
+  if (fstat(fd,&st) == 0 && (uint64_t)st.st_size == map_size)
+  {
+    // It already exists, and is the right size - is it the right shape?
+    ring = mmap(NULL,map_size,PROT_READ | PROT_WRITE,MAP_SHARED,fd,0);
+    if (ring != MAP_FAILED &&
+        atomic_load(&ring->magic) == SHM_RING_MAGIC &&
+        ring->version == SHM_RING_VERSION &&
+        ring->header_size == sizeof(struct shm_ring) &&
+        ring->capacity == capacity && ring->element_size == element_size)
+    {
+      int pid = atomic_load(&ring->producer_pid);
+      if (process_alive(pid) && pid != getpid())
+      {
+        fprintf(stderr,"### Shared memory %s already has a producer (pid %d)\n",
+                name,pid);
+        (void) munmap(ring,map_size);
+        close(fd);
+        return NULL;
+      }
+      printf("Reusing existing shared memory %s\n",name);
+      atomic_store(&ring->producer_pid,getpid());
+      close(fd);
+      return ring;
+    }
+    if (ring != MAP_FAILED)
+      (void) munmap(ring,map_size);
+  }
+
+  // Otherwise, start from scratch - but not while anyone is still attached
+  // to the old contents, as shrinking it under them would kill them (with
+  // SIGBUS) when they next touch it
+  if (fstat(fd,&st) == 0 && (uint64_t)st.st_size >= sizeof(struct shm_ring))
+  {
+    ring = mmap(NULL,sizeof(struct shm_ring),PROT_READ,MAP_SHARED,fd,0);
+    if (ring != MAP_FAILED)
+    {
+      int producer = 0, consumer = 0;
+      if (atomic_load(&ring->magic) == SHM_RING_MAGIC &&
+          ring->version == SHM_RING_VERSION &&
+          ring->header_size == sizeof(struct shm_ring))
+      {
+        producer = atomic_load(&ring->producer_pid);
+        consumer = atomic_load(&ring->consumer_pid);
+      }
+      (void) munmap(ring,sizeof(struct shm_ring));
+      if ((process_alive(producer) && producer != getpid()) ||
+          (process_alive(consumer) && consumer != getpid()))
+      {
+        fprintf(stderr,"### Shared memory %s is a different shape, and is"
+                " still in use (producer pid %d, consumer pid %d)\n",
+                name,producer,consumer);
+        close(fd);
+        return NULL;
+      }
+    }
+  }
+
+  if (ftruncate(fd,0) == -1 || ftruncate(fd,map_size) == -1)
+  {
+    fprintf(stderr,"### Unable to set size of shared memory %s to %llu: %s\n",
+            name,(unsigned long long)map_size,strerror(errno));
+    close(fd);
+    return NULL;
+  }
+  ring = mmap(NULL,map_size,PROT_READ | PROT_WRITE,MAP_SHARED,fd,0);
+  close(fd);
+  if (ring == MAP_FAILED)
+  {
+    fprintf(stderr,"### Unable to map shared memory %s: %s\n",
+            name,strerror(errno));
+    return NULL;
+  }
+
+  ring->version = SHM_RING_VERSION;
+  ring->header_size = sizeof(struct shm_ring);
+  ring->element_size = element_size;
+  ring->capacity = capacity;
+  ring->slot_size = slot_size;
+  ring->map_size = map_size;
+  atomic_init(&ring->producer_pid,getpid());
+  atomic_init(&ring->consumer_pid,0);
+  atomic_init(&ring->dropped,0);
+  atomic_init(&ring->head,0);
+  ring->cached_tail = 0;
+  atomic_init(&ring->tail,0);
+  ring->cached_head = 0;
+  atomic_init(&ring->consumer_waiting,0);
+  atomic_store_explicit(&ring->magic,SHM_RING_MAGIC,memory_order_release);
+  return ring;
+}
+
+/*
+ * Attach to an existing named buffer of packets, as its consumer.
+ *
+ * If `skip` is true, start with the next datagram to arrive, rather than
+ * the oldest still in the buffer.
+ *
+ * Returns the mapped buffer, or NULL if something went wrong.
+ */
+shm_ring_p attach_shm_ring(char  *name,
+                           int    skip)
+{
+  int          fd;
+  shm_ring_p   ring;
+  struct stat  st;
+  uint64_t     map_size;
+  int          pid;
+
+  fd = open_segment(name,O_RDWR);
+  if (fd == -1)
+    return NULL;
+
+  if (fstat(fd,&st) == -1 || st.st_size < (off_t)sizeof(struct shm_ring))
+  {
+    fprintf(stderr,"### Shared memory %s is not a packet ring"
+            " (or is not ready yet)\n",name);
+    close(fd);
+    return NULL;
+  }
+
+  ring = mmap(NULL,st.st_size,PROT_READ | PROT_WRITE,MAP_SHARED,fd,0);
+  close(fd);
+  if (ring == MAP_FAILED)
+  {
+    fprintf(stderr,"### Unable to map shared memory %s: %s\n",
+            name,strerror(errno));
+    return NULL;
+  }
+
+  if (atomic_load_explicit(&ring->magic,memory_order_acquire) != SHM_RING_MAGIC)
+  {
+    fprintf(stderr,"### Shared memory %s is not a packet ring"
+            " (or is not ready yet)\n",name);
+    (void) munmap(ring,st.st_size);
+    return NULL;
+  }
+  if (ring->version != SHM_RING_VERSION ||
+      ring->header_size != sizeof(struct shm_ring) ||
+      ring->map_size != (uint64_t)st.st_size)
+  {
+    fprintf(stderr,"### Shared memory %s is a version %u packet ring,"
+            " we only understand version %u\n",
+            name,ring->version,SHM_RING_VERSION);
+    (void) munmap(ring,st.st_size);
+    return NULL;
+  }
+  map_size = ring->map_size;
+
+  pid = atomic_load(&ring->consumer_pid);
+  if (process_alive(pid))
+  {
+    fprintf(stderr,"### Shared memory %s already has a consumer (pid %d)\n",
+            name,pid);
+    (void) munmap(ring,map_size);
+    return NULL;
+  }
+  atomic_store(&ring->consumer_pid,getpid());
+
+  // Since we own `head`, we can safely throw away everything up to
+  // wherever the producer has got to
+  if (skip)
+    atomic_store_explicit(&ring->head,atomic_load(&ring->tail),
+                          memory_order_release);
+  ring->cached_tail = atomic_load_explicit(&ring->head,memory_order_relaxed);
+  return ring;
+}
+
+/*
+ * Stop using a buffer, as its producer (if `producer` is true) or consumer.
+ *
+ * The shared memory itself stays in existence, so it can be attached to
+ * again, until it is unlinked.
+ */
+void detach_shm_ring(shm_ring_p  ring,
+                     int         producer)
+{
+  if (producer)
+    atomic_store(&ring->producer_pid,0);
+  else
+    atomic_store(&ring->consumer_pid,0);
+  (void) munmap(ring,ring->map_size);
+}
+
+/*
+ * Return the next slot for the producer to fill, or NULL if the buffer is
+ * full.
+ *
+ * The datagram should be written starting SLOT_HEADER bytes into the slot,
+ * and then commit_shm_ring() called with its length.
+ */
+byte *reserve_shm_ring(shm_ring_p  ring)
+{
+  uint64_t  tail = atomic_load_explicit(&ring->tail,memory_order_relaxed);
+  if (tail - ring->cached_head >= ring->capacity)
+  {
+    ring->cached_head = atomic_load_explicit(&ring->head,memory_order_acquire);
+    if (tail - ring->cached_head >= ring->capacity)
+      return NULL;
+  }
+  return ring_slot(ring,tail);
+}
+
+#if defined(__linux__)
+/*
+ * The futex word a waiting consumer sleeps on, and the producer wakes it
+ * with - the low half of `tail`, which is all that FUTEX_WAIT can compare.
+ * Futexes are identified by address, so both sides must use this.
+ */
+static uint32_t *tail_futex_word(shm_ring_p  ring)
+{
+  uint32_t *word = (uint32_t *)&ring->tail;
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  word ++;
+#endif
+  return word;
+}
+#endif
+
+/*
+ * Make the slot returned by reserve_shm_ring() visible to the consumer,
+ * containing a datagram of `len` bytes.
+ */
+void commit_shm_ring(shm_ring_p  ring,
+                     uint32_t    len)
+{
+  uint64_t  tail = atomic_load_explicit(&ring->tail,memory_order_relaxed);
+  *(uint32_t *)ring_slot(ring,tail) = len;
+  atomic_store_explicit(&ring->tail,tail + 1,memory_order_release);
+
+  // See circular.c for why this is enough to never miss a sleeping consumer
+  atomic_thread_fence(memory_order_seq_cst);
+  if (atomic_load_explicit(&ring->consumer_waiting,memory_order_relaxed))
+  {
+#if defined(__linux__)
+    (void) syscall(SYS_futex,tail_futex_word(ring),FUTEX_WAKE,1,NULL,NULL,0);
+#endif
+  }
+}
+
+/*
+ * Return the oldest datagram in the buffer (and its length in `len`),
+ * waiting for one if necessary.
+ *
+ * The data remains valid until release_shm_ring() is called.
+ */
+byte *peek_shm_ring(shm_ring_p  ring,
+                    uint32_t   *len)
+{
+  uint64_t  head = atomic_load_explicit(&ring->head,memory_order_relaxed);
+  byte     *slot;
+
+  while (head == ring->cached_tail)
+  {
+    ring->cached_tail = atomic_load_explicit(&ring->tail,memory_order_acquire);
+    if (head != ring->cached_tail)
+      break;
+
+    atomic_store(&ring->consumer_waiting,1);
+    ring->cached_tail = atomic_load(&ring->tail);
+    if (head == ring->cached_tail)
+    {
+#if defined(__linux__)
+      // Only the low half of `tail` is compared, so this may occasionally
+      // wake early
+      uint32_t  expected = (uint32_t)ring->cached_tail;
+      (void) syscall(SYS_futex,tail_futex_word(ring),FUTEX_WAIT,expected,
+                     NULL,NULL,0);
+#else
+      usleep(100);
+#endif
+    }
+    atomic_store_explicit(&ring->consumer_waiting,0,memory_order_relaxed);
+  }
+
+  slot = ring_slot(ring,head);
+  *len = *(uint32_t *)slot;
+  return slot + SLOT_HEADER;
+}
+
+/*
+ * Give the slot of the datagram returned by peek_shm_ring() back to the
+ * producer.
+ */
+void release_shm_ring(shm_ring_p  ring)
+{
+  uint64_t  head = atomic_load_explicit(&ring->head,memory_order_relaxed);
+  atomic_store_explicit(&ring->head,head + 1,memory_order_release);
+}
+
+
+
+/*
+ * The producer and consumer themselves...
+ */
+
+static int udp_listen_socket(char *hostname, int port)
+{
+  struct hostent *hp;
+  int sock;
+  const int one = 1;
+  int multicast;
+  struct sockaddr_in ipaddr;
+
+  printf("Connecting to %s on port %d\n",hostname,port);
+
+  hp = gethostbyname(hostname);
+  if (!hp)
+  {
+    perror(hostname);
+    fprintf(stderr, "Invalid host address");
+    return -1;
+  }
+  memcpy(&ipaddr.sin_addr, hp->h_addr, hp->h_length);
+  ipaddr.sin_family = AF_INET;
+  ipaddr.sin_port = htons(port);
+
+  if ((sock = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP)) == -1)
+  {
+    perror("socket");
+    fprintf(stderr, "Can't create socket");
+    return -1;
+  }
+
+  // Is this a multicast address?
+  multicast =  IN_CLASSD(ntohl(ipaddr.sin_addr.s_addr));
+
+  if (multicast)
+  {
+    printf("Address is multicast\n");
+    if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (char *) &one,
+                   sizeof(one)) < 0)
+    {
+      perror("setsockopt: reuseaddr");
+    }
+  }
+  else
+  {
+    // This is unicast, so address in the URL is not useful
+    // on bind - it needs to specify our local address
+    ipaddr.sin_addr.s_addr = htonl(INADDR_ANY);
+    printf("Address is unicast\n");
+  }
+
+  if (bind(sock, (struct sockaddr *)&ipaddr, sizeof(ipaddr)) < 0)
+  {
+    perror("bind");
+    close(sock);
+    return -1;
+  }
+
+  // For multicast, need to join the group.
+  if (multicast)
+  {
+    struct ip_mreq mreq;
+    mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+    mreq.imr_multiaddr = ipaddr.sin_addr;
+
+    if (setsockopt(sock, IPPROTO_IP, IP_ADD_MEMBERSHIP,
+                   (char *)&mreq, sizeof(mreq)) < 0)
+    {
+      perror("IP_ADD_MEMBERSHIP");
+      close(sock);
+      return -1;
+    }
+  }
+  return sock;
+}
+
+#define REPORT_EVERY  100000
+
+/*
+ * Receive datagrams from `sock` straight into the buffer, forever.
+ *
+ * If the buffer is full, the datagram is thrown away (we can't ask the
+ * sender to wait).
+ */
+static int produce(shm_ring_p  ring,
+                   int         sock)
+{
+  uint64_t  count = 0;
+  byte     *scratch = malloc(ring->element_size);
+  if (scratch == NULL)
+  {
+    fprintf(stderr,"### Unable to allocate receive buffer\n");
+    return 1;
+  }
+
+  for (;;)
+  {
+    ssize_t  len;
+    byte    *slot = reserve_shm_ring(ring);
+    if (slot == NULL)
+    {
+      // Still need to take it off the socket
+      len = recv(sock,scratch,ring->element_size,0);
+      if (len > 0)
+        atomic_fetch_add_explicit(&ring->dropped,1,memory_order_relaxed);
+    }
+    else
+    {
+      len = recv(sock,slot + SLOT_HEADER,ring->element_size,0);
+      if (len > 0)
+        commit_shm_ring(ring,len);
+    }
+    if (len < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      perror("Error in recv");
+      break;
+    }
+
+    if (++count % REPORT_EVERY == 0)
+      printf("%llu datagrams received, %llu dropped because the buffer"
+             " was full\n",(unsigned long long)count,
+             (unsigned long long)atomic_load(&ring->dropped));
+  }
+  free(scratch);
+  return 1;
+}
+
+/*
+ * Read datagrams from the buffer, forever, and either write them to
+ * `output` or (if it is -1) check the packet numbers in them.
+ */
+static int consume(shm_ring_p  ring,
+                   int         output)
+{
+  uint64_t      count = 0;
+  uint64_t      lost = 0;
+  unsigned int  last_packet_number = 0;
+  for (;;)
+  {
+    uint32_t  len;
+    byte     *data = peek_shm_ring(ring,&len);
+
+    if (output != -1)
+    {
+      ssize_t  written = write(output,data,len);
+      if (written != len)
+      {
+        fprintf(stderr,"### Error writing datagram: %s\n",
+                (written == -1 ? strerror(errno) : "short write"));
+        return 1;
+      }
+    }
+    else if (len >= 4)
+    {
+      unsigned int this_packet_number = data[3];
+      this_packet_number = (this_packet_number << 8) | data[2];
+      this_packet_number = (this_packet_number << 8) | data[1];
+      this_packet_number = (this_packet_number << 8) | data[0];
+      if (count > 0 && this_packet_number != last_packet_number + 1)
+        lost += this_packet_number - (last_packet_number + 1);
+      last_packet_number = this_packet_number;
+    }
+    release_shm_ring(ring);
+
+    if (++count % REPORT_EVERY == 0)
+    {
+      printf("%llu datagrams read",(unsigned long long)count);
+      if (output == -1)
+        printf(", %llu packets missing",(unsigned long long)lost);
+      printf(", %llu dropped by producer\n",
+             (unsigned long long)atomic_load(&ring->dropped));
+    }
+  }
+  return 0;
+}
+
+static void print_usage(void)
+{
+  fprintf(stderr,
+          "Usage: shmring -create <name> <host>[:<port>] [-slots <n>] [-mult <mult>]\n"
+          "       shmring -attach <name> [<file>] [-skip]\n"
+          "       shmring -unlink <name>\n"
+          "\n"
+          "    <name> is either /<something> for POSIX shared memory, or the\n"
+          "    path of a file (for instance, on a hugetlbfs mount).\n"
+          "\n"
+          "    -create makes (or reuses) a packet ring called <name>, and fills\n"
+          "    it with UDP datagrams from <host>, <port> defaulting to 88. The\n"
+          "    ring holds <n> datagrams (a power of two, default 4096) of up to\n"
+          "    <mult>*188 bytes (<mult> defaults to 7).\n"
+          "\n"
+          "    -attach reads datagrams from the packet ring called <name>, and\n"
+          "    writes them to <file> or, if no <file> is given, checks the\n"
+          "    packet numbers written by udpserve. If '-skip' is given, it\n"
+          "    starts with the next datagram to arrive, rather than the oldest\n"
+          "    still in the ring.\n"
+          "\n"
+          "    -unlink removes the packet ring called <name>.\n"
+          );
+}
+
+int main(int argc, char **argv)
+{
+  char       *name;
+  shm_ring_p  ring;
+  int         ii;
+  int         result;
+
+  if (argc < 3)
+  {
+    print_usage();
+    return 1;
+  }
+  name = argv[2];
+
+  if (!strcmp(argv[1],"-create"))
+  {
+    char    *hostname = NULL;
+    char    *colon;
+    int      port = 88;
+    long     mult = 7;
+    uint64_t slots = 4096;
+    int      sock;
+
+    for (ii = 3; ii < argc; ii++)
+    {
+      if (!strcmp(argv[ii],"-slots") && ii + 1 < argc)
+        slots = strtoull(argv[++ii],NULL,0);
+      else if (!strcmp(argv[ii],"-mult") && ii + 1 < argc)
+      {
+        mult = atoi(argv[++ii]);
+        if (mult < 1 || mult > 100)
+        {
+          fprintf(stderr,"### Packet size multiplier %s does not make sense\n",
+                  argv[ii]);
+          return 1;
+        }
+      }
+      else if (hostname == NULL)
+        hostname = argv[ii];
+      else
+      {
+        fprintf(stderr,"### Unexpected argument %s\n",argv[ii]);
+        return 1;
+      }
+    }
+    if (hostname == NULL)
+    {
+      print_usage();
+      return 1;
+    }
+    if ((colon = strchr(hostname,':')))
+    {
+      *colon = '\0';
+      port = atoi(colon + 1);
+    }
+
+    ring = create_shm_ring(name,slots,mult*TS_PACKET_SIZE);
+    if (ring == NULL)
+      return 1;
+    printf("Packet ring %s has %llu slots of %ld bytes\n",name,
+           (unsigned long long)slots,mult*TS_PACKET_SIZE);
+
+    sock = udp_listen_socket(hostname,port);
+    if (sock < 0)
+    {
+      detach_shm_ring(ring,1);
+      return 1;
+    }
+    result = produce(ring,sock);
+    close(sock);
+    detach_shm_ring(ring,1);
+    return result;
+  }
+  else if (!strcmp(argv[1],"-attach"))
+  {
+    char *filename = NULL;
+    int   skip = 0;
+    int   output = -1;
+
+    for (ii = 3; ii < argc; ii++)
+    {
+      if (!strcmp(argv[ii],"-skip"))
+        skip = 1;
+      else if (filename == NULL)
+        filename = argv[ii];
+      else
+      {
+        fprintf(stderr,"### Unexpected argument %s\n",argv[ii]);
+        return 1;
+      }
+    }
+
+    ring = attach_shm_ring(name,skip);
+    if (ring == NULL)
+      return 1;
+    printf("Attached to packet ring %s (%llu slots of %u bytes,"
+           " producer pid %d)\n",name,(unsigned long long)ring->capacity,
+           ring->element_size,atomic_load(&ring->producer_pid));
+
+    if (filename)
+    {
+      output = open(filename,O_WRONLY | O_CREAT | O_TRUNC,0666);
+      if (output == -1)
+      {
+        fprintf(stderr,"### Unable to open %s: %s\n",filename,strerror(errno));
+        detach_shm_ring(ring,0);
+        return 1;
+      }
+    }
+    result = consume(ring,output);
+    if (output != -1)
+      close(output);
+    detach_shm_ring(ring,0);
+    return result;
+  }
+  else if (!strcmp(argv[1],"-unlink"))
+  {
+    if (name[0] == '/' && strchr(name+1,'/') == NULL)
+      result = shm_unlink(name);
+    else
+      result = unlink(name);
+    if (result == -1)
+    {
+      fprintf(stderr,"### Unable to remove %s: %s\n",name,strerror(errno));
+      return 1;
+    }
+    return 0;
+  }
+
+  print_usage();
+  return 1;
+}
@@ -0,0 +1,98 @@
+#! /usr/bin/env python3
+"""tcpclients.py -- connect several TCP clients to udp2tcp at once
+
+Some of the clients read as fast as they can, and some connect and then
+never read at all. Each second, the number of bytes each reading client
+got in that second is printed. A slow or stalled client should never
+hold up the others, so if any reading client gets nothing for a whole
+second (after the first), we say so, and exit with status 1.
+
+For instance, with udpserve sending into udp2tcp:
+
+    udpserve 127.0.0.1:5000 -rate 50M
+    udp2tcp 127.0.0.1:5000 8888 7 -ring 200 -zerocopy -zcmin 0 -report 1
+    tcpclients.py 127.0.0.1:8888 -readers 1 -stalled 1 -seconds 5
+"""
+
+import sys
+import time
+import select
+import socket
+
+def print_usage():
+    print("Usage: tcpclients.py <host>:<port> [-readers <n>] [-stalled <n>]"
+          " [-seconds <n>]")
+    print()
+    print("    <n> readers (default 1) read as fast as they can, and <n>")
+    print("    stalled clients (default 1) never read. Runs for <n> seconds")
+    print("    (default 5).")
+
+def main(args):
+    readers = 1
+    stalled = 1
+    seconds = 5
+    address = None
+
+    while args:
+        word = args.pop(0)
+        if word in ("-readers", "-stalled", "-seconds") and args:
+            value = int(args.pop(0))
+            if word == "-readers":
+                readers = value
+            elif word == "-stalled":
+                stalled = value
+            else:
+                seconds = value
+        elif address is None and ":" in word:
+            host, port = word.rsplit(":", 1)
+            address = (host, int(port))
+        else:
+            print_usage()
+            return 1
+    if address is None or readers < 1:
+        print_usage()
+        return 1
+
+    # Connect the stalled clients first, so they're the oldest
+    idle = []
+    for ii in range(stalled):
+        sock = socket.create_connection(address)
+        sock.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 4096)
+        idle.append(sock)
+    active = [socket.create_connection(address) for ii in range(readers)]
+    for sock in active:
+        sock.setblocking(False)
+
+    ok = True
+    start = time.time()
+    for second in range(seconds):
+        counts = [0] * readers
+        end = start + second + 1
+        while True:
+            left = end - time.time()
+            if left <= 0:
+                break
+            ready, _, _ = select.select(active, [], [], left)
+            for sock in ready:
+                try:
+                    data = sock.recv(1 << 20)
+                except BlockingIOError:
+                    continue
+                if not data:
+                    print("Reader %d was disconnected" % active.index(sock))
+                    return 1
+                counts[active.index(sock)] += len(data)
+        print("Second %d: %s" % (second + 1,
+                                 " ".join("%d" % count for count in counts)))
+        if second > 0 and 0 in counts:
+            ok = False
+
+    for sock in active + idle:
+        sock.close()
+    if not ok:
+        print("### A reading client got nothing for a whole second")
+        return 1
+    return 0
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv[1:]))
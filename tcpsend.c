@@ -10,6 +10,7 @@
 #include <sys/uio.h>
 #include <sys/wait.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>   // TCP_NODELAY
 #include <netdb.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -18,15 +19,845 @@
 #include <time.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#if defined(__linux__)
+#include <sys/sendfile.h>
+#include <linux/errqueue.h>   // struct sock_extended_err
+#endif
 
 #define TRUE    1
 #define FALSE   0
 #define BUFFER_SIZE 1500
 
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+#ifndef SO_EE_ORIGIN_ZEROCOPY
+#define SO_EE_ORIGIN_ZEROCOPY 5
+#endif
+#ifndef SO_EE_CODE_ZEROCOPY_COPIED
+#define SO_EE_CODE_ZEROCOPY_COPIED 1
+#endif
+#ifndef SO_MAX_PACING_RATE
+#define SO_MAX_PACING_RATE 47
+#endif
+
 #define DEBUG_PUTC(x)       {if (dotty){putc(x,stdout);fflush(stdout);}}
 
 typedef unsigned char byte;
 
+/*
+ * Zero copy sending
+ *
+ * With MSG_ZEROCOPY, the kernel sends straight from our buffer, rather
+ * than copying it first, so we mustn't change the buffer until it tells
+ * us (on the socket's error queue) that it has finished with it. Each
+ * zero copy send is given the next of a sequence of ids, and the kernel
+ * reports ranges of ids as done - usually, but not always, in order.
+ *
+ * So we read the file into a small pool of large buffers, each of which
+ * is busy until all the sends from it (more than one, if the socket took
+ * it a piece at a time) are done. Setting up zero copy isn't free, so
+ * reads smaller than `threshold` are sent normally.
+ */
+#define ZC_BUFFERS      8
+#define ZC_BUFFER_SIZE  (256*1024)
+#define ZC_MIN_DEFAULT  (16*1024)
+
+struct zc_buffer
+{
+  byte          *data;
+  int            busy;
+  unsigned int   first;   // ids of the sends from it
+  unsigned int   last;
+  int            outstanding;   // how many of those aren't done yet
+};
+
+struct zerocopy
+{
+  int               enabled;
+  int               threshold;
+  unsigned int      next_id;          // the id the kernel will give our next send
+  struct zc_buffer  buffers[ZC_BUFFERS];
+  int               next_buffer;
+  unsigned long     sends;            // with MSG_ZEROCOPY
+  unsigned long     copies;           // without (too small, or ENOBUFS)
+  unsigned long     completions;
+  unsigned long     kernel_copied;    // the kernel had to copy after all
+};
+
+/*
+ * Ask for zero copy sending on socket `conn`.
+ *
+ * Returns 0 if all went well, 1 if something went wrong.
+ */
+static int enable_zerocopy(int              conn,
+                           struct zerocopy *zc)
+{
+  const int one = 1;
+  int       ii;
+  if (setsockopt(conn,SOL_SOCKET,SO_ZEROCOPY,&one,sizeof(one)) < 0)
+  {
+    printf("Unable to enable SO_ZEROCOPY: %s\n",strerror(errno));
+    return 1;
+  }
+  for (ii = 0; ii < ZC_BUFFERS; ii++)
+  {
+    zc->buffers[ii].data = malloc(ZC_BUFFER_SIZE);
+    if (zc->buffers[ii].data == NULL)
+    {
+      printf("Unable to allocate zero copy buffers\n");
+      return 1;
+    }
+    zc->buffers[ii].busy = FALSE;
+  }
+  return 0;
+}
+
+/*
+ * Is the kernel still using any of our buffers?
+ */
+static int zc_busy(struct zerocopy *zc)
+{
+  int  ii;
+  for (ii = 0; ii < ZC_BUFFERS; ii++)
+    if (zc->buffers[ii].busy)
+      return TRUE;
+  return FALSE;
+}
+
+/*
+ * Collect any zero copy completions from the socket's error queue, and
+ * mark the buffers they were for as free. If `wait`, and any buffers are
+ * still busy, wait until there is at least one.
+ *
+ * Returns 0 if all went well, 1 if something went wrong.
+ */
+static int read_completions(int              conn,
+                            struct zerocopy *zc,
+                            int              wait)
+{
+#if defined(__linux__)
+  int  got = 0;
+  int  hung_up = FALSE;
+  for (;;)
+  {
+    char            control[CMSG_SPACE(sizeof(struct sock_extended_err)) +
+                            CMSG_SPACE(sizeof(struct sockaddr_in))];
+    struct msghdr   msg;
+    struct cmsghdr *cmsg;
+
+    memset(&msg,0,sizeof(msg));
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if (recvmsg(conn,&msg,MSG_ERRQUEUE | MSG_DONTWAIT) == -1)
+    {
+      struct pollfd  pfd = { conn, 0, 0 };   // POLLERR is always asked for
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+      {
+        printf("Error reading socket error queue: %s\n",strerror(errno));
+        return 1;
+      }
+      if (!wait || got || !zc_busy(zc))
+        return 0;
+      if (hung_up)
+      {
+        printf("Connection closed with zero copy sends still outstanding\n");
+        return 1;
+      }
+      if (poll(&pfd,1,-1) == -1)
+      {
+        if (errno == EINTR)
+          continue;
+        printf("Error in poll: %s\n",strerror(errno));
+        return 1;
+      }
+      if (pfd.revents & POLLERR)
+      {
+        // Either a completion has just arrived, or the socket itself has
+        // an error - which would otherwise have us spinning here for ever
+        int        err = 0;
+        socklen_t  len = sizeof(err);
+        if (getsockopt(conn,SOL_SOCKET,SO_ERROR,&err,&len) == 0 && err != 0)
+        {
+          printf("Error on socket: %s\n",strerror(err));
+          return 1;
+        }
+      }
+      if (pfd.revents & POLLHUP)
+        hung_up = TRUE;   // look at the error queue once more, then give up
+      continue;
+    }
+
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg,cmsg))
+    {
+      struct sock_extended_err *err;
+      unsigned int              lo, hi;
+      int                       ii;
+      if (cmsg->cmsg_level != IPPROTO_IP || cmsg->cmsg_type != IP_RECVERR)
+        continue;
+      err = (struct sock_extended_err *)CMSG_DATA(cmsg);
+      if (err->ee_origin != SO_EE_ORIGIN_ZEROCOPY || err->ee_errno != 0)
+        continue;
+      // Ids `lo` to `hi` (inclusive, and maybe wrapping round) are done
+      lo = err->ee_info;
+      hi = err->ee_data;
+      zc->completions += hi - lo + 1;
+      if (err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+        zc->kernel_copied += hi - lo + 1;
+      for (ii = 0; ii < ZC_BUFFERS; ii++)
+      {
+        struct zc_buffer *buffer = &zc->buffers[ii];
+        unsigned int      id;
+        if (!buffer->busy)
+          continue;
+        for (id = buffer->first; id != buffer->last + 1; id++)
+          if (id - lo <= hi - lo)
+            buffer->outstanding --;
+        if (buffer->outstanding == 0)
+          buffer->busy = FALSE;
+      }
+      got ++;
+    }
+  }
+#else
+  return 0;
+#endif
+}
+
+/*
+ * Get the next buffer to read into, waiting for the kernel to finish with
+ * it if necessary.
+ *
+ * Returns the buffer, or NULL if something went wrong.
+ */
+static struct zc_buffer *zc_next_buffer(int              conn,
+                                        struct zerocopy *zc)
+{
+  struct zc_buffer *buffer = &zc->buffers[zc->next_buffer];
+  while (buffer->busy)
+  {
+    if (read_completions(conn,zc,TRUE))
+      return NULL;
+  }
+  zc->next_buffer = (zc->next_buffer + 1) % ZC_BUFFERS;
+  return buffer;
+}
+
+/*
+ * Send `length` bytes from `buffer`, with zero copy if there are enough of
+ * them.
+ *
+ * Returns 0 if all went well, 1 if something went wrong.
+ */
+static int zc_send(int               conn,
+                   struct zerocopy  *zc,
+                   struct zc_buffer *buffer,
+                   ssize_t           length)
+{
+  int      flags = (length >= zc->threshold ? MSG_ZEROCOPY : 0);
+  ssize_t  sent = 0;
+  while (sent < length)
+  {
+    ssize_t  result = send(conn,buffer->data + sent,length - sent,flags);
+    if (result == -1)
+    {
+      if (errno == EINTR)
+        continue;
+      if (errno == ENOBUFS && flags)
+      {
+        // Too much is waiting to complete, so just copy this one
+        flags = 0;
+        continue;
+      }
+      printf("Error writing to socket: %s\n",strerror(errno));
+      return 1;
+    }
+    sent += result;
+    if (flags)
+    {
+      if (!buffer->busy)
+      {
+        buffer->first = zc->next_id;
+        buffer->outstanding = 0;
+        buffer->busy = TRUE;
+      }
+      buffer->last = zc->next_id++;
+      buffer->outstanding ++;
+      zc->sends ++;
+    }
+    else
+      zc->copies ++;
+  }
+  return read_completions(conn,zc,FALSE);
+}
+
+static void report_zerocopy(struct zerocopy *zc)
+{
+  printf("Zero copy: %lu sends (%lu completed, %lu of them copied by the"
+         " kernel after all), %lu sends copied\n",
+         zc->sends,zc->completions,zc->kernel_copied,zc->copies);
+}
+
+/*
+ * Sending regular files
+ *
+ * For a regular file, sendfile() has the kernel pass the data straight
+ * from the page cache to the socket, in chunks as large as we like, which
+ * is very much cheaper than reading it 1500 bytes at a time and writing
+ * each lump back out again.
+ */
+#define SENDFILE_CHUNK  (4*1024*1024)
+
+/*
+ * Can we use sendfile() to send file `fd`?
+ */
+static int can_sendfile(int  fd)
+{
+#if defined(__linux__)
+  struct stat  st;
+  return (fstat(fd,&st) == 0 && S_ISREG(st.st_mode));
+#else
+  return FALSE;
+#endif
+}
+
+/*
+ * Send (up to) the next SENDFILE_CHUNK bytes of file `fd` over `conn`.
+ *
+ * Returns the number of bytes sent, 0 at the end of the file, or -1 if
+ * something went wrong (including, for a non-blocking socket, EAGAIN).
+ */
+static ssize_t sendfile_chunk(int  conn,
+                              int  fd)
+{
+#if defined(__linux__)
+  return sendfile(conn,fd,NULL,SENDFILE_CHUNK);
+#else
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+
+static double seconds_since(struct timespec *start)
+{
+  struct timespec  now;
+  clock_gettime(CLOCK_MONOTONIC,&now);
+  return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void report_rate(long long        total,
+                        struct timespec *start)
+{
+  double  elapsed = seconds_since(start);
+  printf("Sent %lld bytes in %.3f seconds (%.1f Mbit/s)\n",total,elapsed,
+         (elapsed > 0 ? total * 8 / elapsed / 1e6 : 0.0));
+}
+
+/*
+ * Looping
+ *
+ * To play a file over and over again, we map it into memory once, and
+ * send it from there, so it is only read from disk the first time round.
+ * When a send reaches the end of the file, it carries straight on from
+ * the start again (the second part of the same sendmsg), so there is no
+ * gap, or extra system call, at the join.
+ */
+#define LOOP_CHUNK  (1024*1024)
+
+struct looper
+{
+  byte            *data;
+  size_t           size;
+  size_t           pos;       // of the next byte to send
+  long             loops;     // how many times to send it, 0 for ever
+  long             done;      // how many times it has been sent
+  struct timespec  started;   // this time round
+};
+
+/*
+ * Map file `fd` into memory, ready to send it repeatedly.
+ *
+ * Returns 0 if all went well, 1 if something went wrong.
+ */
+static int map_file(int            fd,
+                    char          *filename,
+                    struct looper *loop)
+{
+  struct stat  st;
+  int          flags = MAP_PRIVATE;
+  if (fstat(fd,&st) == -1 || !S_ISREG(st.st_mode))
+  {
+    printf("Can only loop a regular file, and '%s' is not one\n",filename);
+    return 1;
+  }
+  if (st.st_size == 0)
+  {
+    printf("Cannot loop '%s' as it is empty\n",filename);
+    return 1;
+  }
+#ifdef MAP_POPULATE
+  flags |= MAP_POPULATE;   // read it all in now, not on the first loop
+#endif
+  loop->data = mmap(NULL,st.st_size,PROT_READ,flags,fd,0);
+  if (loop->data == MAP_FAILED)
+  {
+    printf("Unable to map '%s' into memory: %s\n",filename,strerror(errno));
+    return 1;
+  }
+  loop->size = st.st_size;
+  loop->pos = 0;
+  loop->done = 0;
+  return 0;
+}
+
+/*
+ * Move on `length` bytes through a looping file, and report each time we
+ * get to the end of it.
+ */
+static void loop_advance(struct looper *loop,
+                         size_t         length)
+{
+  loop->pos += length;
+  while (loop->pos >= loop->size)
+  {
+    double  elapsed = seconds_since(&loop->started);
+    loop->pos -= loop->size;
+    loop->done ++;
+    printf("Loop %ld: sent %zu bytes in %.3f seconds (%.1f Mbit/s)\n",
+           loop->done,loop->size,elapsed,
+           (elapsed > 0 ? loop->size * 8 / elapsed / 1e6 : 0.0));
+    fflush(stdout);
+    clock_gettime(CLOCK_MONOTONIC,&loop->started);
+  }
+}
+
+/*
+ * Send (up to) the next LOOP_CHUNK bytes of a looping file over `conn`,
+ * wrapping round to its start as necessary, and report each time we
+ * finish sending the whole file.
+ *
+ * Returns the number of bytes sent, 0 when it has been sent as many times
+ * as requested, or -1 if something went wrong (including, for a
+ * non-blocking socket, EAGAIN).
+ */
+static ssize_t loop_chunk(int            conn,
+                          struct looper *loop)
+{
+  struct iovec   iov[2];
+  struct msghdr  msg;
+  size_t         first = loop->size - loop->pos;
+  ssize_t        sent;
+
+  if (loop->loops && loop->done >= loop->loops)
+    return 0;
+
+  memset(&msg,0,sizeof(msg));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = 1;
+  if (first > LOOP_CHUNK)
+    first = LOOP_CHUNK;
+  iov[0].iov_base = loop->data + loop->pos;
+  iov[0].iov_len = first;
+  if (first < LOOP_CHUNK && (loop->loops == 0 || loop->done + 1 < loop->loops))
+  {
+    // Carry straight on with the start of the next time round
+    iov[1].iov_base = loop->data;
+    iov[1].iov_len = LOOP_CHUNK - first;
+    if (iov[1].iov_len > loop->size)
+      iov[1].iov_len = loop->size;
+    msg.msg_iovlen = 2;
+  }
+
+  sent = sendmsg(conn,&msg,0);
+  if (sent == -1)
+    return -1;
+
+  loop_advance(loop,sent);
+  return sent;
+}
+
+/*
+ * Copy (up to) the next `length` bytes of a looping file into `buffer`,
+ * stopping at the end of the file, so that each time round starts with a
+ * new call.
+ *
+ * Returns the number of bytes copied, or 0 when the file has been sent as
+ * many times as requested.
+ */
+static size_t loop_read(struct looper *loop,
+                        byte          *buffer,
+                        size_t         length)
+{
+  if (loop->loops && loop->done >= loop->loops)
+    return 0;
+  if (length > loop->size - loop->pos)
+    length = loop->size - loop->pos;
+  memcpy(buffer,loop->data + loop->pos,length);
+  loop_advance(loop,length);
+  return length;
+}
+
+/*
+ * Send the whole of file `fd` over `conn` with sendfile - or, if `loop` is
+ * given, send that as many times as it asks for (which may be for ever) -
+ * as fast as the socket will take it.
+ *
+ * Returns 0 if all went well, 1 if something went wrong.
+ */
+static int send_all(int              conn,
+                    int              fd,
+                    struct looper   *loop,
+                    int              dotty,
+                    long long       *total)
+{
+  for (;;)
+  {
+    ssize_t  length = (loop ? loop_chunk(conn,loop) : sendfile_chunk(conn,fd));
+    if (length == 0)
+      return 0;
+    else if (length == -1)
+    {
+      if (errno == EINTR)
+        continue;
+      printf("Error sending file: %s\n",strerror(errno));
+      return 1;
+    }
+    *total += length;
+    DEBUG_PUTC('w');
+  }
+}
+
+/*
+ * Pacing
+ *
+ * To look like a real time encoder, rather than sending as fast as the
+ * socket will take the data, we can send it at a steady bitrate. As in
+ * udpserve, we don't sleep for a fixed time after each send (which drifts),
+ * but work out when each byte *should* go, and sleep until then - or
+ * rather, until a little before then, and spin for the rest, so as not to
+ * be late because of the time it takes to wake up.
+ *
+ * With -rate, byte <n> is due <n>*8/rate seconds after we started.
+ *
+ * With -pcr, we instead use the PCRs (program clock references) in the
+ * transport stream we are sending: each packet containing a PCR goes when
+ * that PCR says, relative to the first, and the bytes between two PCRs go
+ * at the rate the last two PCRs implied. A PCR that goes backwards, or
+ * jumps more than PCR_MAX_GAP ahead (for instance, when -loop gets back to
+ * the start of the file), is a discontinuity, and we just carry on at the
+ * same rate.
+ *
+ * Either way, we always work from an "anchor" - the time a particular byte
+ * was due - and the rate since then. If we get behind (typically because
+ * the receiver isn't keeping up, and the send blocked), we may catch up by
+ * up to PACE_CATCHUP_NS worth of data, but no more, so that being held up
+ * for a while doesn't lead to a huge burst.
+ *
+ * We send the data in chunks of (up to) PACE_CHUNK bytes - seven TS
+ * packets, as would go in a UDP datagram - and with -pcr, each packet with
+ * a PCR starts a new chunk, so that it goes at its proper time.
+ */
+#define TS_PACKET_SIZE   188
+#define PACE_CHUNK       (7*TS_PACKET_SIZE)
+#define PACE_CATCHUP_NS  20000000   // 20ms
+#define PACE_SPIN_NS     50000      // 50us
+#define PCR_HZ           27000000.0
+#define PCR_WRAP         ((1ULL << 33) * 300)
+#define PCR_MAX_GAP      (1 * 27000000ULL)
+
+struct pacer
+{
+  int        enabled;
+  int        pcr;             // pace by the PCRs in the data?
+  double     rate;            // bits/second (for -pcr, as of the last PCR)
+  double     anchor_ns;       // when byte `anchor_byte` was due
+  long long  anchor_byte;
+  long long  bytes;           // how many we've sent
+  long long  late;            // how many times we fell behind
+  // For -pcr
+  int        pcr_pid;         // the PID we take PCRs from, -1 until we know
+  long long  last_pcr;        // the last PCR, in 27MHz ticks, -1 for none
+  long long  pcrs;
+  long long  discontinuities;
+  // The chunk we're sending
+  byte       buffer[PACE_CHUNK];
+  size_t     length;          // how much is in `buffer`
+  size_t     next;            // the next byte to send from it
+  size_t     end;             // the end of the current chunk
+  int        eof;
+  int        error;           // errno, if reading went wrong
+};
+
+static double now_ns(void)
+{
+  struct timespec  ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/*
+ * Wait until (CLOCK_MONOTONIC) time `deadline`, in nanoseconds
+ */
+static void wait_until(double  deadline)
+{
+  if (deadline > now_ns() + PACE_SPIN_NS)
+  {
+    struct timespec  wake;
+    double           when = deadline - PACE_SPIN_NS;
+    wake.tv_sec  = (time_t)(when / 1e9);
+    wake.tv_nsec = (long)(when - wake.tv_sec * 1e9);
+    while (clock_nanosleep(CLOCK_MONOTONIC,TIMER_ABSTIME,&wake,NULL) == EINTR)
+      ;
+  }
+  while (now_ns() < deadline)
+    ;
+}
+
+/*
+ * When byte `byte_num` is due, going by our current anchor and rate.
+ */
+static double pace_due_at(struct pacer *pacer,
+                          long long     byte_num)
+{
+  if (pacer->rate <= 0)   // we don't know yet
+    return pacer->anchor_ns;
+  return pacer->anchor_ns + (byte_num - pacer->anchor_byte) * 8e9 / pacer->rate;
+}
+
+/*
+ * If the TS packet at `packet` has a PCR on the PID we're following,
+ * return it (in 27MHz ticks), otherwise -1.
+ */
+static long long packet_pcr(struct pacer *pacer,
+                            byte         *packet)
+{
+  int        pid = ((packet[1] & 0x1F) << 8) | packet[2];
+  long long  base;
+  if (packet[0] != 0x47 ||          // not a packet start (or not TS)
+      !(packet[3] & 0x20) ||        // no adaptation field
+      packet[4] < 7 ||              // too short to have a PCR
+      !(packet[5] & 0x10))          // no PCR
+    return -1;
+  if (pacer->pcr_pid == -1)
+    pacer->pcr_pid = pid;
+  else if (pid != pacer->pcr_pid)
+    return -1;
+  base = ((long long)packet[6] << 25) | (packet[7] << 17) | (packet[8] << 9) |
+    (packet[9] << 1) | (packet[10] >> 7);
+  return base * 300 + (((packet[10] & 0x01) << 8) | packet[11]);
+}
+
+/*
+ * Move our anchor to the byte `byte_num`, which starts a packet with
+ * PCR `pcr`.
+ */
+static void pace_by_pcr(struct pacer *pacer,
+                        long long     byte_num,
+                        long long     pcr)
+{
+  double  due = pace_due_at(pacer,byte_num);
+  if (pacer->last_pcr != -1)
+  {
+    unsigned long long  ticks = (pcr - pacer->last_pcr + PCR_WRAP) % PCR_WRAP;
+    if (ticks == 0 || ticks > PCR_MAX_GAP)
+      pacer->discontinuities ++;
+    else
+    {
+      due = pacer->anchor_ns + ticks / PCR_HZ * 1e9;
+      pacer->rate = (byte_num - pacer->anchor_byte) * 8 * PCR_HZ / ticks;
+    }
+  }
+  pacer->anchor_ns = due;
+  pacer->anchor_byte = byte_num;
+  pacer->last_pcr = pcr;
+  pacer->pcrs ++;
+}
+
+/*
+ * Read as much of `length` bytes as we can from `fd` - a pipe may give us
+ * less than we asked for, but we want whole TS packets if we can get them.
+ *
+ * Returns the number of bytes read (0 at end of file), or -1 if something
+ * went wrong.
+ */
+static ssize_t read_fully(int     fd,
+                          byte   *buffer,
+                          size_t  length)
+{
+  size_t  got = 0;
+  while (got < length)
+  {
+    ssize_t  count = read(fd,buffer + got,length - got);
+    if (count == 0)
+      break;
+    else if (count == -1)
+    {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    got += count;
+  }
+  return got;
+}
+
+/*
+ * Make sure we have a chunk ready to send, reading more from file `fd`
+ * (or `loop`, if it is not NULL) if necessary, and work out when it is
+ * due.
+ *
+ * Returns the (CLOCK_MONOTONIC) time, in nanoseconds, at which it should
+ * be sent. At the end of the file, or if reading failed, this is 0, so
+ * pace_send() can report that straight away.
+ */
+static double pace_next_due(struct pacer  *pacer,
+                            int            fd,
+                            struct looper *loop)
+{
+  double  due, now;
+
+  if (pacer->eof || pacer->error)
+    return 0;
+  if (pacer->next == pacer->length)
+  {
+    ssize_t  length = (loop ? (ssize_t)loop_read(loop,pacer->buffer,PACE_CHUNK)
+                            : read_fully(fd,pacer->buffer,PACE_CHUNK));
+    if (length <= 0)
+    {
+      pacer->eof = (length == 0);
+      pacer->error = (length == -1 ? errno : 0);
+      return 0;
+    }
+    pacer->length = length;
+    pacer->next = pacer->end = 0;
+  }
+
+  if (pacer->next == pacer->end)
+  {
+    // Start a new chunk, which runs until the next packet with a PCR.
+    // Our buffer always starts with a whole packet (except perhaps after
+    // a partial packet at the end of a looped file, which we can't do
+    // much about)
+    pacer->end = pacer->length;
+    if (pacer->pcr)
+    {
+      size_t  pos;
+      for (pos = pacer->next; pos + TS_PACKET_SIZE <= pacer->length;
+           pos += TS_PACKET_SIZE)
+      {
+        long long  pcr = packet_pcr(pacer,&pacer->buffer[pos]);
+        if (pcr == -1)
+          continue;
+        if (pos > pacer->next)
+        {
+          pacer->end = pos;   // send what comes before it first
+          break;
+        }
+        pace_by_pcr(pacer,pacer->bytes,pcr);
+      }
+    }
+  }
+
+  due = pace_due_at(pacer,pacer->bytes);
+  now = now_ns();
+  if (now > due + PACE_CATCHUP_NS)
+  {
+    // We're further behind than we're allowed to catch up, so pretend
+    // everything is due later than it was
+    pacer->anchor_ns += now - (due + PACE_CATCHUP_NS);
+    due = now - PACE_CATCHUP_NS;
+    pacer->late ++;
+  }
+  return due;
+}
+
+/*
+ * Send (the rest of) the chunk that pace_next_due() prepared - which the
+ * caller should only do when it is due.
+ *
+ * Returns the number of bytes sent, 0 at the end of the file, or -1 if
+ * something went wrong (including, for a non-blocking socket, EAGAIN).
+ */
+static ssize_t pace_send(int           conn,
+                         struct pacer *pacer)
+{
+  ssize_t  sent;
+  if (pacer->error)
+  {
+    errno = pacer->error;
+    return -1;
+  }
+  if (pacer->eof)
+    return 0;
+  sent = send(conn,pacer->buffer + pacer->next,pacer->end - pacer->next,0);
+  if (sent > 0)
+  {
+    pacer->next += sent;
+    pacer->bytes += sent;
+  }
+  return sent;
+}
+
+/*
+ * Ask the kernel to pace the socket (with TCP's own pacing, or the fq
+ * queueing discipline if it is in use) to `rate` bits/second.
+ *
+ * Returns 0 if all went well, 1 if something went wrong.
+ */
+static int set_max_pacing_rate(int     conn,
+                               double  rate)
+{
+  double        bytes = rate / 8;
+  unsigned int  value = (bytes > 0xFFFFFFFE ? 0xFFFFFFFE : (unsigned int)bytes);
+  if (setsockopt(conn,SOL_SOCKET,SO_MAX_PACING_RATE,&value,sizeof(value)) == -1)
+  {
+    printf("Unable to set SO_MAX_PACING_RATE: %s\n",strerror(errno));
+    return 1;
+  }
+  return 0;
+}
+
+static void report_pacer(struct pacer *pacer)
+{
+  if (pacer->pcr)
+    printf("Paced by %lld PCRs on PID 0x%x, %lld discontinuities,"
+           " last rate %.0f bits/second",pacer->pcrs,
+           (pacer->pcr_pid == -1 ? 0 : pacer->pcr_pid),
+           pacer->discontinuities,pacer->rate);
+  else
+    printf("Paced to %.0f bits/second",pacer->rate);
+  if (pacer->late > 0)
+    printf(", fell behind %lld times",pacer->late);
+  printf("\n");
+}
+
+/*
+ * Read a bitrate, which may have a suffix of k, M or G (powers of 1000)
+ *
+ * Returns the rate, or 0 if it doesn't make sense.
+ */
+static double read_rate(char *text)
+{
+  char   *ptr;
+  double  rate = strtod(text,&ptr);
+  switch (*ptr)
+  {
+  case 'k': case 'K': rate *= 1e3; ptr++; break;
+  case 'm': case 'M': rate *= 1e6; ptr++; break;
+  case 'g': case 'G': rate *= 1e9; ptr++; break;
+  default: break;
+  }
+  if (ptr == text || *ptr != '\0' || rate <= 0)
+    return 0;
+  return rate;
+}
+
 static void print_usage(void)
 {
   printf("Usage:\n"
@@ -42,11 +873,34 @@ static void print_usage(void)
          "\n"
          "and <switches> are:\n"
          "\n"
-         "  -loop           loop repeating the file.\n"
+         "  -loop           loop repeating the file (for ever). The file is read\n"
+         "                  into memory once, and must be a regular file.\n"
+         "  -loops <n>      the same, but only send the file <n> times.\n"
          "  -retry          keep trying if connection refused.\n"
          "  -receive <file> read data back over TCP/IP into the named file.\n"
          "  -rx <file>      the same.\n"
          "  -dots           output indicators of packet transfer\n"
+         "  -zerocopy       send with MSG_ZEROCOPY, so the kernel doesn't copy\n"
+         "                  the data (Linux 4.14 or later). The file is read in\n"
+         "                  chunks of %d bytes.\n"
+         "  -zcmin <bytes>  with -zerocopy, chunks smaller than this are copied\n"
+         "                  as normal (the default is %d).\n"
+         "  -nosendfile     read and send the file %d bytes at a time, even if\n"
+         "                  it is a regular file (which would otherwise be sent\n"
+         "                  with sendfile, unless -loop, -zerocopy or -hang is\n"
+         "                  given). -loop ignores -zerocopy and -nosendfile.\n"
+         "\n"
+         "  -rate <bits/s>  send at this steady bitrate (a suffix of k, M or G\n"
+         "                  may be used), rather than as fast as possible.\n"
+         "  -pcr            pace the data by the PCRs in it, which must be a TS.\n"
+         "                  -rate, if given, is used until there are two PCRs.\n"
+         "                  Pacing (-rate or -pcr) ignores -zerocopy and\n"
+         "                  -nosendfile, unless -fq is also given.\n"
+         "  -fq             with -rate, leave the pacing to the kernel, using\n"
+         "                  SO_MAX_PACING_RATE (best with the fq qdisc, for\n"
+         "                  instance 'tc qdisc replace dev eth0 root fq').\n"
+         "                  We then send as we would without -rate, so sendfile,\n"
+         "                  -loop and -zerocopy are used as normal.\n"
          "\n"
          "  -hang           hang (stop sending) after some small number of packets\n"
          "                  - this is intended for use in testing the recipient\n"
@@ -55,15 +909,15 @@ static void print_usage(void)
          "Note that <switches> may actually occur at any position on the\n"
          "command line. For instance:\n"
          "\n"
-         "          tcpsend 10.10.1.98:8888 data.es -rx result.es\n"
-         );
+         "          tcpsend 10.10.1.98:8888 data.es -rx result.es\n",
+         ZC_BUFFER_SIZE,ZC_MIN_DEFAULT,BUFFER_SIZE);
 }
 
 int main(int argc, char **argv)
 {
   int    had_hostname = FALSE;
   int    had_filename = FALSE;
-  char  *hostname;
+  char  *hostname = NULL;
   char  *colon;
   char  *filename = NULL;
   char  *receive_filename = NULL;
@@ -72,9 +926,17 @@ int main(int argc, char **argv)
 
   int    retry_mode = FALSE;
   int    loop_mode = FALSE;
+  struct looper looper = {0};
 
   int    force_hang = FALSE;
 
+  struct zerocopy zc = {0};
+  int    use_sendfile = TRUE;
+  struct pacer pacer = {0};
+  int    kernel_pacing = FALSE;
+  long long total = 0;
+  struct timespec start;
+
   int done;
   struct sockaddr_in addr = {0};
   int conn;	// Socket
@@ -87,6 +949,7 @@ int main(int argc, char **argv)
   struct hostent *hp;
 
   conn = -1;
+  zc.threshold = ZC_MIN_DEFAULT;
 
   if (argc < 2)
   {
@@ -100,6 +963,23 @@ int main(int argc, char **argv)
     {
       loop_mode = TRUE;
     }
+    else if (!strcmp(argv[1], "-loops"))
+    {
+      if (argc < 3)
+      {
+        printf("%s needs a number of times\n",argv[1]);
+        return 1;
+      }
+      looper.loops = atol(argv[2]);
+      if (looper.loops < 1)
+      {
+        printf("Bad -loops value '%s'\n",argv[2]);
+        return 1;
+      }
+      loop_mode = TRUE;
+      argv++;
+      argc--;
+    }
     else if (!strcmp(argv[1], "-retry"))
     {
       retry_mode = TRUE;
@@ -112,6 +992,56 @@ int main(int argc, char **argv)
     {
       force_hang = TRUE;
     }
+    else if (!strcmp(argv[1], "-zerocopy"))
+    {
+      zc.enabled = TRUE;
+    }
+    else if (!strcmp(argv[1], "-nosendfile"))
+    {
+      use_sendfile = FALSE;
+    }
+    else if (!strcmp(argv[1], "-rate"))
+    {
+      if (argc < 3)
+      {
+        printf("%s needs a bitrate\n",argv[1]);
+        return 1;
+      }
+      pacer.rate = read_rate(argv[2]);
+      if (pacer.rate == 0)
+      {
+        printf("Bad -rate value '%s'\n",argv[2]);
+        return 1;
+      }
+      pacer.enabled = TRUE;
+      argv++;
+      argc--;
+    }
+    else if (!strcmp(argv[1], "-pcr"))
+    {
+      pacer.enabled = TRUE;
+      pacer.pcr = TRUE;
+    }
+    else if (!strcmp(argv[1], "-fq"))
+    {
+      kernel_pacing = TRUE;
+    }
+    else if (!strcmp(argv[1], "-zcmin"))
+    {
+      if (argc < 3)
+      {
+        printf("%s needs a number of bytes\n",argv[1]);
+        return 1;
+      }
+      zc.threshold = atoi(argv[2]);
+      if (zc.threshold < 0)
+      {
+        printf("Bad -zcmin value '%s'\n",argv[2]);
+        return 1;
+      }
+      argv++;
+      argc--;
+    }
     else if (!strcmp(argv[1],"-receive") || !strcmp(argv[1],"-rx"))
     {
       if (argc < 2)
@@ -188,6 +1118,13 @@ int main(int argc, char **argv)
       return 1;
     }
   }
+  if (loop_mode && map_file(fd,filename,&looper))
+    return 1;
+  if (kernel_pacing && (pacer.rate == 0 || pacer.pcr))
+  {
+    printf("-fq needs -rate, and cannot be used with -pcr\n");
+    return 1;
+  }
 
   if ((conn = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0)
   {
@@ -218,22 +1155,121 @@ int main(int argc, char **argv)
     break;
   }
 
-  printf("Starting send...\n");
+  if (zc.enabled && enable_zerocopy(conn,&zc))
+  {
+    printf("Sending without zero copy\n");
+    zc.enabled = FALSE;
+  }
+
+  if (kernel_pacing)
+  {
+    // The kernel does the pacing, so we can send as fast as we like
+    if (set_max_pacing_rate(conn,pacer.rate))
+    {
+      result = 1;
+      goto giveup;
+    }
+    pacer.enabled = FALSE;
+  }
+  else if (pacer.enabled)
+  {
+    // Don't let TCP hold back our carefully timed sends
+    const int one = 1;
+    if (setsockopt(conn,IPPROTO_TCP,TCP_NODELAY,&one,sizeof(one)) == -1)
+      printf("Unable to set TCP_NODELAY: %s\n",strerror(errno));
+    pacer.pcr_pid = -1;
+    pacer.last_pcr = -1;
+  }
 
-  for (;;)
+  if (loop_mode || pacer.enabled)
+  {
+    zc.enabled = FALSE;
+    use_sendfile = FALSE;
+  }
+  else
+    use_sendfile = (use_sendfile && !zc.enabled && !force_hang &&
+                    can_sendfile(fd));
+
+  if (loop_mode && looper.loops)
+    printf("Starting send, %ld times round...\n",looper.loops);
+  else if (loop_mode)
+    printf("Starting send, looping for ever...\n");
+  else
+    printf("Starting send%s...\n",(use_sendfile?" (with sendfile)":""));
+  if (pacer.pcr)
+    printf("Pacing by the PCRs in %s\n",filename);
+  else if (pacer.enabled || kernel_pacing)
+    printf("Pacing to %.0f bits/second%s\n",pacer.rate,
+           (kernel_pacing?" in the kernel":""));
+  clock_gettime(CLOCK_MONOTONIC,&start);
+  looper.started = start;
+  pacer.anchor_ns = now_ns();
+
+  if ((use_sendfile || loop_mode) && !pacer.enabled &&
+      receive_filename == NULL)
+  {
+    // Nothing to receive, so just send the file as fast as we can
+    if (send_all(conn,fd,(loop_mode?&looper:NULL),dotty,&total))
+    {
+      (void) shutdown(conn,SHUT_WR);
+      return 1;
+    }
+    DEBUG_PUTC('\n');
+    printf("EOF in %s\n",filename);
+    close(fd);
+    filename = NULL;
+    if (shutdown(conn,SHUT_WR) == -1)
+    {
+      printf("Error shutting down write on socket: %s\n",strerror(errno));
+      return 1;
+    }
+  }
+  else if ((use_sendfile || loop_mode || pacer.enabled) && receive_filename)
+  {
+    // Don't let a large send hold up reading what comes back
+    int  flags = fcntl(conn,F_GETFL,0);
+    if (flags == -1 || fcntl(conn,F_SETFL,flags | O_NONBLOCK) == -1)
+    {
+      printf("Error making socket non-blocking: %s\n",strerror(errno));
+      result = 1;
+      goto giveup;
+    }
+  }
+
+  while (filename != NULL || receive_filename != NULL)
   {
     fd_set read_fds, write_fds;
     int    result;
     int    num_to_check = (fd>rxfd?fd:rxfd)+1;
+    int    due = TRUE;
+    struct timeval  timeout, *wait_for = NULL;
+
+    if (pacer.enabled && filename)
+    {
+      // Wait until the next chunk is due - or, if we're also receiving,
+      // let select wait for us (all but the last little bit)
+      double  when = pace_next_due(&pacer,fd,(loop_mode?&looper:NULL));
+      double  wait_ns = when - now_ns();
+      if (receive_filename && wait_ns > PACE_SPIN_NS)
+      {
+        wait_ns -= PACE_SPIN_NS;
+        timeout.tv_sec = (time_t)(wait_ns / 1e9);
+        timeout.tv_usec = (long)((wait_ns - timeout.tv_sec * 1e9) / 1000);
+        wait_for = &timeout;
+        due = FALSE;
+      }
+      else if (wait_ns > 0)
+        wait_until(when);
+    }
 
     FD_ZERO(&read_fds);
     FD_ZERO(&write_fds);
-    if (filename)
+    if (filename && due)
       FD_SET(conn,&write_fds);
     if (receive_filename)
       FD_SET(conn,&read_fds);
 
-    result = select(conn+1,&read_fds,&write_fds,NULL,NULL);
+    result = select(conn+1,&read_fds,&write_fds,NULL,wait_for);
     if (result == -1)
     {
       printf("Error in select: %s\n",strerror(errno));
@@ -246,8 +1282,40 @@ int main(int argc, char **argv)
     if (FD_ISSET(conn,&write_fds))
     {
       int     result;
-      byte    buffer[BUFFER_SIZE];
-      ssize_t length = read(fd,buffer,BUFFER_SIZE);
+      byte    local_buffer[BUFFER_SIZE];
+      byte   *buffer = local_buffer;
+      ssize_t length;
+      struct zc_buffer *zc_buffer = NULL;
+      if (use_sendfile || loop_mode || pacer.enabled)
+      {
+        if (pacer.enabled)
+          length = pace_send(conn,&pacer);
+        else if (loop_mode)
+          length = loop_chunk(conn,&looper);
+        else
+          length = sendfile_chunk(conn,fd);
+        if (length == -1 && (errno == EAGAIN || errno == EWOULDBLOCK ||
+                             errno == EINTR))
+          length = -2;  // try again next time round
+        else if (length > 0)
+        {
+          total += length;
+          DEBUG_PUTC('w');
+        }
+      }
+      else if (zc.enabled)
+      {
+        zc_buffer = zc_next_buffer(conn,&zc);
+        if (zc_buffer == NULL)
+        {
+          (void) shutdown(conn,SHUT_WR);
+          return 1;
+        }
+        buffer = zc_buffer->data;
+        length = read(fd,buffer,ZC_BUFFER_SIZE);
+      }
+      else
+        length = read(fd,buffer,BUFFER_SIZE);
       if (length == 0)
       {
         DEBUG_PUTC('\n');
@@ -264,11 +1332,26 @@ int main(int argc, char **argv)
       }
       else if (length == -1)
       {
-        printf("Error reading from file: %s\n",strerror(errno));
+        printf("Error %s file: %s\n",
+               (use_sendfile || loop_mode || pacer.enabled ?
+                "sending" : "reading from"),
+               strerror(errno));
         (void) shutdown(conn,SHUT_WR);
         return 1;
       }
-      if (length > 0)
+      if (length > 0 && (use_sendfile || loop_mode || pacer.enabled))
+        ;  // already sent
+      else if (length > 0 && zc.enabled)
+      {
+        if (zc_send(conn,&zc,zc_buffer,length))
+        {
+          (void) shutdown(conn,SHUT_WR);
+          return 1;
+        }
+        total += length;
+        DEBUG_PUTC('w');
+      }
+      else if (length > 0)
       {
         result = send(conn,buffer,length,0);
         if (result == -1)
@@ -277,6 +1360,7 @@ int main(int argc, char **argv)
           (void) shutdown(conn,SHUT_WR);
           return 1;
         }
+        total += length;
         DEBUG_PUTC('w');
       }
 
@@ -333,6 +1417,17 @@ int main(int argc, char **argv)
       break;
   }
   DEBUG_PUTC('\n');
+  report_rate(total,&start);
+  if (pacer.enabled)
+    report_pacer(&pacer);
+  if (zc.enabled)
+  {
+    // Wait for the kernel to finish with everything we've sent
+    for (i = 0; i < ZC_BUFFERS; i++)
+      while (zc.buffers[i].busy && !read_completions(conn,&zc,TRUE))
+        ;
+    report_zerocopy(&zc);
+  }
   printf("Finished\n");
 
 giveup:
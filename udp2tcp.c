@@ -13,8 +13,26 @@
 #include <sys/types.h>  // Posix standard primitive system data types
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/udp.h> // UDP_GRO
 #include <netdb.h>
 #include <unistd.h>      // open, close
+#include <fcntl.h>
+#include <time.h>
+#include <arpa/inet.h>   // inet_ntoa
+#include <sys/uio.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <linux/errqueue.h>   // struct sock_extended_err
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#else
+#include <poll.h>
+#endif
 
 // C99 also defines equivalent types in <stdint.h>, but the unsigned types
 // are spelt uint8_t, etc., instead of u_int8_t. Given the need to support
@@ -30,46 +48,47 @@ typedef int64_t  int64;
 #define SOCKET int
 #define TS_PACKET_SIZE 188
 
-/*
- * Write data out to a socket
- *
- * - `output` is a socket for our output
- * - `data` is the data to write out
- * - `data_len` is how much of it there is
- *
- * Returns 0 if all went well, 1 if something went wrong.
- */
-static int write_socket_data(SOCKET output,
-                             byte   data[],
-                             int    data_len)
+#ifndef __linux__
+// Without epoll, the server uses poll() instead (see watch and wait_events),
+// with the same names for what it's waiting for
+#define EPOLLIN       POLLIN
+#define EPOLLOUT      POLLOUT
+#define EPOLLERR      POLLERR
+#define EPOLLHUP      POLLHUP
+#define EPOLLRDHUP    0
+#define EPOLL_CTL_ADD 1
+#define EPOLL_CTL_DEL 2
+#define EPOLL_CTL_MOD 3
+struct epoll_event
 {
-  ssize_t  written = 0;
-  ssize_t  left    = data_len;
-  int     start   = 0;
+  u_int32  events;
+  union { u_int32 u32; } data;
+};
+#endif
 
-  errno = 0;
-  while (left > 0)
-  {
-    written = send(output,&(data[start]),left,0);
-    if (written == -1)
-    {
-      if (errno == ENOBUFS)
-      {
-        fprintf(stderr,"!!! Warning: 'no buffer space available' writing out"
-                " packet data - retrying\n");
-        errno = 0;
-      }
-      else
-      {
-        fprintf(stderr,"### Error writing: %s\n",strerror(errno));
-        return 1;
-      }
-    }
-    left -= written;
-    start += written;
-  }
-  return 0;
-}
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+#ifndef SOL_UDP
+#define SOL_UDP IPPROTO_UDP
+#endif
+
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+#ifndef SO_EE_ORIGIN_ZEROCOPY
+#define SO_EE_ORIGIN_ZEROCOPY 5
+#endif
+#ifndef SO_EE_CODE_ZEROCOPY_COPIED
+#define SO_EE_CODE_ZEROCOPY_COPIED 1
+#endif
+
+// The most a single (maximum size) UDP datagram can hold, which is also
+// the most the kernel will coalesce into one buffer for us
+#define MAX_GRO_BYTES 65535
 
 static SOCKET udp_listen_socket(char *hostname, int port)
 {
@@ -148,181 +167,2180 @@ static SOCKET udp_listen_socket(char *hostname, int port)
   return sock;
 }
 
-static int run_server(char  *udp_host,
-                      int    udp_port,
-                      int    listen_port,
-                      int    mult)
+/*
+ * Ask the kernel to coalesce consecutive datagrams into one buffer for us
+ * (UDP generic receive offload), telling us the size of the original
+ * datagrams in a control message.
+ *
+ * Returns 0 if all went well, 1 if something went wrong.
+ */
+static int enable_gro(SOCKET sock)
 {
-  int    err;
-  SOCKET server_socket;
-  SOCKET client_socket;
-  SOCKET udp_socket;
-  struct sockaddr_in ipaddr;
-  byte  *data;
-  int    packet_size = mult * TS_PACKET_SIZE;
-
-  data = malloc(sizeof(byte) * packet_size);
-  if (data == NULL) 
+  const int one = 1;
+  if (setsockopt(sock,SOL_UDP,UDP_GRO,&one,sizeof(one)) < 0)
   {
-    fprintf(stderr,"### Cannot allocate data buffer of size %d*%d=%d\n",
-            mult,TS_PACKET_SIZE,packet_size);
+    fprintf(stderr,"### Unable to enable UDP GRO: %s\n",strerror(errno));
     return 1;
   }
+  return 0;
+}
 
-  // Create a socket.
-  server_socket = socket(AF_INET, SOCK_STREAM, 0);
-  if (server_socket == -1)
+/*
+ * Ask the kernel to tell us, with each datagram, how many it has had to
+ * drop on this socket (because we weren't reading quickly enough).
+ *
+ * Returns 0 if all went well, 1 if something went wrong.
+ */
+static int enable_drop_count(SOCKET sock)
+{
+#if defined(SO_RXQ_OVFL)
+  const int one = 1;
+  if (setsockopt(sock,SOL_SOCKET,SO_RXQ_OVFL,&one,sizeof(one)) < 0)
   {
-    fprintf(stderr,"### Unable to create socket: %s\n",strerror(errno));
-    free(data);
+    fprintf(stderr,"### Unable to enable SO_RXQ_OVFL: %s\n",strerror(errno));
     return 1;
   }
+  return 0;
+#else
+  fprintf(stderr,"### SO_RXQ_OVFL is not supported on this system\n");
+  return 1;
+#endif
+}
 
-  // Bind it to port `listen_port` on this machine
-  memset(&ipaddr,0,sizeof(ipaddr));
-#if !defined(__linux__)
-  // On BSD, the length is defined in the datastructure
-  ipaddr.sin_len = sizeof(struct sockaddr_in);
+/*
+ * Read the next datagram - or, with GRO, run of datagrams - from `sock`.
+ *
+ * - `data` is where to put it, and `data_len` how much room there is
+ * - `segment` is set to the size of the individual datagrams (or, if we
+ *   weren't told, the size of the whole thing)
+ * - if `drops` is not NULL, and the kernel tells us (see
+ *   enable_drop_count), it is set to how many datagrams have been dropped
+ *   on this socket so far
+ *
+ * Returns what recvmsg returns.
+ */
+static ssize_t read_datagrams(SOCKET   sock,
+                              byte     data[],
+                              int      data_len,
+                              int     *segment,
+                              u_int32 *drops)
+{
+  union {
+    char            buf[CMSG_SPACE(sizeof(int)) + CMSG_SPACE(sizeof(u_int32))];
+    struct cmsghdr  align;
+  } control;
+  struct iovec    iov = { data, data_len };
+  struct msghdr   msg;
+  struct cmsghdr *cmsg;
+  ssize_t         len;
+
+  memset(&msg,0,sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof(control.buf);
+  len = recvmsg(sock,&msg,0);
+  *segment = len;
+  for (cmsg = CMSG_FIRSTHDR(&msg); len > 0 && cmsg != NULL;
+       cmsg = CMSG_NXTHDR(&msg,cmsg))
+  {
+    if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO)
+    {
+      int size;
+      memcpy(&size,CMSG_DATA(cmsg),sizeof(size));
+      if (size > 0)
+        *segment = size;
+    }
+#if defined(SO_RXQ_OVFL)
+    else if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_RXQ_OVFL &&
+             drops != NULL)
+      memcpy(drops,CMSG_DATA(cmsg),sizeof(*drops));
 #endif
-  ipaddr.sin_family = AF_INET;
-  ipaddr.sin_port = htons(listen_port);
-  ipaddr.sin_addr.s_addr = INADDR_ANY;  // any interface
+  }
+  return len;
+}
+
+#ifdef __linux__
+/*
+ * An io_uring engine for copying packets
+ *
+ * Rather than a system call to read each datagram, and more to write it
+ * out, we give the kernel a ring of buffers, and a single "multishot"
+ * receive request, which keeps filling buffers for us as datagrams arrive.
+ * As each is received, we queue a send of it to the TCP client. Sends are
+ * linked (IOSQE_IO_LINK), so that they happen in order, and only one chain
+ * of them is in flight at a time - any datagrams that arrive meanwhile go
+ * into the next chain. When a send is done, its buffer goes back into the
+ * ring. All of this is submitted, and the results collected, with a single
+ * system call each time round.
+ *
+ * We use the system calls directly, rather than needing liburing.
+ */
+#define URING_ENTRIES     256   // submission queue entries
+#define URING_BUFFERS     256   // must be a power of two
+#define URING_GRO_BUFFERS 32    // fewer, as each is bigger
+#define URING_GROUP       0     // our buffer group id
+#define URING_RECV        ((u_int64)1 << 32)  // user_data for our receive
+#define URING_SEND        ((u_int64)2 << 32)  // user_data for a send, | buffer id
+
+struct uring
+{
+  int                       fd;
+  unsigned                  sq_entries;
+  unsigned                 *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned                 *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe      *sqes;
+  struct io_uring_cqe      *cqes;
+  void                     *sq_ring, *cq_ring;
+  size_t                    sq_ring_size, cq_ring_size, sqes_size;
+  unsigned                  to_submit;
+  // Our buffers, and the ring we give them to the kernel with
+  struct io_uring_buf_ring *buf_ring;
+  size_t                    buf_ring_size;
+  unsigned                  num_buffers;
+  byte                     *buffers;
+  int                       buffer_size;
+};
 
-  err = bind(server_socket,(struct sockaddr*)&ipaddr,sizeof(ipaddr));
-  if (err == -1)
+static int uring_setup(struct uring *ring,
+                       unsigned      entries)
+{
+  struct io_uring_params  params;
+
+  memset(ring,0,sizeof(*ring));
+  memset(&params,0,sizeof(params));
+  ring->fd = syscall(__NR_io_uring_setup,entries,&params);
+  if (ring->fd < 0)
   {
-    fprintf(stderr,"### Unable to bind to port %d: %s\n",
-            listen_port,strerror(errno));
-    free(data);
+    fprintf(stderr,"### Unable to set up io_uring: %s\n",strerror(errno));
     return 1;
   }
+  ring->sq_entries = params.sq_entries;
+  ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  ring->cq_ring_size = params.cq_off.cqes +
+    params.cq_entries * sizeof(struct io_uring_cqe);
+  ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
 
-  for (;;)
+  ring->sq_ring = mmap(NULL,ring->sq_ring_size,PROT_READ|PROT_WRITE,
+                       MAP_SHARED|MAP_POPULATE,ring->fd,IORING_OFF_SQ_RING);
+  ring->cq_ring = mmap(NULL,ring->cq_ring_size,PROT_READ|PROT_WRITE,
+                       MAP_SHARED|MAP_POPULATE,ring->fd,IORING_OFF_CQ_RING);
+  ring->sqes = mmap(NULL,ring->sqes_size,PROT_READ|PROT_WRITE,
+                    MAP_SHARED|MAP_POPULATE,ring->fd,IORING_OFF_SQES);
+  if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED ||
+      ring->sqes == MAP_FAILED)
   {
-    printf("Listening for a connection on port %d\n",listen_port);
+    fprintf(stderr,"### Unable to map io_uring: %s\n",strerror(errno));
+    return 1;
+  }
+  ring->sq_head  = (unsigned *)((char *)ring->sq_ring + params.sq_off.head);
+  ring->sq_tail  = (unsigned *)((char *)ring->sq_ring + params.sq_off.tail);
+  ring->sq_mask  = (unsigned *)((char *)ring->sq_ring + params.sq_off.ring_mask);
+  ring->sq_array = (unsigned *)((char *)ring->sq_ring + params.sq_off.array);
+  ring->cq_head  = (unsigned *)((char *)ring->cq_ring + params.cq_off.head);
+  ring->cq_tail  = (unsigned *)((char *)ring->cq_ring + params.cq_off.tail);
+  ring->cq_mask  = (unsigned *)((char *)ring->cq_ring + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)((char *)ring->cq_ring + params.cq_off.cqes);
+  return 0;
+}
+
+static void uring_free(struct uring *ring)
+{
+  if (ring->sq_ring != NULL && ring->sq_ring != MAP_FAILED)
+    munmap(ring->sq_ring,ring->sq_ring_size);
+  if (ring->cq_ring != NULL && ring->cq_ring != MAP_FAILED)
+    munmap(ring->cq_ring,ring->cq_ring_size);
+  if (ring->sqes != NULL && ring->sqes != MAP_FAILED)
+    munmap(ring->sqes,ring->sqes_size);
+  if (ring->buf_ring != NULL && ring->buf_ring != MAP_FAILED)
+    munmap(ring->buf_ring,ring->buf_ring_size);
+  free(ring->buffers);
+  if (ring->fd >= 0)
+    close(ring->fd);
+}
+
+/*
+ * Get the next free submission queue entry (cleared), or NULL if the
+ * queue is full
+ */
+static struct io_uring_sqe *uring_get_sqe(struct uring *ring)
+{
+  unsigned  head = __atomic_load_n(ring->sq_head,__ATOMIC_ACQUIRE);
+  unsigned  tail = *ring->sq_tail;
+  unsigned  index;
+  if (tail - head >= ring->sq_entries)
+    return NULL;
+  index = tail & *ring->sq_mask;
+  ring->sq_array[index] = index;
+  memset(&ring->sqes[index],0,sizeof(struct io_uring_sqe));
+  __atomic_store_n(ring->sq_tail,tail + 1,__ATOMIC_RELEASE);
+  ring->to_submit ++;
+  return &ring->sqes[index];
+}
+
+/*
+ * Submit whatever we've queued, and wait for at least one completion
+ */
+static int uring_submit_and_wait(struct uring *ring)
+{
+  int  result;
+  do
+    result = syscall(__NR_io_uring_enter,ring->fd,ring->to_submit,1,
+                     IORING_ENTER_GETEVENTS,NULL,0);
+  while (result < 0 && errno == EINTR);
+  if (result < 0)
+  {
+    fprintf(stderr,"### Error in io_uring_enter: %s\n",strerror(errno));
+    return 1;
+  }
+  ring->to_submit -= result;
+  return 0;
+}
+
+/*
+ * Hand buffer `bid` (back) to the kernel to receive into
+ */
+static void uring_give_buffer(struct uring *ring,
+                              unsigned      bid)
+{
+  u_int16             tail = ring->buf_ring->tail;
+  struct io_uring_buf *buf = &ring->buf_ring->bufs[tail & (ring->num_buffers - 1)];
+  buf->addr = (u_int64)(uintptr_t)&ring->buffers[bid * ring->buffer_size];
+  buf->len = ring->buffer_size;
+  buf->bid = bid;
+  __atomic_store_n(&ring->buf_ring->tail,tail + 1,__ATOMIC_RELEASE);
+}
+
+/*
+ * Allocate `num_buffers` buffers of `buffer_size` bytes, and give them to
+ * the kernel as a provided buffer ring
+ */
+static int uring_setup_buffers(struct uring *ring,
+                               unsigned      num_buffers,
+                               int           buffer_size)
+{
+  struct io_uring_buf_reg  reg;
+  unsigned                 ii;
+
+  ring->num_buffers = num_buffers;
+  ring->buffer_size = buffer_size;
+  ring->buffers = malloc((size_t)num_buffers * buffer_size);
+  ring->buf_ring_size = num_buffers * sizeof(struct io_uring_buf);
+  ring->buf_ring = mmap(NULL,ring->buf_ring_size,PROT_READ|PROT_WRITE,
+                        MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+  if (ring->buffers == NULL || ring->buf_ring == MAP_FAILED)
+  {
+    fprintf(stderr,"### Unable to allocate %u buffers of %d bytes\n",
+            num_buffers,buffer_size);
+    return 1;
+  }
+  memset(&reg,0,sizeof(reg));
+  reg.ring_addr = (u_int64)(uintptr_t)ring->buf_ring;
+  reg.ring_entries = num_buffers;
+  reg.bgid = URING_GROUP;
+  if (syscall(__NR_io_uring_register,ring->fd,IORING_REGISTER_PBUF_RING,
+              &reg,1) < 0)
+  {
+    fprintf(stderr,"### Unable to register io_uring buffer ring: %s\n",
+            strerror(errno));
+    return 1;
+  }
+  for (ii = 0; ii < num_buffers; ii++)
+    uring_give_buffer(ring,ii);
+  return 0;
+}
+
+/*
+ * Copy from `udp_socket` to `client_socket` using io_uring, until the
+ * client goes away (or something else goes wrong).
+ *
+ * Returns 0 if the client went away, 1 if something else went wrong, 2 if
+ * we couldn't set io_uring up at all (so the caller can fall back to the
+ * normal loop).
+ */
+static int relay_uring(SOCKET udp_socket,
+                       SOCKET client_socket,
+                       int    packet_size,
+                       int    gro)
+{
+  struct uring  ring;
+  unsigned     *ready_bid;     // received, waiting to be sent
+  int          *ready_len;
+  unsigned      num_ready = 0;
+  unsigned      sends_in_flight = 0;
+  int           recv_armed = 0;
+  int           result = 0;
+  int           finished = 0;
+  unsigned      num_buffers = (gro ? URING_GRO_BUFFERS : URING_BUFFERS);
+  unsigned      ii;
+
+  ready_bid = malloc(num_buffers * sizeof(unsigned));
+  ready_len = malloc(num_buffers * sizeof(int));
+  if (ready_bid == NULL || ready_len == NULL)
+  {
+    fprintf(stderr,"### Unable to allocate io_uring send queue\n");
+    return 2;
+  }
+  if (uring_setup(&ring,URING_ENTRIES) ||
+      uring_setup_buffers(&ring,num_buffers,
+                          (gro ? MAX_GRO_BYTES : packet_size)))
+  {
+    uring_free(&ring);
+    free(ready_bid);
+    free(ready_len);
+    return 2;
+  }
+
+  while (!finished)
+  {
+    unsigned  head, tail;
 
-    // Listen for someone to connect to it
-    err = listen(server_socket,1);
-    if (err == -1)
+    // If our receive has stopped (because it ran out of buffers), start
+    // it again, as long as we've got some buffers it can use
+    if (!recv_armed && num_ready + sends_in_flight < num_buffers)
     {
-      fprintf(stderr,"### Error listening for client: %s\n",strerror(errno));
-      free(data);
-      return 1;
+      struct io_uring_sqe *sqe = uring_get_sqe(&ring);
+      if (sqe != NULL)
+      {
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = udp_socket;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = URING_GROUP;
+        sqe->user_data = URING_RECV;
+        recv_armed = 1;
+      }
     }
 
-    // Accept the connection
-    client_socket = accept(server_socket,NULL,NULL);
-    if (client_socket == -1)
+    // Send everything that's arrived since the last lot of sends
+    if (sends_in_flight == 0 && num_ready > 0)
     {
-      fprintf(stderr,"### Error accepting connection: %s\n",strerror(errno));
-      free(data);
-      return 1;
+      for (ii = 0; ii < num_ready; ii++)
+      {
+        struct io_uring_sqe *sqe = uring_get_sqe(&ring);
+        if (sqe == NULL)
+          break;
+        sqe->opcode = IORING_OP_SEND;
+        sqe->fd = client_socket;
+        sqe->addr = (u_int64)(uintptr_t)&ring.buffers[ready_bid[ii] * ring.buffer_size];
+        sqe->len = ready_len[ii];
+        sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+        sqe->user_data = URING_SEND | ready_bid[ii];
+        sqe->flags = IOSQE_IO_LINK;
+        sends_in_flight ++;
+      }
+      if (ii > 0)
+        ring.sqes[(*ring.sq_tail - 1) & *ring.sq_mask].flags = 0;  // end of chain
+      num_ready -= ii;
+      memmove(ready_bid,&ready_bid[ii],num_ready * sizeof(unsigned));
+      memmove(ready_len,&ready_len[ii],num_ready * sizeof(int));
     }
 
-    // And connect to the UDP as well
-    udp_socket = udp_listen_socket(udp_host,udp_port);
-    if (udp_socket < 0)
+    if (uring_submit_and_wait(&ring))
     {
-      fprintf(stderr,"### Unable to connect to UDP host %s, port %d\n",
-              udp_host,udp_port);
-      return 1;
+      result = 1;
+      break;
     }
 
-    printf("Copying packets...\n");
-
-    for (;;)
+    head = *ring.cq_head;
+    tail = __atomic_load_n(ring.cq_tail,__ATOMIC_ACQUIRE);
+    for ( ; head != tail; head++)
     {
-      int    ii;
-      size_t len = recv(udp_socket, data, mult*TS_PACKET_SIZE, MSG_WAITALL);
-      if (len < 0)
-      {
-        perror("Error in recv");
-        break;
-      }
-      if (len == 0)
+      struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+      if (cqe->user_data == URING_RECV)
       {
-        printf("End of file\n");
-        break;
-      }
-      if (len != packet_size)
-        printf("!!! Packet of size %d, not %d\n",len,packet_size);
-
+        if (!(cqe->flags & IORING_CQE_F_MORE))
+          recv_armed = 0;
+        if (cqe->res < 0)
+        {
+          if (cqe->res != -ENOBUFS)
+          {
+            fprintf(stderr,"### Error receiving: %s\n",strerror(-cqe->res));
+            result = 1;
+            finished = 1;
+          }
+        }
+        else if (cqe->flags & IORING_CQE_F_BUFFER)
+        {
+          unsigned bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+          if (cqe->res != packet_size && !gro)
+            printf("!!! Packet of size %d, not %d\n",cqe->res,packet_size);
 #ifdef PACKETNUMS
-      // This code is useful if we are receiving data from udpserve,
-      // which puts a packet number in the first four bytes of each
-      // <mult>*188 byte packet.
-      {
-        unsigned int this_packet_number;
-        this_packet_number = data[3];
-        this_packet_number = (this_packet_number << 8) | data[2];
-        this_packet_number = (this_packet_number << 8) | data[1];
-        this_packet_number = (this_packet_number << 8) | data[0];
-        printf("%08u\n",this_packet_number);
-      }
+          {
+            byte *data = &ring.buffers[bid * ring.buffer_size];
+            printf("%08u\n",data[0] | data[1] << 8 | data[2] << 16 |
+                   (unsigned)data[3] << 24);
+          }
 #endif
-      for (ii = 0; ii < mult; ii++)
+          if (cqe->res > 0)
+          {
+            ready_bid[num_ready] = bid;
+            ready_len[num_ready] = cqe->res;
+            num_ready ++;
+          }
+          else
+            uring_give_buffer(&ring,bid);
+        }
+      }
+      else
       {
-        err = write_socket_data(client_socket,&data[ii*TS_PACKET_SIZE],TS_PACKET_SIZE);
-        if (err) break;
+        // One of our sends
+        sends_in_flight --;
+        uring_give_buffer(&ring,cqe->user_data & 0xFFFF);
+        if (cqe->res < 0 && cqe->res != -ECANCELED)
+        {
+          fprintf(stderr,"### Error writing: %s\n",strerror(-cqe->res));
+          finished = 1;  // i.e., the client has probably gone away
+        }
       }
-      if (err) break;
     }
-    close(udp_socket);
-    close(client_socket);
+    __atomic_store_n(ring.cq_head,head,__ATOMIC_RELEASE);
   }
 
-  free(data);
-  return 0;
+  uring_free(&ring);
+  free(ready_bid);
+  free(ready_len);
+  return result;
 }
+#endif // __linux__
 
-int main(int argc, char **argv)
+/*
+ * Output batching
+ *
+ * Rather than writing each datagram to a client as soon as we have it, we
+ * can let them build up, and write them all at once, when we have
+ * `flush_bytes` of them, or when the oldest has been waiting for
+ * `latency_ms`, whichever happens first. Fewer, bigger writes cost less
+ * CPU, at the price of some latency.
+ */
+struct flush_stats
 {
-  char  *udp_host = NULL;
-  char  *colon;
-  long   udp_port = 88;
-  long   listen_port;
-  int    mult = 7;
+  unsigned long  size_flushes;    // because we had enough bytes
+  unsigned long  timer_flushes;   // because the oldest data was old enough
+  unsigned long  other_flushes;   // because the client could take more again
+  unsigned long  datagrams;
+  unsigned long  bytes;
+};
 
-  if (argc != 3)
-  {
-    fprintf(stderr,"Usage: udp2tcp <from>[:<port>] <listen-port> [<mult>]\n"
-            "Reads packets over UDP from the host with IP <from>, default port 88.\n"
-            "Listens on TCP port <listen-port> for a connection, and on receiving one\n"
-            "streams UDP packets over TCP.\n"
-            "If <mult> is given, it is the size of the packets in multiples of 188\n"
-            "(i.e., TS packets are assumed). <mult> defaults to 7.\n"
-           );
-    return 1;
-  }
+static void print_flush_stats(struct flush_stats *stats)
+{
+  unsigned long flushes = stats->size_flushes + stats->timer_flushes +
+    stats->other_flushes;
+  printf("wrote %lu bytes from %lu datagrams in %lu writes"
+         " (%lu full, %lu timed out, %lu other)",
+         stats->bytes,stats->datagrams,flushes,
+         stats->size_flushes,stats->timer_flushes,stats->other_flushes);
+  if (flushes > 0)
+    printf(", %.1f datagrams per write",(double)stats->datagrams / flushes);
+}
 
-  udp_host = argv[1];
-  if ((colon = strchr(udp_host, ':')))
-  {
-    *colon = '\0';
-    udp_port = atoi(colon + 1);
-  }
+static long long now_ms(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC,&now);
+  return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
 
-  if (argc > 3)
-    mult = atoi(argv[4]);
-  if (mult <= 0)
-  {
-    fprintf(stderr,"Packet size multiplier %s does not make sense\n",argv[4]);
-    return 1;
-  }
+/*
+ * The shared packet ring
+ *
+ * Each datagram (or GRO run of datagrams) is received straight into a
+ * ring of bytes, once, however many clients there are, and described by
+ * a record in a second ring. A record remembers how many clients have
+ * still to send it (its reference count), and each client has its own
+ * cursor, the next record it is to send. Records are only ever released
+ * in order, so the space at the tail of the ring is free once the oldest
+ * record's count drops to zero.
+ *
+ * Record data never wraps around the end of the byte ring - if there
+ * isn't room for a whole datagram before the end, we skip to the start.
+ *
+ * Positions in both rings are counts since we started, which only ever
+ * go up; the index into the ring is the position modulo its size.
+ *
+ * The ring is shared between two threads. The receiving thread fills in
+ * records, and then moves `head` on, and the sending thread (which looks
+ * after the clients, and so the reference counts) moves `tail` on as they
+ * are finished with. Neither ever writes the other's end, so each only
+ * needs to publish its own, as in circular.c.
+ */
+struct record
+{
+  u_int64    start;       // byte position of the data
+  int        len;
+  int        datagrams;   // how many datagrams (more than one with GRO)
+  int        refs;        // how many clients still have to send it
+  long long  arrived;     // when, in ms
+};
+
+struct packet_ring
+{
+  byte            *data;
+  u_int64          size;          // of `data`
+  struct record   *records;
+  u_int64          num_records;   // a power of two
+  _Atomic u_int64  head;          // the next record to fill
+  _Atomic u_int64  tail;          // the oldest record still wanted
+  u_int64          end;           // (receiver) byte position after the newest record
+  u_int64          seen;          // (sender) how far it has taken records on
+};
 
-  listen_port = atoi(argv[2]);
-  if (listen_port <= 0)
+static int ring_setup(struct packet_ring *ring,
+                      u_int64             size)
+{
+  memset(ring,0,sizeof(*ring));
+  ring->size = size;
+  // No record is ever shorter than a TS packet
+  ring->num_records = 1;
+  while (ring->num_records < size / TS_PACKET_SIZE)
+    ring->num_records <<= 1;
+  ring->data = malloc(size);
+  ring->records = malloc(ring->num_records * sizeof(struct record));
+  if (ring->data == NULL || ring->records == NULL)
   {
-    fprintf(stderr,"Port %s does not make sense\n",argv[2]);
+    fprintf(stderr,"### Unable to allocate a packet ring of %llu bytes\n",
+            (unsigned long long)size);
     return 1;
   }
+  atomic_init(&ring->head,0);
+  atomic_init(&ring->tail,0);
+  return 0;
+}
+
+static void ring_free(struct packet_ring *ring)
+{
+  free(ring->data);
+  free(ring->records);
+}
 
-  printf("UDP from %s:%ld, listening for a TCP connection on port %ld\n"
-         "Packet size = %d (%d * 188)\n",udp_host,udp_port,listen_port,
-         TS_PACKET_SIZE,mult);
+static struct record *ring_record(struct packet_ring *ring,
+                                  u_int64             posn)
+{
+  return &ring->records[posn & (ring->num_records - 1)];
+}
 
-  if (run_server(udp_host,udp_port,listen_port,mult) < 0)
-    return 1;
-  else
+static byte *record_data(struct packet_ring *ring,
+                         struct record      *record)
+{
+  return &ring->data[record->start % ring->size];
+}
+
+/*
+ * (Sender) Forget any records at the tail that no-one wants any more
+ */
+static void ring_reclaim(struct packet_ring *ring)
+{
+  u_int64  tail = atomic_load_explicit(&ring->tail,memory_order_relaxed);
+  u_int64  old_tail = tail;
+  while (tail != ring->seen && ring_record(ring,tail)->refs == 0)
+    tail ++;
+  if (tail != old_tail)
+    atomic_store_explicit(&ring->tail,tail,memory_order_release);
+}
+
+/*
+ * (Sender) How many bytes of the ring are in use?
+ */
+static u_int64 ring_used(struct packet_ring *ring)
+{
+  u_int64        tail = atomic_load_explicit(&ring->tail,memory_order_relaxed);
+  struct record *newest;
+  if (tail == ring->seen)
     return 0;
+  newest = ring_record(ring,ring->seen - 1);
+  return newest->start + newest->len - ring_record(ring,tail)->start;
+}
+
+/*
+ * (Receiver) Find room for `len` contiguous bytes.
+ *
+ * Returns where they start, or NULL if there isn't room.
+ */
+static byte *ring_space(struct packet_ring *ring,
+                        int                 len,
+                        u_int64            *start)
+{
+  u_int64  head = atomic_load_explicit(&ring->head,memory_order_relaxed);
+  u_int64  tail = atomic_load_explicit(&ring->tail,memory_order_acquire);
+  u_int64  posn = ring->end;
+  u_int64  used_from;
+  if (head - tail == ring->num_records)
+    return NULL;
+  if (ring->size - posn % ring->size < (u_int64)len)
+    posn += ring->size - posn % ring->size;
+  used_from = (tail == head ? posn : ring_record(ring,tail)->start);
+  if (posn + len - used_from > ring->size)
+    return NULL;
+  *start = posn;
+  return &ring->data[posn % ring->size];
+}
+
+/*
+ * Output to TCP clients
+ *
+ * Each client has its own policy for what to do when it isn't keeping up,
+ * and the ring is getting full:
+ *
+ * - POLICY_DROP: drop the oldest datagram it has still to send, so that it
+ *   sees a gap. If it had started to send it, the rest is copied aside
+ *   first, so it never sees a partial TS packet.
+ * - POLICY_DISCONNECT: disconnect it.
+ * - POLICY_BLOCK: stop reading UDP until it catches up (at which point the
+ *   kernel may be dropping datagrams for everyone).
+ */
+#define POLICY_DROP       0
+#define POLICY_DISCONNECT 1
+#define POLICY_BLOCK      2
+
+static const char *policy_names[] = { "drop", "disconnect", "block" };
+
+#define MAX_CLIENTS   64
+#define MAX_LISTENERS 8
+#define MAX_WATCHED   (MAX_CLIENTS + MAX_LISTENERS + 1) // and the wake up
+#define MAX_IOVECS    64
+
+/*
+ * Zero copy output
+ *
+ * With MSG_ZEROCOPY, the kernel sends to a client straight from the ring,
+ * rather than copying the data first, so the records sent mustn't be
+ * released (and their space reused) until the kernel says (on the socket's
+ * error queue) that it has finished with them. Each zero copy send gets the
+ * next of a sequence of ids, and we remember, for each, how far through the
+ * records it went. TCP normally reports them done in order, but not always
+ * (for instance, once a connection is reset), so we note which are done,
+ * and release records as the oldest of them are. Any records finished with
+ * by ordinary sends, while zero copy ones are still outstanding, are
+ * released along with the last of those.
+ *
+ * A client that stops reading never lets its sends complete, so when the
+ * ring is full we only wait for a client's completions while it is still
+ * able to send, and for at most ZC_WAIT_MS after the ring filled (which
+ * the ring has extra room for) - after that, it is treated like any other
+ * client that can't keep up, except that it can't just miss packets the
+ * kernel is still sending, so is disconnected. Dropping a client resets its
+ * connection, after which its completions come soon, and we keep its
+ * records until they have.
+ */
+#define ZC_QUEUE      256     // zero copy sends a client may have outstanding
+#define ZC_WAIT_MS    100
+#define ZC_DRAIN_MS   1       // how often to look for completions, once dropped
+
+struct zc_send
+{
+  u_int32  id;
+  u_int64  upto;    // release records before this when it's done
+  int      done;
+};
+
+struct listener
+{
+  SOCKET  sock;
+  int     port;
+  int     policy;
+};
+
+struct client
+{
+  int                 in_use;
+  int                 number;
+  SOCKET              sock;
+  int                 policy;
+  int                 blocked;      // waiting for the socket to have room
+  u_int64             cursor;       // the next record to send
+  int                 offset;       // how much of it we've already sent
+  u_int64             pending;      // bytes waiting to be sent
+  byte               *carry;        // the rest of a dropped, part-sent record
+  int                 carry_len;
+  int                 carry_offset;
+  long long           carry_arrived;
+  unsigned long       dropped;      // datagrams
+  struct flush_stats  stats;
+  // Records before `released` have been released. Without zero copy, that
+  // happens as soon as they're sent, so it's the same as `cursor`
+  u_int64             released;
+  int                 zerocopy;
+  u_int32             zc_next_id;   // the id the kernel will give our next send
+  struct zc_send      zc_queue[ZC_QUEUE];
+  int                 zc_first;
+  int                 zc_count;
+  unsigned long       zc_sends;
+  unsigned long       zc_completed;
+  unsigned long       zc_kernel_copied;
+  int                 draining;     // dropped, waiting for the last completions
+};
+
+/*
+ * Everything the server needs to know about.
+ *
+ * The receiving thread reads UDP into the ring, and the sending thread
+ * (the main one) does everything else. Fields they share are atomic.
+ */
+struct server
+{
+  int                 packet_size;
+  int                 buffer_size;  // the most one read can bring in
+  int                 gro;
+  int                 flush_bytes;
+  int                 latency_ms;
+  int                 zerocopy;
+  int                 zc_threshold; // smaller writes are copied as normal
+  struct packet_ring  ring;
+  u_int64             reserve;      // how much of the ring to keep free
+  long long           full_since;   // when less than that was, in ms
+
+  // Used by the receiving thread
+  SOCKET              udp_socket;
+  pthread_t           receiver;
+  _Atomic int         hold_udp;     // stop reading, for a POLICY_BLOCK client
+  _Atomic unsigned long datagrams;
+  _Atomic unsigned long bytes;
+  _Atomic unsigned long full_drops; // because the ring was full anyway
+  _Atomic u_int32     kernel_drops; // because we weren't reading fast enough
+  _Atomic int         failed;
+
+  // For the receiving thread to wake up the sending thread
+  int                 wake_fd;      // an eventfd, or the read end of a pipe
+  int                 wake_write_fd; // the same eventfd, or the write end
+  _Atomic int         sleeping;
+
+  // Used by the sending thread
+#ifdef __linux__
+  int                 epoll_fd;
+#else
+  struct pollfd       polls[MAX_WATCHED];
+  u_int32             poll_tags[MAX_WATCHED];
+  int                 num_polls;
+#endif
+  int                 num_listeners;
+  struct listener     listeners[MAX_LISTENERS];
+  struct client       clients[MAX_CLIENTS];
+  int                 next_client;
+  unsigned long       blocks;
+  unsigned long       too_many;     // clients we turned away
+  u_int64             high_water;   // most of the ring used, since last report
+  u_int64             low_water;    // and least
+  unsigned long       last_bytes;   // `bytes` at last report
+  long long           last_report;
+};
+
+// Tags, to say which socket an event is for
+#define TAG_WAKE       0
+#define TAG_LISTENER   1      // + listener index
+#define TAG_CLIENT     1000   // + client index
+
+/*
+ * Parse a policy name.
+ *
+ * Returns the policy, or -1 if it isn't one.
+ */
+static int read_policy(char *name)
+{
+  int  ii;
+  for (ii = 0; ii < 3; ii++)
+    if (!strcmp(name,policy_names[ii]))
+      return ii;
+  return -1;
+}
+
+static int set_nonblocking(SOCKET sock)
+{
+  int  flags = fcntl(sock,F_GETFL,0);
+  if (flags < 0 || fcntl(sock,F_SETFL,flags | O_NONBLOCK) < 0)
+  {
+    fprintf(stderr,"### Unable to make socket non-blocking: %s\n",
+            strerror(errno));
+    return 1;
+  }
+  return 0;
+}
+
+/*
+ * Make a TCP socket listening on `port`, on any interface.
+ *
+ * Returns the socket, or -1 if something went wrong.
+ */
+static SOCKET tcp_listen_socket(int port,
+                                int backlog)
+{
+  const int one = 1;
+  SOCKET    sock;
+  struct sockaddr_in ipaddr;
+
+  sock = socket(AF_INET, SOCK_STREAM, 0);
+  if (sock == -1)
+  {
+    fprintf(stderr,"### Unable to create socket: %s\n",strerror(errno));
+    return -1;
+  }
+  // So we can restart straight away, without waiting for old connections
+  if (setsockopt(sock,SOL_SOCKET,SO_REUSEADDR,&one,sizeof(one)) < 0)
+    perror("setsockopt: reuseaddr");
+
+  memset(&ipaddr,0,sizeof(ipaddr));
+#if !defined(__linux__)
+  // On BSD, the length is defined in the datastructure
+  ipaddr.sin_len = sizeof(struct sockaddr_in);
+#endif
+  ipaddr.sin_family = AF_INET;
+  ipaddr.sin_port = htons(port);
+  ipaddr.sin_addr.s_addr = INADDR_ANY;  // any interface
+
+  if (bind(sock,(struct sockaddr*)&ipaddr,sizeof(ipaddr)) == -1)
+  {
+    fprintf(stderr,"### Unable to bind to port %d: %s\n",
+            port,strerror(errno));
+    close(sock);
+    return -1;
+  }
+  if (listen(sock,backlog) == -1)
+  {
+    fprintf(stderr,"### Error listening on port %d: %s\n",port,strerror(errno));
+    close(sock);
+    return -1;
+  }
+  return sock;
+}
+
+/*
+ * Start (EPOLL_CTL_ADD) or stop (EPOLL_CTL_DEL) watching `sock` for
+ * `events`, or change them (EPOLL_CTL_MOD). Events for it will have `tag`.
+ *
+ * Returns 0 if all went well, 1 if something went wrong.
+ */
+static int watch(struct server *server,
+                 int            op,
+                 SOCKET         sock,
+                 u_int32        events,
+                 u_int32        tag)
+{
+#ifdef __linux__
+  struct epoll_event  event;
+  memset(&event,0,sizeof(event));
+  event.events = events;
+  event.data.u32 = tag;
+  if (epoll_ctl(server->epoll_fd,op,sock,&event) < 0)
+  {
+    fprintf(stderr,"### Error in epoll_ctl: %s\n",strerror(errno));
+    return 1;
+  }
+#else
+  int  ii;
+  for (ii = 0; ii < server->num_polls; ii++)
+    if (server->polls[ii].fd == sock)
+      break;
+  if (ii == server->num_polls)
+  {
+    if (op != EPOLL_CTL_ADD)
+    {
+      fprintf(stderr,"### Socket %d is not being watched\n",sock);
+      return 1;
+    }
+    server->num_polls ++;   // MAX_WATCHED allows for everything we watch
+  }
+  if (op == EPOLL_CTL_DEL)
+  {
+    server->num_polls --;
+    server->polls[ii] = server->polls[server->num_polls];
+    server->poll_tags[ii] = server->poll_tags[server->num_polls];
+    return 0;
+  }
+  server->polls[ii].fd = sock;
+  server->polls[ii].events = events;
+  server->poll_tags[ii] = tag;
+#endif
+  return 0;
+}
+
+/*
+ * Wait for up to `timeout` ms (or for ever, if it is -1) for any of the
+ * sockets we're watching to be ready.
+ *
+ * Returns how many `events` there are, or -1 if something went wrong.
+ */
+static int wait_events(struct server      *server,
+                       struct epoll_event  events[MAX_WATCHED],
+                       int                 timeout)
+{
+#ifdef __linux__
+  return epoll_wait(server->epoll_fd,events,MAX_WATCHED,timeout);
+#else
+  int  num_events = 0;
+  int  ii;
+  if (poll(server->polls,server->num_polls,timeout) < 0)
+    return -1;
+  for (ii = 0; ii < server->num_polls; ii++)
+  {
+    if (server->polls[ii].revents == 0)
+      continue;
+    events[num_events].events = server->polls[ii].revents;
+    events[num_events].data.u32 = server->poll_tags[ii];
+    num_events ++;
+  }
+  return num_events;
+#endif
+}
+
+static void print_client_stats(struct client *client,
+                               const char    *what)
+{
+  printf("Client %d%s: ",client->number,what);
+  print_flush_stats(&client->stats);
+  printf(", dropped %lu datagrams\n",client->dropped);
+  if (client->zerocopy)
+    printf("Client %d: %lu zero copy writes (%lu completed, %lu of them copied"
+           " by the kernel after all)\n",client->number,client->zc_sends,
+           client->zc_completed,client->zc_kernel_copied);
+}
+
+/*
+ * Release the records `client` has finished with, up to `upto`
+ */
+static void release_records(struct server *server,
+                            struct client *client,
+                            u_int64        upto)
+{
+  for ( ; client->released != upto; client->released++)
+    ring_record(&server->ring,client->released)->refs --;
+}
+
+/*
+ * Release the records `client` has finished with, up to its cursor - or,
+ * if the kernel still has some of its zero copy sends, when it has finished
+ * with the last of them.
+ */
+static void finished_with(struct server *server,
+                          struct client *client)
+{
+  if (client->zc_count > 0)
+    client->zc_queue[(client->zc_first + client->zc_count - 1) % ZC_QUEUE].upto =
+      client->cursor;
+  else
+    release_records(server,client,client->cursor);
+}
+
+/*
+ * Collect any zero copy completions for `client` from its socket's error
+ * queue, and release the records they were for.
+ */
+static void read_completions(struct server *server,
+                             struct client *client)
+{
+#ifdef __linux__
+  int  ii;
+  for (;;)
+  {
+    char            control[CMSG_SPACE(sizeof(struct sock_extended_err)) +
+                            CMSG_SPACE(sizeof(struct sockaddr_in))];
+    struct msghdr   msg;
+    struct cmsghdr *cmsg;
+
+    memset(&msg,0,sizeof(msg));
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if (recvmsg(client->sock,&msg,MSG_ERRQUEUE | MSG_DONTWAIT) == -1)
+      break;  // (normally EAGAIN, i.e., nothing more to read)
+
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg,cmsg))
+    {
+      struct sock_extended_err *err;
+      u_int32                   lo, hi;
+      if (cmsg->cmsg_level != IPPROTO_IP || cmsg->cmsg_type != IP_RECVERR)
+        continue;
+      err = (struct sock_extended_err *)CMSG_DATA(cmsg);
+      if (err->ee_origin != SO_EE_ORIGIN_ZEROCOPY || err->ee_errno != 0)
+        continue;
+      // Ids `lo` to `hi` (inclusive, and maybe wrapping round) are done
+      lo = err->ee_info;
+      hi = err->ee_data;
+      client->zc_completed += hi - lo + 1;
+      if (err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+        client->zc_kernel_copied += hi - lo + 1;
+      for (ii = 0; ii < client->zc_count; ii++)
+      {
+        struct zc_send *send = &client->zc_queue[(client->zc_first + ii) %
+                                                 ZC_QUEUE];
+        if (send->id - lo <= hi - lo)
+          send->done = 1;
+      }
+      while (client->zc_count > 0 && client->zc_queue[client->zc_first].done)
+      {
+        release_records(server,client,client->zc_queue[client->zc_first].upto);
+        client->zc_first = (client->zc_first + 1) % ZC_QUEUE;
+        client->zc_count --;
+      }
+    }
+  }
+#endif
+}
+
+/*
+ * Finally let go of a client
+ */
+static void close_client(struct server *server,
+                         struct client *client)
+{
+  if (!client->draining)  // which we've already stopped watching
+    watch(server,EPOLL_CTL_DEL,client->sock,0,0);
+  close(client->sock);
+  free(client->carry);
+  client->in_use = 0;
+}
+
+/*
+ * Stop sending to a client, and let go of all the records it was holding.
+ *
+ * If the kernel may still be sending some of them (with zero copy), we
+ * reset the connection, which throws away whatever it hasn't yet sent, but
+ * keep the socket (and those records) until it says it has finished with
+ * them, as until then they may still be going out.
+ */
+static void drop_client(struct server *server,
+                        struct client *client,
+                        const char    *why)
+{
+  print_client_stats(client,why);
+  if (client->zc_count > 0)
+  {
+    struct zc_send  *last = &client->zc_queue[(client->zc_first +
+                                               client->zc_count - 1) % ZC_QUEUE];
+    struct sockaddr  unspec;
+    u_int64          posn;
+
+    memset(&unspec,0,sizeof(unspec));
+    unspec.sa_family = AF_UNSPEC;
+    if (connect(client->sock,&unspec,sizeof(unspec)) < 0)
+      fprintf(stderr,"!!! Warning: unable to reset client %d: %s\n",
+              client->number,strerror(errno));
+    watch(server,EPOLL_CTL_DEL,client->sock,0,0);
+    // A record we'd started to send may be partly in flight
+    if (client->offset > 0)
+      last->upto = client->cursor + 1;
+    for (posn = last->upto; posn != server->ring.seen; posn++)
+      ring_record(&server->ring,posn)->refs --;
+    client->draining = 1;
+    client->pending = 0;
+    client->blocked = 0;
+    return;
+  }
+  release_records(server,client,server->ring.seen);
+  close_client(server,client);
+}
+
+/*
+ * Collect completions for a client we've dropped, and close it once the
+ * kernel has finished with all its sends.
+ */
+static void drain_client(struct server *server,
+                         struct client *client)
+{
+  read_completions(server,client);
+  if (client->zc_count == 0)
+    close_client(server,client);
+}
+
+/*
+ * Accept as many new clients as are waiting on `listener`
+ */
+static void accept_clients(struct server   *server,
+                           struct listener *listener)
+{
+  for (;;)
+  {
+    struct sockaddr_in  addr;
+    socklen_t           addr_len = sizeof(addr);
+    struct client      *client = NULL;
+    SOCKET              sock;
+    int                 ii;
+
+    sock = accept(listener->sock,(struct sockaddr *)&addr,&addr_len);
+    if (sock < 0)
+    {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        fprintf(stderr,"### Error accepting connection: %s\n",strerror(errno));
+      return;
+    }
+    for (ii = 0; ii < MAX_CLIENTS && client == NULL; ii++)
+      if (!server->clients[ii].in_use)
+        client = &server->clients[ii];
+    if (client == NULL)
+    {
+      fprintf(stderr,"!!! Warning: already serving %d clients, refusing"
+              " another\n",MAX_CLIENTS);
+      server->too_many ++;
+      close(sock);
+      continue;
+    }
+    if (set_nonblocking(sock) ||
+        watch(server,EPOLL_CTL_ADD,sock,EPOLLIN | EPOLLRDHUP,
+              TAG_CLIENT + (client - server->clients)))
+    {
+      close(sock);
+      continue;
+    }
+    memset(client,0,sizeof(*client));
+    client->in_use = 1;
+    client->number = ++server->next_client;
+    client->sock = sock;
+    client->policy = listener->policy;
+    client->cursor = server->ring.seen;  // it starts with the next datagram
+    client->released = client->cursor;
+    if (server->zerocopy)
+    {
+      const int one = 1;
+      if (setsockopt(sock,SOL_SOCKET,SO_ZEROCOPY,&one,sizeof(one)) < 0)
+        fprintf(stderr,"!!! Warning: unable to enable SO_ZEROCOPY for client"
+                " %d: %s\n",client->number,strerror(errno));
+      else
+        client->zerocopy = 1;
+    }
+    printf("Client %d connected from %s:%d on port %d (%s when slow)\n",
+           client->number,inet_ntoa(addr.sin_addr),ntohs(addr.sin_port),
+           listener->port,policy_names[client->policy]);
+  }
+}
+
+/*
+ * Drop the oldest record `client` has still to send
+ */
+static int drop_oldest(struct server *server,
+                       struct client *client)
+{
+  struct record *record = ring_record(&server->ring,client->cursor);
+  if (client->offset > 0)
+  {
+    // Keep the rest of what we'd started to send
+    if (client->carry == NULL)
+      client->carry = malloc(server->buffer_size);
+    if (client->carry == NULL)
+    {
+      drop_client(server,client," could not be given a buffer");
+      return 1;
+    }
+    client->carry_len = record->len - client->offset;
+    client->carry_offset = 0;
+    client->carry_arrived = record->arrived;
+    memcpy(client->carry,record_data(&server->ring,record) + client->offset,
+           client->carry_len);
+    client->offset = 0;
+  }
+  else
+  {
+    client->pending -= record->len;
+    client->dropped += record->datagrams;
+  }
+  client->cursor ++;
+  finished_with(server,client);
+  return 0;
+}
+
+/*
+ * Keep enough of the ring free for the receiving thread, dealing with any
+ * slow clients according to their policies.
+ *
+ * Returns when (in ms) to look again, as we're waiting for zero copy
+ * completions, or -1 if we aren't.
+ */
+static long long keep_room(struct server *server)
+{
+  struct packet_ring *ring = &server->ring;
+  long long           again = -1;
+  int                 hold = 0;
+  int                 ii;
+
+  ring_reclaim(ring);
+  if (ring_used(ring) + server->reserve <= ring->size)
+    server->full_since = 0;
+  else if (server->full_since == 0)
+    server->full_since = now_ms();
+  while (ring_used(ring) + server->reserve > ring->size)
+  {
+    u_int64  tail = atomic_load_explicit(&ring->tail,memory_order_relaxed);
+    int      acted = 0;
+    int      waiting = 0;
+
+    // The oldest record must still be wanted by at least one client, and
+    // they will be the ones who haven't released it. If they've sent it,
+    // they're waiting for zero copy completions - which may already be
+    // there to collect, and otherwise will come if the client is still
+    // reading (see ZC_WAIT_MS)
+    for (ii = 0; ii < MAX_CLIENTS && !hold; ii++)
+    {
+      struct client *client = &server->clients[ii];
+      if (!client->in_use || client->released != tail)
+        continue;
+      if (client->draining)
+      {
+        // Which shouldn't take long, as it has nothing left to send
+        acted = 1;
+        drain_client(server,client);
+        if (client->in_use && client->released == tail)
+        {
+          waiting = 1;
+          again = now_ms() + ZC_DRAIN_MS;
+        }
+        continue;
+      }
+      if (client->cursor != tail)
+      {
+        long long  now = now_ms();
+        read_completions(server,client);
+        if (client->released != tail)
+        {
+          acted = 1;
+          continue;
+        }
+        if (!client->blocked && now - server->full_since < ZC_WAIT_MS)
+        {
+          acted = waiting = 1;
+          if (again < 0 || server->full_since + ZC_WAIT_MS < again)
+            again = server->full_since + ZC_WAIT_MS;
+          continue;
+        }
+      }
+      acted = 1;
+      if (client->policy == POLICY_BLOCK)
+        hold = 1;
+      else if (client->policy == POLICY_DISCONNECT || client->cursor != tail)
+        drop_client(server,client," disconnected, as too slow");
+      else
+        drop_oldest(server,client);
+    }
+    if (hold || waiting)
+      break;
+    if (!acted)
+    {
+      // Which shouldn't happen, but we mustn't wait for ever
+      fprintf(stderr,"!!! Warning: record %llu has %d references, but no"
+              " client wants it\n",(unsigned long long)tail,
+              ring_record(ring,tail)->refs);
+      ring_record(ring,tail)->refs = 0;
+    }
+    ring_reclaim(ring);
+  }
+
+  if (hold && !atomic_load(&server->hold_udp))
+    server->blocks ++;
+  atomic_store(&server->hold_udp,hold);
+  return again;
+}
+
+/*
+ * Take on any new records from the receiving thread, for all our clients.
+ */
+static void take_records(struct server *server)
+{
+  struct packet_ring *ring = &server->ring;
+  u_int64             head = atomic_load_explicit(&ring->head,memory_order_acquire);
+  u_int64             used;
+  int                 ii;
+
+  for ( ; ring->seen != head; ring->seen++)
+  {
+    struct record *record = ring_record(ring,ring->seen);
+    record->refs = 0;
+    for (ii = 0; ii < MAX_CLIENTS; ii++)
+    {
+      if (server->clients[ii].in_use && !server->clients[ii].draining)
+      {
+        record->refs ++;
+        server->clients[ii].pending += record->len;
+      }
+    }
+  }
+  ring_reclaim(ring);
+  used = ring_used(ring);
+  if (used > server->high_water)
+    server->high_water = used;
+}
+
+/*
+ * Write as much as we can of what `client` has waiting, counting it as a
+ * flush in `which`.
+ */
+static void write_client(struct server *server,
+                         struct client *client,
+                         unsigned long *which)
+{
+  struct packet_ring *ring = &server->ring;
+  int                 copy_only = 0;
+
+  while (client->pending > 0)
+  {
+    struct iovec   iov[MAX_IOVECS];
+    struct msghdr  msg;
+    int            num_iov = 0;
+    u_int64        posn = client->cursor;
+    int            offset = client->offset;
+    u_int64        total = 0;
+    int            flags = MSG_NOSIGNAL | MSG_DONTWAIT;
+    int            zerocopy;
+    ssize_t        written;
+
+    if (client->carry_offset < client->carry_len)
+    {
+      iov[0].iov_base = client->carry + client->carry_offset;
+      iov[0].iov_len = client->carry_len - client->carry_offset;
+      num_iov = 1;
+    }
+    for ( ; num_iov < MAX_IOVECS && posn != ring->seen; posn++)
+    {
+      struct record *record = ring_record(ring,posn);
+      iov[num_iov].iov_base = record_data(ring,record) + offset;
+      iov[num_iov].iov_len = record->len - offset;
+      total += iov[num_iov].iov_len;
+      num_iov ++;
+      offset = 0;
+    }
+
+    // The carried over data isn't in the ring, and we may need to reuse
+    // its buffer, so it is always copied
+    zerocopy = (client->zerocopy && !copy_only &&
+                total >= (u_int64)server->zc_threshold &&
+                client->carry_offset == client->carry_len &&
+                client->zc_count < ZC_QUEUE);
+    if (zerocopy)
+      flags |= MSG_ZEROCOPY;
+
+    memset(&msg,0,sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = num_iov;
+    written = sendmsg(client->sock,&msg,flags);
+    if (written < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      if (errno == ENOBUFS && zerocopy)
+      {
+        // Too much is waiting to complete, so copy for now
+        copy_only = 1;
+        continue;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+      {
+        // Wait until it has room again
+        client->blocked = 1;
+        watch(server,EPOLL_CTL_MOD,client->sock,EPOLLIN | EPOLLRDHUP | EPOLLOUT,
+              TAG_CLIENT + (client - server->clients));
+        return;
+      }
+      fprintf(stderr,"### Error writing to client %d: %s\n",
+              client->number,strerror(errno));
+      drop_client(server,client," disconnected");
+      return;
+    }
+    (*which) ++;
+    client->stats.bytes += written;
+    client->pending -= written;
+
+    // Now work out what we've finished with
+    if (client->carry_offset < client->carry_len)
+    {
+      int  used = client->carry_len - client->carry_offset;
+      if (written < used)
+        used = written;
+      client->carry_offset += used;
+      written -= used;
+    }
+    while (written > 0)
+    {
+      struct record *record = ring_record(ring,client->cursor);
+      int            left = record->len - client->offset;
+      if (written < left)
+      {
+        client->offset += written;
+        break;
+      }
+      written -= left;
+      client->offset = 0;
+      client->stats.datagrams += record->datagrams;
+      client->cursor ++;
+    }
+    if (zerocopy)
+    {
+      struct zc_send *send = &client->zc_queue[(client->zc_first +
+                                                client->zc_count) % ZC_QUEUE];
+      send->id = client->zc_next_id++;
+      send->upto = client->cursor;
+      send->done = 0;
+      client->zc_count ++;
+      client->zc_sends ++;
+    }
+    else
+      finished_with(server,client);
+  }
+}
+
+/*
+ * When should `client` next be written to, if nothing else arrives?
+ *
+ * Returns the time in ms, or -1 if it has nothing waiting.
+ */
+static long long client_due(struct server *server,
+                            struct client *client)
+{
+  if (client->pending == 0 || client->blocked)
+    return -1;
+  if (client->carry_offset < client->carry_len)
+    return client->carry_arrived + server->latency_ms;
+  return ring_record(&server->ring,client->cursor)->arrived + server->latency_ms;
+}
+
+/*
+ * Write to each client that has enough waiting, or has had it waiting for
+ * long enough
+ */
+static void write_clients(struct server *server)
+{
+  long long  now = now_ms();
+  int        ii;
+  for (ii = 0; ii < MAX_CLIENTS; ii++)
+  {
+    struct client *client = &server->clients[ii];
+    long long      due;
+    if (!client->in_use || client->blocked || client->pending == 0)
+      continue;
+    if (client->pending >= (u_int64)server->flush_bytes)
+      write_client(server,client,&client->stats.size_flushes);
+    else if ((due = client_due(server,client)) >= 0 && due <= now)
+      write_client(server,client,&client->stats.timer_flushes);
+  }
+}
+
+/*
+ * Wake the sending thread up, if it's waiting in wait_events
+ */
+static void wake_sender(struct server *server)
+{
+  const u_int64  one = 1;
+  // (If a pipe is full, there's already plenty to wake it up)
+  if (write(server->wake_write_fd,&one,sizeof(one)) < 0 && errno != EAGAIN)
+    fprintf(stderr,"### Unable to wake sending thread: %s\n",strerror(errno));
+}
+
+/*
+ * The receiving thread: read UDP into the ring, for as long as we can
+ */
+static void *receive_udp(void *arg)
+{
+  struct server      *server = arg;
+  struct packet_ring *ring = &server->ring;
+  byte               *discard = malloc(server->buffer_size);
+  u_int32             kernel_drops = 0;
+
+  if (discard == NULL)
+  {
+    fprintf(stderr,"### Unable to allocate receive buffer\n");
+    atomic_store(&server->failed,1);
+    wake_sender(server);
+    return NULL;
+  }
+
+  for (;;)
+  {
+    struct record *record;
+    u_int64        start = 0;
+    byte          *data;
+    ssize_t        len;
+    int            segment;
+    int            offset;
+    int            kept = 0;
+    int            datagrams = 0;
+
+    if (atomic_load(&server->hold_udp))
+    {
+      // A POLICY_BLOCK client is holding us up
+      struct timespec  wait = { 0, 1000000 };
+      nanosleep(&wait,NULL);
+      continue;
+    }
+
+    // If the ring is full (the sending thread hasn't yet dealt with a slow
+    // client), we still read, so the kernel doesn't drop things instead, but
+    // the datagrams are lost
+    data = ring_space(ring,server->buffer_size,&start);
+    if (data == NULL)
+      data = discard;
+
+    len = read_datagrams(server->udp_socket,data,server->buffer_size,&segment,
+                         &kernel_drops);
+    if (len < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      perror("Error in recv");
+      atomic_store(&server->failed,1);
+      wake_sender(server);
+      break;
+    }
+    atomic_store_explicit(&server->kernel_drops,kernel_drops,
+                          memory_order_relaxed);
+
+    // With GRO, we may have several packets, one after another. We only
+    // pass on whole TS packets, so drop any odd bytes from each.
+    for (offset = 0; offset < len; offset += segment)
+    {
+      byte *packet = &data[offset];
+      int   this_len = (len - offset < segment ? len - offset : segment);
+      if (this_len != server->packet_size)
+        printf("!!! Packet of size %d, not %d\n",this_len,server->packet_size);
+
+#ifdef PACKETNUMS
+      // This code is useful if we are receiving data from udpserve,
+      // which puts a packet number in the first four bytes of each
+      // <mult>*188 byte packet.
+      {
+        unsigned int this_packet_number;
+        this_packet_number = packet[3];
+        this_packet_number = (this_packet_number << 8) | packet[2];
+        this_packet_number = (this_packet_number << 8) | packet[1];
+        this_packet_number = (this_packet_number << 8) | packet[0];
+        printf("%08u\n",this_packet_number);
+      }
+#endif
+      this_len -= this_len % TS_PACKET_SIZE;
+      if (&data[kept] != packet)
+        memmove(&data[kept],packet,this_len);
+      kept += this_len;
+      datagrams ++;
+    }
+    atomic_fetch_add_explicit(&server->datagrams,datagrams,memory_order_relaxed);
+    atomic_fetch_add_explicit(&server->bytes,kept,memory_order_relaxed);
+    if (data == discard)
+    {
+      atomic_fetch_add_explicit(&server->full_drops,datagrams,
+                                memory_order_relaxed);
+      continue;
+    }
+    if (kept == 0)
+      continue;
+
+    record = ring_record(ring,atomic_load_explicit(&ring->head,
+                                                   memory_order_relaxed));
+    record->start = start;
+    record->len = kept;
+    record->datagrams = datagrams;
+    record->arrived = now_ms();
+    ring->end = start + kept;
+    atomic_fetch_add(&ring->head,1);  // which publishes the record
+
+    // And if the sending thread is waiting for something to do, tell it
+    if (atomic_load(&server->sleeping) && atomic_exchange(&server->sleeping,0))
+      wake_sender(server);
+  }
+  free(discard);
+  return NULL;
+}
+
+/*
+ * Report on the ring and the clients. Ring usage is given in ms of the
+ * stream as well as bytes, assuming it arrives at `bitrate`, as when we
+ * sized the ring.
+ */
+static void report_server(struct server *server,
+                          int            bitrate)
+{
+  long long      now = now_ms();
+  unsigned long  bytes = atomic_load(&server->bytes);
+  double         bytes_per_ms = (double)bitrate / 8000;
+  double         seconds = (now - server->last_report) / 1000.0;
+  u_int64        low = (server->low_water > server->high_water ?
+                        server->high_water : server->low_water);
+  int            ii;
+
+  printf("Received %lu datagrams (%.1f Mbit/s)",atomic_load(&server->datagrams),
+         seconds > 0 ? (bytes - server->last_bytes) * 8 / seconds / 1000000 : 0);
+  printf(", ring %llu..%llu of %llu bytes (%.0f..%.0f of %.0f ms)\n",
+         (unsigned long long)low,(unsigned long long)server->high_water,
+         (unsigned long long)server->ring.size,
+         low / bytes_per_ms,server->high_water / bytes_per_ms,
+         server->ring.size / bytes_per_ms);
+  printf("Dropped %lu datagrams as the ring was full, %u in the kernel,"
+         " UDP held %lu times, %lu clients turned away\n",
+         atomic_load(&server->full_drops),atomic_load(&server->kernel_drops),
+         server->blocks,server->too_many);
+  for (ii = 0; ii < MAX_CLIENTS; ii++)
+    if (server->clients[ii].in_use && !server->clients[ii].draining)
+      print_client_stats(&server->clients[ii],"");
+
+  server->last_bytes = bytes;
+  server->last_report = now;
+  server->high_water = server->low_water = ring_used(&server->ring);
+}
+
+/*
+ * Read from UDP, and send to any number of TCP clients, connecting on any
+ * of our listeners.
+ *
+ * - if `zerocopy`, writes of at least `zc_threshold` bytes use MSG_ZEROCOPY
+ * - `ring_ms` is the size of the shared packet ring, in milliseconds of
+ *   the stream, assuming it arrives at `bitrate` bits/second
+ * - `report` is how often to report statistics, in seconds (0 for never)
+ *
+ * Returns 0 if all went well, 1 if something went wrong.
+ */
+static int run_server(char            *udp_host,
+                      int              udp_port,
+                      struct listener  listeners[],
+                      int              num_listeners,
+                      int              mult,
+                      int              gro,
+                      int              flush_bytes,
+                      int              latency_ms,
+                      int              zerocopy,
+                      int              zc_threshold,
+                      int              ring_ms,
+                      int              bitrate,
+                      int              report)
+{
+  struct server  *server;
+  u_int64         ring_size;
+  int             result = 0;
+  int             err;
+  int             ii;
+
+  server = calloc(1,sizeof(*server));
+  if (server == NULL)
+  {
+    fprintf(stderr,"### Unable to allocate server state\n");
+    return 1;
+  }
+  server->packet_size = mult * TS_PACKET_SIZE;
+  server->buffer_size = (gro ? MAX_GRO_BYTES : server->packet_size);
+  server->gro = gro;
+  server->flush_bytes = flush_bytes;
+  server->latency_ms = latency_ms;
+  server->zerocopy = zerocopy;
+  server->zc_threshold = zc_threshold;
+  server->num_listeners = num_listeners;
+  memcpy(server->listeners,listeners,num_listeners * sizeof(struct listener));
+
+  // Keep an eighth of the ring free, so the receiving thread doesn't run
+  // out of room while we're catching up with slow clients
+  ring_size = (u_int64)bitrate / 8 * ring_ms / 1000;
+  if (ring_size < (u_int64)server->buffer_size * 16)
+    ring_size = (u_int64)server->buffer_size * 16;
+  server->reserve = ring_size / 8;
+  if (zerocopy)
+  {
+    // And room for what arrives while we wait for a client's completions
+    // (see keep_room), so that doesn't make us drop datagrams either
+    u_int64  zc_reserve = (u_int64)bitrate / 8 * ZC_WAIT_MS / 1000 +
+                          server->buffer_size;
+    ring_size += zc_reserve;
+    server->reserve += zc_reserve;
+  }
+  if (ring_setup(&server->ring,ring_size))
+  {
+    ring_free(&server->ring);
+    free(server);
+    return 1;
+  }
+  printf("Packet ring of %llu bytes (%d ms at %d bits/s)\n",
+         (unsigned long long)ring_size,ring_ms + (zerocopy ? ZC_WAIT_MS : 0),
+         bitrate);
+
+#ifdef __linux__
+  server->epoll_fd = epoll_create1(0);
+  if (server->epoll_fd < 0)
+  {
+    fprintf(stderr,"### Unable to create epoll instance: %s\n",strerror(errno));
+    return 1;
+  }
+#endif
+#ifdef __linux__
+  server->wake_fd = server->wake_write_fd = eventfd(0,EFD_NONBLOCK);
+  if (server->wake_fd < 0)
+  {
+    fprintf(stderr,"### Unable to create eventfd: %s\n",strerror(errno));
+    return 1;
+  }
+#else
+  {
+    int  fds[2];
+    if (pipe(fds) < 0)
+    {
+      fprintf(stderr,"### Unable to create pipe: %s\n",strerror(errno));
+      return 1;
+    }
+    server->wake_fd = fds[0];
+    server->wake_write_fd = fds[1];
+    if (set_nonblocking(fds[0]) || set_nonblocking(fds[1]))
+      return 1;
+  }
+#endif
+  if (watch(server,EPOLL_CTL_ADD,server->wake_fd,EPOLLIN,TAG_WAKE))
+    return 1;
+
+  // One UDP socket, whoever is (or isn't) listening
+  server->udp_socket = udp_listen_socket(udp_host,udp_port);
+  if (server->udp_socket < 0)
+  {
+    fprintf(stderr,"### Unable to connect to UDP host %s, port %d\n",
+            udp_host,udp_port);
+    return 1;
+  }
+  if (gro && enable_gro(server->udp_socket))
+    return 1;
+  if (enable_drop_count(server->udp_socket))
+    printf("!!! Warning: datagrams dropped by the kernel will not be counted\n");
+
+  for (ii = 0; ii < num_listeners; ii++)
+  {
+    struct listener *listener = &server->listeners[ii];
+    listener->sock = tcp_listen_socket(listener->port,MAX_CLIENTS);
+    if (listener->sock < 0 || set_nonblocking(listener->sock) ||
+        watch(server,EPOLL_CTL_ADD,listener->sock,EPOLLIN,TAG_LISTENER + ii))
+      return 1;
+    printf("Listening for connections on port %d (%s when slow)\n",
+           listener->port,policy_names[listener->policy]);
+  }
+
+  server->last_report = now_ms();
+  err = pthread_create(&server->receiver,NULL,receive_udp,server);
+  if (err)
+  {
+    fprintf(stderr,"### Unable to start receiving thread: %s\n",strerror(err));
+    return 1;
+  }
+
+  for (;;)
+  {
+    struct epoll_event  events[MAX_WATCHED];
+    long long           now;
+    long long           next = -1;
+    int                 timeout;
+    int                 num_events;
+    u_int64             used;
+
+    take_records(server);
+    write_clients(server);
+    for (ii = 0; ii < MAX_CLIENTS; ii++)
+      if (server->clients[ii].in_use && server->clients[ii].draining)
+        drain_client(server,&server->clients[ii]);
+    // While we wait for completions with the ring full, nothing new will
+    // arrive to wake us
+    next = keep_room(server);
+    used = ring_used(&server->ring);
+    if (used < server->low_water)
+      server->low_water = used;
+
+    if (atomic_load(&server->failed))
+    {
+      result = 1;
+      break;
+    }
+
+    now = now_ms();
+    if (report && now - server->last_report >= report * 1000LL)
+      report_server(server,bitrate);
+
+    // Wake up for the first client whose data has waited long enough
+    for (ii = 0; ii < MAX_CLIENTS; ii++)
+    {
+      long long due;
+      if (!server->clients[ii].in_use)
+        continue;
+      if (server->clients[ii].draining)
+        due = now + ZC_DRAIN_MS;  // it isn't watched, so look again soon
+      else
+        due = client_due(server,&server->clients[ii]);
+      if (due >= 0 && (next < 0 || due < next))
+        next = due;
+    }
+    if (report && (next < 0 || server->last_report + report * 1000LL < next))
+      next = server->last_report + report * 1000LL;
+    timeout = (next < 0 ? -1 : next <= now ? 0 : (int)(next - now));
+
+    // Ask to be woken when more arrives - unless it already has
+    atomic_store(&server->sleeping,1);
+    if (atomic_load(&server->ring.head) != server->ring.seen)
+    {
+      atomic_store(&server->sleeping,0);
+      timeout = 0;
+    }
+    num_events = wait_events(server,events,timeout);
+    atomic_store(&server->sleeping,0);
+    if (num_events < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      fprintf(stderr,"### Error waiting for events: %s\n",strerror(errno));
+      result = 1;
+      break;
+    }
+
+    for (ii = 0; ii < num_events; ii++)
+    {
+      u_int32  tag = events[ii].data.u32;
+      if (tag == TAG_WAKE)
+      {
+        // An eventfd is emptied by one read, a pipe may take more
+        byte     discard[64];
+        ssize_t  len;
+        while ((len = read(server->wake_fd,discard,sizeof(discard))) > 0)
+          ;
+        if (len < 0 && errno != EAGAIN)
+          fprintf(stderr,"### Error reading wake up: %s\n",strerror(errno));
+      }
+      else if (tag < TAG_CLIENT)
+        accept_clients(server,&server->listeners[tag - TAG_LISTENER]);
+      else
+      {
+        struct client *client = &server->clients[tag - TAG_CLIENT];
+        if (!client->in_use || client->draining)
+          continue;   // we dropped it earlier on this time round
+        // Completions are signalled with EPOLLERR, whatever we asked for
+        // (so even while we're waiting for a blocked client to have room),
+        // but look as well when a blocked client has room again, as its
+        // earlier sends will have been acknowledged to make that room
+        if ((events[ii].events & (EPOLLERR | EPOLLOUT)) && client->zc_count > 0)
+          read_completions(server,client);
+        if (events[ii].events & EPOLLOUT)
+        {
+          client->blocked = 0;
+          watch(server,EPOLL_CTL_MOD,client->sock,EPOLLIN | EPOLLRDHUP,
+                tag);
+          write_client(server,client,&client->stats.other_flushes);
+        }
+        if (client->in_use &&
+            (events[ii].events & (EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP)))
+        {
+          // We don't expect anything from clients, except them going away
+          byte     discard[1024];
+          ssize_t  len = recv(client->sock,discard,sizeof(discard),MSG_DONTWAIT);
+          if (len == 0 ||
+              (len < 0 && errno != EAGAIN && errno != EWOULDBLOCK &&
+               errno != EINTR))
+            drop_client(server,client," went away");
+        }
+      }
+    }
+  }
+
+  report_server(server,bitrate);
+  if (!atomic_load(&server->failed))
+    pthread_cancel(server->receiver);
+  pthread_join(server->receiver,NULL);
+  for (ii = 0; ii < MAX_CLIENTS; ii++)
+  {
+    struct client *client = &server->clients[ii];
+    // With nothing receiving into the ring any more, the records a
+    // draining client still holds can't be overwritten, so it needn't wait
+    if (client->in_use && !client->draining)
+      drop_client(server,client," stopped");
+    if (client->in_use)
+      close_client(server,client);
+  }
+  close(server->udp_socket);
+#ifdef __linux__
+  close(server->epoll_fd);
+#endif
+  close(server->wake_fd);
+  if (server->wake_write_fd != server->wake_fd)
+    close(server->wake_write_fd);
+  ring_free(&server->ring);
+  free(server);
+  return result;
+}
+
+#ifdef __linux__
+/*
+ * Read from UDP, and send to one TCP client at a time, using io_uring.
+ *
+ * Returns 0 if all went well, 1 if something went wrong, 2 if io_uring
+ * could not be set up (so the caller can use run_server instead).
+ */
+static int run_uring_server(char  *udp_host,
+                            int    udp_port,
+                            int    listen_port,
+                            int    mult,
+                            int    gro)
+{
+  int    err;
+  SOCKET server_socket;
+  SOCKET client_socket;
+  SOCKET udp_socket;
+  int    packet_size = mult * TS_PACKET_SIZE;
+  struct uring probe;
+
+  // Check we can use io_uring at all before we take anyone's connection
+  err = uring_setup(&probe,2);
+  uring_free(&probe);
+  if (err)
+    return 2;
+
+  server_socket = tcp_listen_socket(listen_port,1);
+  if (server_socket == -1)
+    return 1;
+
+  for (;;)
+  {
+    printf("Listening for a connection on port %d\n",listen_port);
+
+    // Accept the connection
+    client_socket = accept(server_socket,NULL,NULL);
+    if (client_socket == -1)
+    {
+      fprintf(stderr,"### Error accepting connection: %s\n",strerror(errno));
+      close(server_socket);
+      return 1;
+    }
+
+    // And connect to the UDP as well
+    udp_socket = udp_listen_socket(udp_host,udp_port);
+    if (udp_socket < 0)
+    {
+      fprintf(stderr,"### Unable to connect to UDP host %s, port %d\n",
+              udp_host,udp_port);
+      return 1;
+    }
+    if (gro && enable_gro(udp_socket))
+      return 1;
+
+    printf("Copying packets...\n");
+    err = relay_uring(udp_socket,client_socket,packet_size,gro);
+    close(udp_socket);
+    close(client_socket);
+    if (err)
+    {
+      close(server_socket);
+      return err;
+    }
+  }
+}
+#endif // __linux__
+
+/*
+ * Read a TCP port to listen on, "<port>[:<policy>]", with `policy` as the
+ * default policy.
+ *
+ * Returns 0 if all went well, 1 if something went wrong.
+ */
+static int read_listener(char            *arg,
+                         int              policy,
+                         struct listener *listener)
+{
+  char *colon = strchr(arg,':');
+  listener->sock = -1;
+  listener->port = atoi(arg);
+  listener->policy = policy;
+  if (listener->port <= 0 || listener->port > 65535)
+  {
+    fprintf(stderr,"### Port %s does not make sense\n",arg);
+    return 1;
+  }
+  if (colon != NULL && (listener->policy = read_policy(colon + 1)) < 0)
+  {
+    fprintf(stderr,"### Unknown policy '%s' (not drop, disconnect or block)\n",
+            colon + 1);
+    return 1;
+  }
+  return 0;
+}
+
+int main(int argc, char **argv)
+{
+  char  *udp_host = NULL;
+  char  *colon;
+  char  *mult_arg = NULL;
+  char  *port_arg = NULL;
+  char  *extra_ports[MAX_LISTENERS];
+  int    num_extra = 0;
+  struct listener listeners[MAX_LISTENERS];
+  int    num_listeners = 0;
+  int    policy = POLICY_DROP;
+  long   udp_port = 88;
+  int    mult = 7;
+  int    gro = 0;
+  int    uring = 0;
+  int    flush_bytes = 0;
+  int    latency_ms = 10;
+  int    zerocopy = 0;
+  int    zc_threshold = 16384;
+  int    ring_ms = 1000;
+  int    bitrate = 40000000;
+  int    report = 0;
+  int    ii = 1;
+  int    bad = 0;
+
+  while (ii < argc)
+  {
+    if (!strcmp("-gro",argv[ii]))
+      gro = 1;
+    else if (!strcmp("-uring",argv[ii]))
+      uring = 1;
+    else if (!strcmp("-zerocopy",argv[ii]))
+      zerocopy = 1;
+    else if (!strcmp("-flush",argv[ii]) || !strcmp("-latency",argv[ii]) ||
+             !strcmp("-report",argv[ii]) || !strcmp("-ring",argv[ii]) ||
+             !strcmp("-bitrate",argv[ii]) || !strcmp("-zcmin",argv[ii]) ||
+             !strcmp("-policy",argv[ii]) || !strcmp("-listen",argv[ii]))
+    {
+      int  value;
+      if (ii + 1 >= argc)
+      {
+        fprintf(stderr,"### %s needs an argument\n",argv[ii]);
+        return 1;
+      }
+      if (!strcmp("-policy",argv[ii]))
+      {
+        policy = read_policy(argv[ii+1]);
+        if (policy < 0)
+        {
+          fprintf(stderr,"### Unknown policy '%s' (not drop, disconnect or"
+                  " block)\n",argv[ii+1]);
+          return 1;
+        }
+        ii += 2;
+        continue;
+      }
+      if (!strcmp("-listen",argv[ii]))
+      {
+        if (num_extra == MAX_LISTENERS - 1)
+        {
+          fprintf(stderr,"### Cannot listen on more than %d ports\n",
+                  MAX_LISTENERS);
+          return 1;
+        }
+        extra_ports[num_extra++] = argv[ii+1];
+        ii += 2;
+        continue;
+      }
+      value = atoi(argv[ii+1]);
+      if (value < 0 || (value == 0 && (!strcmp("-ring",argv[ii]) ||
+                                       !strcmp("-bitrate",argv[ii]))))
+      {
+        fprintf(stderr,"### %s %s does not make sense\n",argv[ii],argv[ii+1]);
+        return 1;
+      }
+      if (!strcmp("-flush",argv[ii]))
+        flush_bytes = value;
+      else if (!strcmp("-latency",argv[ii]))
+        latency_ms = value;
+      else if (!strcmp("-ring",argv[ii]))
+        ring_ms = value;
+      else if (!strcmp("-bitrate",argv[ii]))
+        bitrate = value;
+      else if (!strcmp("-zcmin",argv[ii]))
+        zc_threshold = value;
+      else
+        report = value;
+      ii++;
+    }
+    else if (udp_host == NULL)
+      udp_host = argv[ii];
+    else if (port_arg == NULL)
+      port_arg = argv[ii];
+    else if (mult_arg == NULL)
+      mult_arg = argv[ii];
+    else
+      bad = 1;
+    ii++;
+  }
+
+  if (udp_host == NULL || port_arg == NULL || bad)
+  {
+    fprintf(stderr,"Usage: udp2tcp <from>[:<port>] <listen-port>[:<policy>] [<mult>] [-gro]\n"
+            "               [-policy <policy>] [-listen <port>[:<policy>]]...\n"
+            "               [-ring <ms>] [-bitrate <bits/s>]\n"
+            "               [-flush <bytes>] [-latency <ms>]\n"
+            "               [-zerocopy [-zcmin <bytes>]]\n"
+            "               [-report <s>] [-uring]\n"
+            "Reads packets over UDP from the host with IP <from>, default port 88.\n"
+            "Listens on TCP port <listen-port> (and any other ports given with\n"
+            "-listen) for connections, and streams the UDP packets over TCP to\n"
+            "each client that connects, from when they connect.\n"
+            "If <mult> is given, it is the size of the packets in multiples of 188\n"
+            "(i.e., TS packets are assumed). <mult> defaults to 7.\n"
+            "If -gro is given, the kernel is asked to coalesce incoming packets\n"
+            "(UDP generic receive offload), so fewer reads are needed.\n"
+            "\n"
+            "UDP is read by a thread of its own, into a ring that packets are kept\n"
+            "in until every client has been sent them, so that TCP clients being\n"
+            "slow for a while doesn't make us lose UDP packets. The ring holds\n"
+            "<ms> milliseconds (-ring, default 1000) of a stream of <bits/s>\n"
+            "(-bitrate, default 40000000). If it fills up because a client is\n"
+            "not keeping up, what happens depends on the <policy> of the port it\n"
+            "connected to (-policy sets the default):\n"
+            "  drop        it misses the oldest packets (the default)\n"
+            "  disconnect  it is disconnected\n"
+            "  block       we stop reading UDP until it catches up\n"
+            "\n"
+            "Each client is normally written to as soon as there is something to\n"
+            "send. If -flush is given, we wait until there are at least <bytes>,\n"
+            "or the oldest has waited <ms> milliseconds (-latency, default 10),\n"
+            "whichever is sooner. Bigger writes use less CPU, but add latency.\n"
+            "If -zerocopy is given, writes of at least <bytes> (-zcmin, default\n"
+            "16384) use MSG_ZEROCOPY, so the kernel sends straight from our ring\n"
+            "rather than copying the data (Linux 4.14 or later). This is mostly\n"
+            "useful along with -flush. Data the kernel is still sending can't be\n"
+            "dropped, so the ring is made %d ms bigger, and a \"drop\" client is\n"
+            "disconnected instead if its oldest packets are still unacknowledged\n"
+            "%d ms after the ring fills (or at once, if it has stopped reading).\n"
+            "What was written to each client (and why) is reported when it goes\n"
+            "away. If -report is given, every <s> seconds we also report how full\n"
+            "the ring has been (its high and low water marks), and how many UDP\n"
+            "packets were dropped, either by us or by the kernel.\n"
+            "\n"
+            "If -uring is given, only one client is served at a time, and packets\n"
+            "are copied to it using io_uring (Linux 6.0 or later), which needs far\n"
+            "fewer system calls. The -listen, -policy, -ring, -flush and -zerocopy\n"
+            "options are then ignored.\n",
+            ZC_WAIT_MS,ZC_WAIT_MS);
+    return 1;
+  }
+
+  if ((colon = strchr(udp_host, ':')))
+  {
+    *colon = '\0';
+    udp_port = atoi(colon + 1);
+  }
+
+  if (mult_arg != NULL)
+  {
+    mult = atoi(mult_arg);
+    if (mult <= 0)
+    {
+      fprintf(stderr,"Packet size multiplier %s does not make sense\n",mult_arg);
+      return 1;
+    }
+  }
+
+  if (read_listener(port_arg,policy,&listeners[num_listeners++]))
+    return 1;
+  for (ii = 0; ii < num_extra; ii++)
+    if (read_listener(extra_ports[ii],policy,&listeners[num_listeners++]))
+      return 1;
+
+  printf("UDP from %s:%ld, packet size = %d (%d * 188)\n",
+         udp_host,udp_port,mult*TS_PACKET_SIZE,mult);
+  if (gro)
+    printf("Using UDP GRO\n");
+
+  if (uring)
+  {
+#ifdef __linux__
+    int  err;
+    printf("Using io_uring, serving one client at a time on port %d\n",
+           listeners[0].port);
+    err = run_uring_server(udp_host,udp_port,listeners[0].port,mult,gro);
+    if (err != 2)
+      return err;
+    fprintf(stderr,"!!! Warning: falling back to epoll\n");
+#else
+    fprintf(stderr,"### -uring is only supported on Linux\n");
+    return 1;
+#endif
+  }
+
+  if (flush_bytes > 0)
+    printf("Writing when %d bytes are waiting, or after %d ms\n",
+           flush_bytes,latency_ms);
+  if (zerocopy)
+    printf("Using MSG_ZEROCOPY for writes of %d bytes or more\n",zc_threshold);
+
+  return run_server(udp_host,udp_port,listeners,num_listeners,mult,gro,
+                    flush_bytes,latency_ms,zerocopy,zc_threshold,
+                    ring_ms,bitrate,report);
 }
@@ -10,6 +10,8 @@
  * Date: 2005-03-31
  */
 
+#define _GNU_SOURCE      // for sendmmsg, pthread_setaffinity_np
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
@@ -19,13 +21,90 @@
 #include <sys/wait.h>
 #include <sys/types.h>
 #include <netdb.h>       // gethostbyname
-#include <sys/socket.h>  // send
+#include <sys/socket.h>  // send, sendmmsg
+#include <sys/uio.h>     // struct iovec
 #include <arpa/inet.h>   // inet_aton
 #include <netinet/in.h>  // sockaddr_in
+#include <netinet/udp.h> // UDP_SEGMENT
+#if defined(__linux__)
+#include <linux/net_tstamp.h> // struct sock_txtime
+#include <linux/errqueue.h>   // struct sock_extended_err
+#endif
 #include <unistd.h>      // open, close
 #include <sys/time.h>    // gettimeofday
+#include <time.h>        // clock_gettime, clock_nanosleep
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>       // sched_getaffinity
 
 #define TS_PACKET_SIZE 188
+#define MAX_BATCH      1024
+
+// Linux won't segment a single send into more datagrams than this, and
+// the whole send must still fit into a single (maximum size) UDP datagram
+#define MAX_GSO_SEGMENTS  64
+#define MAX_GSO_BYTES     65507
+
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+
+// Room for the control message that tells the kernel the segment size,
+// or when to send the packet
+union msg_control
+{
+  char            buf[CMSG_SPACE(sizeof(uint64_t))];
+  struct cmsghdr  align;
+};
+
+/*
+ * Put the packet number into the first four bytes of a packet
+ * (least significant byte first), so the client can check it
+ */
+static void set_packet_number(unsigned char data[],
+                              unsigned int  packet_number)
+{
+  data[0] =  packet_number        & 0xFF;
+  data[1] = (packet_number >>  8) & 0xFF;
+  data[2] = (packet_number >> 16) & 0xFF;
+  data[3] = (packet_number >> 24) & 0xFF;
+}
+
+/*
+ * Put the stream id into the next two bytes (again least significant
+ * byte first), so a client receiving several streams can tell them apart
+ */
+static void set_stream_id(unsigned char data[],
+                          unsigned int  stream_id)
+{
+  data[4] =  stream_id       & 0xFF;
+  data[5] = (stream_id >> 8) & 0xFF;
+}
+
+// Which clock the send time in a packet comes from
+#define SEND_CLOCK_NONE     0
+#define SEND_CLOCK_REALTIME 1
+#define SEND_CLOCK_TAI      2
+
+/*
+ * Put the time a packet is sent (in nanoseconds) into bytes 8..15 (least
+ * significant byte first), and which clock it is from into byte 6, so the
+ * client can work out how long it took to get there. Byte 7 is 0, for now.
+ */
+static void set_send_time(unsigned char data[],
+                          int           send_clock,
+                          uint64_t      when)
+{
+  int  ii;
+  data[6] = send_clock;
+  data[7] = 0;
+  for (ii = 8; ii < 16; ii++)
+  {
+    data[ii] = when & 0xFF;
+    when >>= 8;
+  }
+}
 
 static void write_socket_data(int           output,
                               unsigned char data[],
@@ -65,6 +144,399 @@ static void write_socket_data(int           output,
   return;
 }
 
+/*
+ * Write a batch of messages out to a socket, using as few system calls
+ * as possible
+ *
+ * - `output` is the (connected) socket to write to
+ * - `msgs` describes the messages to write
+ * - `count` is how many there are
+ * - `per_msg` is how many packets there are in each message (more than
+ *   one if the kernel is segmenting them for us)
+ * - `packet_number` is the packet number of the first packet
+ *
+ * Returns the number of messages written. If that is less than `count`,
+ * then `errno` says why.
+ */
+static int write_socket_batch(int             output,
+                              struct mmsghdr  msgs[],
+                              int             count,
+                              int             per_msg,
+                              unsigned int    packet_number)
+{
+  int  sent = 0;
+
+  // sendmmsg may send fewer than we asked (for instance, if the socket
+  // buffer fills up part way through), in which case we just carry on
+  // with the rest
+  while (sent < count)
+  {
+    int  result = sendmmsg(output,&msgs[sent],count - sent,0);
+    if (result == -1)
+    {
+      if (errno == ENOBUFS)
+      {
+        fprintf(stderr,"!!! Warning: 'no buffer space available' writing out"
+                " packet %u - retrying\n",packet_number + sent*per_msg);
+        continue;
+      }
+      else if (errno == EINTR)
+        continue;
+      else
+        return sent;
+    }
+    sent += result;
+  }
+  return sent;
+}
+
+/*
+ * Describe the packets in `data` as messages for write_socket_batch()
+ *
+ * - `data` is `count` packets, each `data_len` bytes, back to back
+ * - `gso` is how many packets to put into each message, for the kernel to
+ *   split up again. If it is 1, each packet is a message of its own.
+ * - `msgs`, `iovecs` and `control` must have room for `count` messages
+ *
+ * Returns the number of messages.
+ */
+static int setup_messages(unsigned char      *data,
+                          int                 data_len,
+                          int                 count,
+                          int                 gso,
+                          struct mmsghdr      msgs[],
+                          struct iovec        iovecs[],
+                          union msg_control   control[])
+{
+  int  ii;
+  int  num_msgs = count / gso;
+
+  memset(msgs,0,count*sizeof(struct mmsghdr));
+  memset(control,0,count*sizeof(union msg_control));
+  for (ii = 0; ii < num_msgs; ii++)
+  {
+    iovecs[ii].iov_base = &data[ii*gso*data_len];
+    iovecs[ii].iov_len = gso*data_len;
+    msgs[ii].msg_hdr.msg_iov = &iovecs[ii];
+    msgs[ii].msg_hdr.msg_iovlen = 1;
+    if (gso > 1)
+    {
+      struct cmsghdr *cmsg;
+      msgs[ii].msg_hdr.msg_control = control[ii].buf;
+      msgs[ii].msg_hdr.msg_controllen = CMSG_SPACE(sizeof(uint16_t));
+      cmsg = CMSG_FIRSTHDR(&msgs[ii].msg_hdr);
+      cmsg->cmsg_level = IPPROTO_UDP;
+      cmsg->cmsg_type = UDP_SEGMENT;
+      cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+      *(uint16_t *)CMSG_DATA(cmsg) = data_len;
+    }
+  }
+  return num_msgs;
+}
+
+/*
+ * Pacing to a target bitrate
+ *
+ * Rather than sleeping for a fixed time after each send (which drifts, as
+ * the time taken to send isn't counted, and is at the mercy of how long
+ * the system takes to wake us up), we work out when each send *should*
+ * happen, from when we started and how much we've sent, and sleep until
+ * then. To avoid being late because of the time it takes to wake up, we
+ * sleep until a little before the deadline, and spin for the rest.
+ *
+ * If we do get behind (because we were descheduled, or the send blocked),
+ * we're allowed to catch up by sending up to `burst` packets back to back
+ * - much like a token bucket of that size - but no more, so that we never
+ * send a large burst just because we were held up for a while.
+ */
+struct pacer
+{
+  double    ns_per_packet;   // how long each packet "takes" at our rate
+  double    target_gap;      // how long between sends, ideally
+  double    start;           // when packet 0 was (notionally) due
+  uint64_t  packets;         // how many packets we've sent
+  uint64_t  burst;           // packets we may send back to back to catch up
+  uint64_t  spin_ns;         // spin for this long before each deadline
+  // Statistics about the gaps between sends, since the last report
+  uint64_t  last_send;
+  uint64_t  gaps;
+  double    gap_sum;
+  double    gap_deviation;   // sum of |gap - target_gap|
+  double    gap_max;
+  uint64_t  late;            // how many times we've had to drop behind
+};
+
+static uint64_t now_ns(void)
+{
+  struct timespec  ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void init_pacer(struct pacer *pacer,
+                       double        rate,
+                       int           data_len,
+                       int           per_send,
+                       uint64_t      burst,
+                       uint64_t      spin_ns)
+{
+  memset(pacer,0,sizeof(*pacer));
+  pacer->ns_per_packet = data_len * 8 * 1e9 / rate;
+  pacer->target_gap = pacer->ns_per_packet * per_send;
+  pacer->burst = burst;
+  pacer->spin_ns = spin_ns;
+  pacer->start = now_ns();
+}
+
+/*
+ * When the next send is due
+ */
+static double pacer_due(struct pacer *pacer)
+{
+  return pacer->start + pacer->packets * pacer->ns_per_packet;
+}
+
+/*
+ * Wait until (CLOCK_MONOTONIC) time `deadline`, in nanoseconds
+ */
+static void wait_until(uint64_t  deadline,
+                       uint64_t  spin_ns)
+{
+  uint64_t  now = now_ns();
+  if (deadline > now + spin_ns)
+  {
+    struct timespec  wake;
+    uint64_t         when = deadline - spin_ns;
+    wake.tv_sec  = when / 1000000000;
+    wake.tv_nsec = when % 1000000000;
+    while (clock_nanosleep(CLOCK_MONOTONIC,TIMER_ABSTIME,&wake,NULL) == EINTR)
+      ;
+  }
+  while (now_ns() < deadline)
+    ;
+}
+
+/*
+ * Wait until it is time to send the next `count` packets.
+ *
+ * If `lead_ns` is not 0, then the kernel is going to hold on to the
+ * packets until it is time for them to go (see set_txtimes()), so we
+ * only need to wait until that long before then.
+ *
+ * Returns the time the first of the packets is due to be sent.
+ */
+static uint64_t pace(struct pacer *pacer,
+                     int           count,
+                     uint64_t      lead_ns)
+{
+  double    deadline = pacer_due(pacer);
+  uint64_t  now = now_ns() + lead_ns;
+  double    allowed = pacer->burst * pacer->ns_per_packet;
+
+  if (now > deadline + allowed)
+  {
+    // We're further behind than we're allowed to catch up, so pretend
+    // we started later than we did
+    pacer->start += now - (deadline + allowed);
+    deadline = now - allowed;
+    pacer->late ++;
+  }
+  if (deadline > now)
+    wait_until((uint64_t)deadline - lead_ns,pacer->spin_ns);
+
+  now = now_ns();
+  if (pacer->last_send != 0)
+  {
+    double  gap = now - pacer->last_send;
+    pacer->gaps ++;
+    pacer->gap_sum += gap;
+    pacer->gap_deviation += (gap > pacer->target_gap ? gap - pacer->target_gap
+                                                     : pacer->target_gap - gap);
+    if (gap > pacer->gap_max)
+      pacer->gap_max = gap;
+  }
+  pacer->last_send = now;
+  pacer->packets += count;
+  return (uint64_t)deadline;
+}
+
+/*
+ * Kernel pacing (SO_TXTIME)
+ *
+ * Instead of waking up for each send, we can give the kernel each packet
+ * in advance, with the time it should be sent, and let the "fq" or "etf"
+ * queueing discipline send it then. For instance:
+ *
+ *    tc qdisc replace dev eth0 root fq
+ *
+ * fq works in CLOCK_MONOTONIC time, etf in CLOCK_TAI. Either can tell us
+ * (via the socket's error queue) about packets it has had to drop because
+ * their time had already passed, or was nonsense.
+ */
+struct txtime
+{
+  clockid_t  clock;
+  int64_t    offset;      // add to CLOCK_MONOTONIC to get `clock`
+  uint64_t   lead_ns;     // how far ahead to give packets to the kernel
+  uint64_t   missed;      // packets dropped because they were too late
+  uint64_t   invalid;     // packets dropped because the time made no sense
+  uint64_t   last_missed; // (CLOCK_MONOTONIC) time the last one was due
+};
+
+/*
+ * Ask the kernel to honour the send times we give it.
+ *
+ * Returns 0 if all went well, 1 if something went wrong.
+ */
+static int enable_txtime(int            output,
+                         struct txtime *txtime)
+{
+#if defined(__linux__) && defined(SO_TXTIME)
+  struct sock_txtime  config;
+  struct timespec     mono, other;
+
+  memset(&config,0,sizeof(config));
+  config.clockid = txtime->clock;
+  config.flags = SOF_TXTIME_REPORT_ERRORS;
+  if (setsockopt(output,SOL_SOCKET,SO_TXTIME,&config,sizeof(config)) == -1)
+  {
+    fprintf(stderr,"### Unable to enable SO_TXTIME: %s\n",strerror(errno));
+    return 1;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC,&mono);
+  clock_gettime(txtime->clock,&other);
+  txtime->offset = ((int64_t)other.tv_sec - mono.tv_sec) * 1000000000 +
+    (other.tv_nsec - mono.tv_nsec);
+  return 0;
+#else
+  fprintf(stderr,"### SO_TXTIME is not supported on this system\n");
+  return 1;
+#endif
+}
+
+/*
+ * Put send times on each of the `count` messages in `msgs`, the first due
+ * at (CLOCK_MONOTONIC) time `first`, and each following `ns_per_packet`
+ * after the one before.
+ */
+static void set_txtimes(struct mmsghdr     msgs[],
+                        union msg_control  control[],
+                        int                count,
+                        struct txtime     *txtime,
+                        uint64_t           first,
+                        double             ns_per_packet)
+{
+#if defined(__linux__) && defined(SO_TXTIME)
+  int  ii;
+  for (ii = 0; ii < count; ii++)
+  {
+    struct cmsghdr *cmsg;
+    uint64_t        when = first + (uint64_t)(ii * ns_per_packet) + txtime->offset;
+    msgs[ii].msg_hdr.msg_control = control[ii].buf;
+    msgs[ii].msg_hdr.msg_controllen = CMSG_SPACE(sizeof(uint64_t));
+    cmsg = CMSG_FIRSTHDR(&msgs[ii].msg_hdr);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_TXTIME;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(uint64_t));
+    memcpy(CMSG_DATA(cmsg),&when,sizeof(when));
+  }
+#endif
+}
+
+/*
+ * Collect any reports of dropped packets from the socket's error queue
+ */
+static void read_txtime_errors(int            output,
+                               struct txtime *txtime)
+{
+#if defined(__linux__) && defined(SO_TXTIME)
+  for (;;)
+  {
+    char            data[64];
+    char            control[CMSG_SPACE(sizeof(struct sock_extended_err)) +
+                            CMSG_SPACE(sizeof(struct sockaddr_in))];
+    struct iovec    iov = { data, sizeof(data) };
+    struct msghdr   msg;
+    struct cmsghdr *cmsg;
+
+    memset(&msg,0,sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if (recvmsg(output,&msg,MSG_ERRQUEUE | MSG_DONTWAIT) == -1)
+      break;  // (normally EAGAIN, i.e., nothing more to read)
+
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg,cmsg))
+    {
+      struct sock_extended_err *err;
+      if (cmsg->cmsg_level != IPPROTO_IP || cmsg->cmsg_type != IP_RECVERR)
+        continue;
+      err = (struct sock_extended_err *)CMSG_DATA(cmsg);
+      if (err->ee_origin != SO_EE_ORIGIN_TXTIME)
+        continue;
+      if (err->ee_code == SO_EE_CODE_TXTIME_MISSED)
+      {
+        // The send time is split between two 32 bit fields
+        uint64_t  when = ((uint64_t)err->ee_data << 32) | err->ee_info;
+        txtime->missed ++;
+        txtime->last_missed = when - txtime->offset;
+      }
+      else
+        txtime->invalid ++;
+    }
+  }
+#endif
+}
+
+/*
+ * Report on how well we're keeping to our rate, and start collecting
+ * statistics afresh.
+ */
+static void report_pacer(struct pacer *pacer,
+                         double        rate,
+                         double        achieved)
+{
+  printf("    target %.0f bits/second, achieved %.0f (%.2f%%)",
+         rate,achieved,100.0 * achieved / rate);
+  if (pacer->gaps > 0)
+  {
+    // Jitter is the mean difference between the actual and ideal gap
+    printf(", gap between sends %.1f us (target %.1f), jitter %.1f us,"
+           " max %.1f us",pacer->gap_sum / pacer->gaps / 1000,
+           pacer->target_gap / 1000,
+           pacer->gap_deviation / pacer->gaps / 1000,pacer->gap_max / 1000);
+  }
+  if (pacer->late > 0)
+    printf(", fell behind %llu times",(unsigned long long)pacer->late);
+  printf("\n");
+  pacer->gaps = 0;
+  pacer->gap_sum = pacer->gap_deviation = pacer->gap_max = 0;
+  pacer->late = 0;
+}
+
+/*
+ * Read a bitrate, which may have a suffix of k, M or G (powers of 1000)
+ *
+ * Returns the rate, or 0 if it doesn't make sense.
+ */
+static double read_rate(char *text)
+{
+  char   *ptr;
+  double  rate = strtod(text,&ptr);
+  switch (*ptr)
+  {
+  case 'k': case 'K': rate *= 1e3; ptr++; break;
+  case 'm': case 'M': rate *= 1e6; ptr++; break;
+  case 'g': case 'G': rate *= 1e9; ptr++; break;
+  default: break;
+  }
+  if (ptr == text || *ptr != '\0' || rate <= 0)
+    return 0;
+  return rate;
+}
+
 extern int connect_udp_socket(char *hostname,
                               int   port,
                               char *multicast_ifaddr)
@@ -141,30 +613,567 @@ extern int connect_udp_socket(char *hostname,
   return output;
 }
 
+/*
+ * Multiple streams
+ *
+ * We can send several streams at once, each to its own destination, with
+ * its own rate, packet size and packet numbers, spread over a number of
+ * threads. Each packet carries the id of its stream (see set_stream_id()),
+ * so a client receiving more than one can tell them apart.
+ */
+struct stream
+{
+  int                id;
+  char               label[24];      // "" or "Stream <id>: ", for messages
+  char              *hostname;
+  long               port;
+  long               mult;
+  double             rate;           // bits/second, or 0 to use -delay
+  int                socket;
+  unsigned char     *data;
+  int                data_len;
+  int                gso;
+  int                per_send;
+  int                num_msgs;
+  struct mmsghdr    *msgs;
+  struct iovec      *iovecs;
+  union msg_control *control;
+  struct pacer       pacer;
+  struct txtime      txtime;
+  unsigned int       packet_number;
+  int                sleep_count;
+  unsigned int       packets_since_report;
+  struct timeval     then;
+  // Running totals, read by the main thread for the aggregate report
+  _Atomic uint64_t   total_packets;
+  _Atomic uint64_t   total_bytes;
+};
+
+// The settings that are the same for all streams
+struct settings
+{
+  char          *multicast_if;
+  unsigned long  delay;
+  int            every;
+  int            batch;
+  int            gso;
+  int            burst;
+  unsigned long  spin;
+  int            use_txtime;
+  int            send_clock;     // SEND_CLOCK_xxx
+  clockid_t      txtime_clock;
+  unsigned long  lead;
+};
+
+// Each thread sends one or more streams
+struct worker
+{
+  int               cpu;          // -1 if not pinned
+  int               num_streams;
+  struct stream   **streams;
+  struct settings  *settings;
+  pthread_t         thread;
+};
+
+/*
+ * Split "<host>[:<port>]" in `text` into its parts (nb: `text` is altered
+ * to leave just the host name). `port` is left alone if none is given.
+ *
+ * Returns 0 if all went well, 1 if something went wrong.
+ */
+static int read_host_port(char *text,
+                          long *port)
+{
+  char *p = strchr(text,':');
+  if (p != NULL)
+  {
+    char *ptr;
+    p[0] = '\0';
+    errno = 0;
+    *port = strtol(p+1,&ptr,10);
+    if (errno)
+    {
+      p[0] = ':';
+      fprintf(stderr,"### Cannot read port number in %s (%s)\n",
+              text,strerror(errno));
+      return 1;
+    }
+    if (ptr[0] != '\0')
+    {
+      p[0] = ':';
+      fprintf(stderr,"### Unexpected characters in port number in %s\n",
+              text);
+      return 1;
+    }
+    if (*port < 0)
+    {
+      p[0] = ':';
+      fprintf(stderr,"### Negative port number in %s\n",text);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Read a packet size multiplier
+ *
+ * Returns the multiplier, or 0 if it doesn't make sense.
+ */
+static long read_mult(char *text)
+{
+  long mult = atoi(text);
+  if (mult <= 0)
+  {
+    fprintf(stderr,"### Packet size multiplier %s does not make sense\n",text);
+    return 0;
+  }
+  else if (mult > 100)
+  {
+    fprintf(stderr,"### Packet size multiplier > 100 not supported\n");
+    return 0;
+  }
+  return mult;
+}
+
+/*
+ * Read a stream description, "<host>[:<port>][,rate=<bits/s>][,mult=<n>]"
+ * into `stream` (nb: `text` is altered). Anything not given is left alone.
+ *
+ * Returns 0 if all went well, 1 if something went wrong.
+ */
+static int read_stream(char          *text,
+                       struct stream *stream)
+{
+  char *option = strchr(text,',');
+  if (option != NULL)
+    *option++ = '\0';
+  stream->hostname = text;
+  if (read_host_port(text,&stream->port))
+    return 1;
+  while (option != NULL)
+  {
+    char *next = strchr(option,',');
+    if (next != NULL)
+      *next++ = '\0';
+    if (!strncmp("rate=",option,5))
+    {
+      stream->rate = read_rate(option+5);
+      if (stream->rate == 0)
+      {
+        fprintf(stderr,"### Rate %s does not make sense\n",option+5);
+        return 1;
+      }
+    }
+    else if (!strncmp("mult=",option,5))
+    {
+      stream->mult = read_mult(option+5);
+      if (stream->mult == 0)
+        return 1;
+    }
+    else
+    {
+      fprintf(stderr,"### Unexpected '%s' in stream %s\n",option,text);
+      return 1;
+    }
+    option = next;
+  }
+  return 0;
+}
+
+/*
+ * Connect a stream to its destination, and get its packets ready
+ *
+ * Returns 0 if all went well, 1 if something went wrong.
+ */
+static int setup_stream(struct stream   *stream,
+                        struct settings *settings)
+{
+  int  ii;
+
+  stream->socket = connect_udp_socket(stream->hostname,stream->port,
+                                      settings->multicast_if);
+  if (stream->socket < 0) return 1;
+
+  if (settings->use_txtime)
+  {
+    stream->txtime.clock = settings->txtime_clock;
+    stream->txtime.lead_ns = settings->lead * 1000;
+    if (enable_txtime(stream->socket,&stream->txtime))
+      return 1;
+  }
+
+  stream->data_len = stream->mult*TS_PACKET_SIZE;
+  stream->gso = settings->gso;
+  if (stream->gso * stream->data_len > MAX_GSO_BYTES)
+  {
+    stream->gso = MAX_GSO_BYTES / stream->data_len;
+    fprintf(stderr,"!!! Warning: %sonly %d packets of %d bytes fit into one"
+            " GSO send - using that\n",stream->label,stream->gso,
+            stream->data_len);
+  }
+  stream->per_send = settings->batch * stream->gso;
+  stream->num_msgs = 1;
+
+  stream->data = malloc(stream->per_send*stream->data_len);
+  if (stream->data == NULL)
+  {
+    fprintf(stderr,"### Unable to allocate %d packets of %d bytes\n",
+            stream->per_send,stream->data_len);
+    return 1;
+  }
+  memset(stream->data,0xFF,stream->per_send*stream->data_len);
+  for (ii = 0; ii < stream->per_send; ii++)
+    set_stream_id(&stream->data[ii*stream->data_len],stream->id);
+
+  if (stream->per_send > 1 || settings->use_txtime)
+  {
+    stream->msgs = calloc(stream->per_send,sizeof(struct mmsghdr));
+    stream->iovecs = calloc(stream->per_send,sizeof(struct iovec));
+    stream->control = calloc(stream->per_send,sizeof(union msg_control));
+    if (stream->msgs == NULL || stream->iovecs == NULL || stream->control == NULL)
+    {
+      fprintf(stderr,"### Unable to allocate batch of %d messages\n",
+              stream->per_send);
+      return 1;
+    }
+    stream->num_msgs = setup_messages(stream->data,stream->data_len,
+                                      stream->per_send,stream->gso,
+                                      stream->msgs,stream->iovecs,
+                                      stream->control);
+  }
+
+  printf("%sTransmitting with packet size %d (%ld*%d)\n",stream->label,
+         stream->data_len,stream->mult,TS_PACKET_SIZE);
+  if (settings->batch > 1)
+    printf("%sSending %d %s at a time\n",stream->label,settings->batch,
+           (stream->gso > 1 ? "GSO sends":"packets"));
+  if (stream->gso > 1)
+    printf("%sSending %d packets in each GSO send\n",stream->label,stream->gso);
+  if (stream->rate > 0)
+  {
+    printf("%sSending at %.0f bits/second, bursts of at most %d packets\n",
+           stream->label,stream->rate,
+           (settings->burst < stream->per_send ? stream->per_send
+                                               : settings->burst));
+    if (settings->use_txtime)
+      printf("%sLeaving the timing to the %s qdisc, %lu microseconds ahead\n",
+             stream->label,(settings->txtime_clock == CLOCK_TAI ? "etf":"fq"),
+             settings->lead);
+  }
+  else
+    printf("%sDelaying %lu microseconds between %s\n",stream->label,
+           settings->delay,(stream->per_send > 1 ? "batches":"packets"));
+  return 0;
+}
+
+/*
+ * Get ready to start sending a stream
+ */
+static void start_stream(struct stream   *stream,
+                         struct settings *settings)
+{
+  if (stream->rate > 0)
+    init_pacer(&stream->pacer,stream->rate,stream->data_len,stream->per_send,
+               (settings->burst < stream->per_send ? stream->per_send
+                                                   : settings->burst),
+               settings->spin*1000);
+  stream->sleep_count = 1;
+  gettimeofday(&stream->then, NULL);
+}
+
+/*
+ * Put the send time into each of the packets we're about to send. If the
+ * kernel is pacing them, each will go at its own time, the first at
+ * (CLOCK_MONOTONIC) time `first`, otherwise they'll all go right now.
+ */
+static void set_send_times(struct stream   *stream,
+                           struct settings *settings,
+                           uint64_t         first)
+{
+  struct timespec  ts;
+  uint64_t         now;
+  int64_t          to_first = 0;
+  int              ii;
+
+  clock_gettime((settings->send_clock == SEND_CLOCK_TAI ? CLOCK_TAI
+                                                        : CLOCK_REALTIME),&ts);
+  now = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+  if (settings->use_txtime)
+    to_first = (int64_t)(first - now_ns());
+  for (ii = 0; ii < stream->per_send; ii++)
+  {
+    uint64_t  when = now;
+    if (settings->use_txtime)
+      when += to_first + (int64_t)(ii * stream->pacer.ns_per_packet);
+    set_send_time(&stream->data[ii*stream->data_len],settings->send_clock,when);
+  }
+}
+
+/*
+ * Send the next packet (or batch of packets) in a stream, and report on
+ * how we're doing every so often
+ */
+static void send_stream(struct stream   *stream,
+                        struct settings *settings)
+{
+  int  ii;
+  int  per_send = stream->per_send;
+  unsigned int  packet_number = stream->packet_number;
+  uint64_t      first = 0;
+
+  for (ii = 0; ii < per_send; ii++)
+    set_packet_number(&stream->data[ii*stream->data_len],packet_number + ii);
+  if (stream->rate > 0)
+  {
+    first = pace(&stream->pacer,per_send,
+                 (settings->use_txtime ? stream->txtime.lead_ns : 0));
+    if (settings->use_txtime)
+      set_txtimes(stream->msgs,stream->control,stream->num_msgs,
+                  &stream->txtime,first,stream->pacer.ns_per_packet);
+  }
+  if (settings->send_clock != SEND_CLOCK_NONE)
+    set_send_times(stream,settings,first);
+  if (per_send > 1 || settings->use_txtime)
+  {
+    int  sent = write_socket_batch(stream->socket,stream->msgs,
+                                   stream->num_msgs,stream->gso,packet_number);
+    if (sent < stream->num_msgs && stream->gso > 1 &&
+        (errno == EIO || errno == EINVAL || errno == ENOPROTOOPT ||
+         errno == EOPNOTSUPP))
+    {
+      // The kernel (or the network card driver) can't segment for us,
+      // so send the rest of this batch (and all the future ones) the
+      // ordinary way
+      fprintf(stderr,"!!! Warning: %sGSO send refused (%s) - sending"
+              " packets individually\n",stream->label,strerror(errno));
+      sent *= stream->gso;  // now counting packets rather than GSO sends
+      stream->gso = 1;
+      stream->num_msgs = setup_messages(stream->data,stream->data_len,
+                                        per_send,stream->gso,stream->msgs,
+                                        stream->iovecs,stream->control);
+      sent += write_socket_batch(stream->socket,&stream->msgs[sent],
+                                 stream->num_msgs - sent,1,
+                                 packet_number + sent);
+    }
+    if (sent < stream->num_msgs)
+      fprintf(stderr,"### %sError writing out packets %u..%u: %s\n",
+              stream->label,packet_number + sent*stream->gso,
+              packet_number + per_send - 1,strerror(errno));
+  }
+  else
+    write_socket_data(stream->socket,stream->data,stream->data_len,
+                      packet_number);
+  if (settings->use_txtime)
+    read_txtime_errors(stream->socket,&stream->txtime);
+  stream->packet_number += per_send;
+  stream->packets_since_report += per_send;
+  atomic_fetch_add_explicit(&stream->total_packets,per_send,
+                            memory_order_relaxed);
+  atomic_fetch_add_explicit(&stream->total_bytes,
+                            (uint64_t)per_send * stream->data_len,
+                            memory_order_relaxed);
+  if (stream->rate == 0 && settings->delay > 0)
+  {
+    stream->sleep_count ++;
+    if (stream->sleep_count > settings->every)
+    {
+      usleep(settings->delay);
+      stream->sleep_count = 1;
+    }
+  }
+#define REPORT_EVERY        10000
+#define US_PER_SECOND       1000000
+#define FLOAT_US_PER_SECOND 1000000.0
+  if (stream->packets_since_report >= REPORT_EVERY)
+  {
+    unsigned long  elapsed;
+    double         seconds;
+    double         bytes = (double)stream->data_len * stream->packets_since_report;
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    elapsed = (now.tv_sec - stream->then.tv_sec) * US_PER_SECOND +
+      (now.tv_usec - stream->then.tv_usec);
+    seconds = elapsed/FLOAT_US_PER_SECOND;
+    flockfile(stdout);  // keep our lines together, if there are other threads
+    printf("%s%u packets transmitted in %.2f seconds",stream->label,
+           stream->packets_since_report,seconds);
+    printf(" (i.e. %.0f packets/second, %.2f kilobytes/second, %.2f megabits/second)\n",
+           stream->packets_since_report / seconds,
+           (bytes/1024) / seconds,
+           (bytes*8/(1024*1024)) / seconds);
+    if (stream->rate > 0)
+      report_pacer(&stream->pacer,stream->rate,bytes*8/seconds);
+    if (settings->use_txtime &&
+        (stream->txtime.missed > 0 || stream->txtime.invalid > 0))
+    {
+      printf("  qdisc dropped %llu packets as too late, %llu as invalid",
+             (unsigned long long)stream->txtime.missed,
+             (unsigned long long)stream->txtime.invalid);
+      if (stream->txtime.missed > 0)
+        printf(" (last late packet about #%.0f)",
+               (stream->txtime.last_missed - stream->pacer.start) /
+               stream->pacer.ns_per_packet);
+      printf("\n");
+    }
+    funlockfile(stdout);
+    stream->packets_since_report = 0;
+    stream->then = now;
+  }
+}
+
+static void pin_to_cpu(int  cpu)
+{
+#if defined(__linux__)
+  cpu_set_t  set;
+  int        err;
+  if (cpu < 0)
+    return;
+  CPU_ZERO(&set);
+  CPU_SET(cpu,&set);
+  err = pthread_setaffinity_np(pthread_self(),sizeof(set),&set);
+  if (err)
+    fprintf(stderr,"!!! Warning: unable to pin thread to CPU %d: %s\n",
+            cpu,strerror(err));
+#endif
+}
+
+/*
+ * Work out which CPUs to pin `num_workers` threads to - one each, in turn,
+ * from the CPUs we're allowed to run on, going round again if there are
+ * more threads than CPUs.
+ */
+static void choose_cpus(struct worker workers[],
+                        int           num_workers)
+{
+  int  ii;
+#if defined(__linux__)
+  cpu_set_t  allowed;
+  int        cpu = -1;
+  if (sched_getaffinity(0,sizeof(allowed),&allowed) == -1 ||
+      CPU_COUNT(&allowed) == 0)
+  {
+    for (ii = 0; ii < num_workers; ii++)
+      workers[ii].cpu = -1;
+    return;
+  }
+  for (ii = 0; ii < num_workers; ii++)
+  {
+    do
+      cpu = (cpu + 1) % CPU_SETSIZE;
+    while (!CPU_ISSET(cpu,&allowed));
+    workers[ii].cpu = cpu;
+  }
+#else
+  for (ii = 0; ii < num_workers; ii++)
+    workers[ii].cpu = -1;
+#endif
+}
+
+/*
+ * Send a worker's streams, forever. If it has more than one, they are all
+ * paced, and we always send whichever is due next.
+ */
+static void *run_worker(void *arg)
+{
+  struct worker  *worker = arg;
+  int             ii;
+
+  pin_to_cpu(worker->cpu);
+  for (ii = 0; ii < worker->num_streams; ii++)
+    start_stream(worker->streams[ii],worker->settings);
+  for (;;)
+  {
+    struct stream *next = worker->streams[0];
+    for (ii = 1; ii < worker->num_streams; ii++)
+      if (pacer_due(&worker->streams[ii]->pacer) < pacer_due(&next->pacer))
+        next = worker->streams[ii];
+    send_stream(next,worker->settings);
+  }
+  return NULL;
+}
+
+/*
+ * Report on all the streams together, every so often, forever
+ */
+#define AGGREGATE_EVERY  5  // seconds
+static void report_aggregate(struct stream streams[],
+                             int           num_streams)
+{
+  uint64_t       last_packets = 0;
+  uint64_t       last_bytes = 0;
+  struct timeval then, now;
+
+  gettimeofday(&then, NULL);
+  for (;;)
+  {
+    uint64_t       packets = 0;
+    uint64_t       bytes = 0;
+    double         seconds;
+    int            ii;
+
+    sleep(AGGREGATE_EVERY);
+    for (ii = 0; ii < num_streams; ii++)
+    {
+      packets += atomic_load_explicit(&streams[ii].total_packets,
+                                      memory_order_relaxed);
+      bytes += atomic_load_explicit(&streams[ii].total_bytes,
+                                    memory_order_relaxed);
+    }
+    gettimeofday(&now, NULL);
+    seconds = ((now.tv_sec - then.tv_sec) * US_PER_SECOND +
+               (now.tv_usec - then.tv_usec)) / FLOAT_US_PER_SECOND;
+    printf("All %d streams: %llu packets transmitted in %.2f seconds"
+           " (i.e. %.0f packets/second, %.2f megabits/second)\n",
+           num_streams,(unsigned long long)(packets - last_packets),seconds,
+           (packets - last_packets) / seconds,
+           ((bytes - last_bytes)*8.0/(1024*1024)) / seconds);
+    last_packets = packets;
+    last_bytes = bytes;
+    then = now;
+  }
+}
+
 int main(int argc, char **argv)
 {
-  char *hostname;
-  char *p;
-  long  port = 88;
-  long  mult = 1;
-  char *multicast_if = NULL;
-  int   socket;
   int   ii;
-  unsigned char data[100*TS_PACKET_SIZE];
-  int           data_len;
-  unsigned int  packet_number = 0;
-  unsigned long delay = 1;
-  int every = 0;
-  struct timeval then;
-  struct timeval now;
+  long  mult = 1;
+  double rate = 0;
+  int   num_streams = 1;
+  int   num_workers = 1;
+  int   pin = 0;
+  struct stream    *streams;
+  struct worker    *workers;
+  struct settings   settings;
+
+  memset(&settings,0,sizeof(settings));
+  settings.delay = 1;
+  settings.every = 0;
+  settings.batch = 1;
+  settings.gso = 1;
+  settings.spin = 50;
+  settings.txtime_clock = CLOCK_MONOTONIC;
+  settings.lead = 2000;
 
   if (argc < 2)
   {
     fprintf(stderr,
             "Usage: udpserve <host>[:<port>] [-mult <mult>] [-if <interface>] [-delay <n>] [-every <n>]\n"
+            "                [-batch <n>] [-gso <n>] [-rate <bits/s> [-burst <n>] [-spin <us>]]\n"
+            "                [-txtime fq|etf [-lead <us>]] [-timestamp realtime|tai]\n"
+            "                [-stream <host>[:<port>][,rate=<bits/s>][,mult=<mult>]]... [-threads <n>]\n"
             "\n"
             "    <host> is the host to send data to, <port> defaults to 88\n"
             "\n"
+            "    Each packet starts with its packet number, as four bytes, least\n"
+            "    significant first, followed by the stream id (0 for <host>, see\n"
+            "    '-stream') as two bytes, likewise.\n"
+            "\n"
+            "    If '-timestamp' is given, the next two bytes say which clock (1 for\n"
+            "    CLOCK_REALTIME, 2 for CLOCK_TAI), and the eight after that the time\n"
+            "    (in nanoseconds, from that clock) that the packet was sent, so that\n"
+            "    udptest can measure delay and jitter.\n"
+            "\n"
             "    If '-mult' is given, it indicates that packets of size <mult>*188\n"
             "    bytes will be served. <mult> defaults to 1, and must be 1..20\n"
             "\n"
@@ -176,80 +1185,93 @@ int main(int argc, char **argv)
             "\n"
             "    If '-every' is given, only sleep after every <n>th packet\n"
             "    (the default is every 1, after every packet).\n"
+            "\n"
+            "    If '-batch' is given, <n> packets (each with its own packet number)\n"
+            "    are sent at a time, with a single system call. Any sleeping is then\n"
+            "    done between batches. <n> must be 1..%d, the default is 1.\n"
+            "\n"
+            "    If '-gso' is given, <n> packets are laid out one after another and\n"
+            "    sent as one, for the kernel (or network card) to split into separate\n"
+            "    datagrams (UDP generic segmentation offload). <n> must be 1..%d,\n"
+            "    and <n>*<mult>*188 must be no more than %d. If the kernel won't\n"
+            "    do this, packets are sent individually instead. '-gso' may be\n"
+            "    combined with '-batch', in which case <n> is multiplied by the\n"
+            "    batch size.\n"
+            "\n"
+            "    If '-rate' is given, packets are sent at a steady <bits/s> (which may\n"
+            "    end in k, M or G), and '-delay' and '-every' are ignored. Each send\n"
+            "    (of one packet, or a batch) is scheduled for an exact time, and if\n"
+            "    that is missed, at most '-burst' packets (the default is one send's\n"
+            "    worth) are sent back to back to catch up. To be on time, we spin\n"
+            "    for the last '-spin' microseconds (default 50) before each send.\n"
+            "\n"
+            "    If '-txtime' is also given, each packet is handed to the kernel\n"
+            "    '-lead' microseconds (default 2000) before it is due, marked with\n"
+            "    the time it should be sent (SO_TXTIME), and the 'fq' or 'etf'\n"
+            "    queueing discipline on the outgoing interface sends it then. The\n"
+            "    right one must already be set up, e.g. 'tc qdisc replace dev eth0\n"
+            "    root fq'. Packets the qdisc drops for being late are reported.\n"
+            "    '-txtime' cannot be combined with '-gso'.\n"
+            "\n"
+            "    Each '-stream' adds another stream of packets, to another <host>,\n"
+            "    with its own packet numbers. Streams are numbered 1, 2, ... in the\n"
+            "    order given. Their rate and <mult> default to '-rate' and '-mult'.\n"
+            "    The other options apply to all streams.\n"
+            "\n"
+            "    If '-threads' is given, the streams are shared out between <n>\n"
+            "    threads (in turn), each pinned to its own CPU. If a thread has more\n"
+            "    than one stream, they must all have a rate. With more than one\n"
+            "    stream, a report on all of them together is also given every %d\n"
+            "    seconds.\n",
+            MAX_BATCH,MAX_GSO_SEGMENTS,MAX_GSO_BYTES,AGGREGATE_EVERY
            );
     return 1;
   }
 
-  hostname = argv[1];
-  p = strchr(hostname,':');
-
-  if (p != NULL)
+  // There can't be more streams than there are arguments
+  streams = calloc(argc,sizeof(struct stream));
+  if (streams == NULL)
   {
-    char *ptr;
-    p[0] = '\0';  // nb: modifying argv[1]
-    errno = 0;
-    port = strtol(p+1,&ptr,10);
-    if (errno)
-    {
-      p[0] = ':';
-      fprintf(stderr,"### Cannot read port number in %s (%s)\n",
-              hostname,strerror(errno));
-      return 1;
-    }
-    if (ptr[0] != '\0')
-    {
-      p[0] = ':';
-      fprintf(stderr,"### Unexpected characters in port number in %s\n",
-              hostname);
-      return 1;
-    }
-    if (port < 0)
-    {
-      p[0] = ':';
-      fprintf(stderr,"### Negative port number in %s\n",hostname);
-      return 1;
-    }
+    fprintf(stderr,"### Unable to allocate stream descriptions\n");
+    return 1;
   }
+  streams[0].hostname = argv[1];  // nb: modified by read_host_port
+  streams[0].port = 88;
+  if (read_host_port(argv[1],&streams[0].port))
+    return 1;
 
   ii = 2;
   while (ii < argc)
   {
     if (!strcmp("-mult",argv[ii]))
     {
-      mult = atoi(argv[ii+1]);
-      if (mult <= 0)
-      {
-        fprintf(stderr,"### Packet size multiplier %s does not make sense\n",argv[ii+1]);
+      mult = read_mult(argv[ii+1]);
+      if (mult == 0)
         return 1;
-      }
-      else if (mult > 100)
-      {
-        fprintf(stderr,"### Packet size multiplier > 100 not supported\n");
-        return 1;
-      }
       ii ++;
     }
     else if (!strcmp("-if",argv[ii]))
     {
-      multicast_if = argv[ii+1];
+      settings.multicast_if = argv[ii+1];
       ii++;
     }
     else if (!strcmp("-delay",argv[ii]))
     {
-      delay = atoi(argv[ii+1]);
+      long delay = atol(argv[ii+1]);
       if (delay < 0)
       {
         fprintf(stderr,"### Delay %s does not make sense\n",argv[ii+1]);
         return 1;
       }
+      settings.delay = delay;
       ii ++;
     }
     else if (!strcmp("-every",argv[ii]))
     {
-      every = atoi(argv[ii+1]);
-      if (every < 1)
+      settings.every = atoi(argv[ii+1]);
+      if (settings.every < 1)
       {
-        if (every == 0)
+        if (settings.every == 0)
           fprintf(stderr,"### Try -delay 0 instead of -every 0\n");
         else
           fprintf(stderr,"### Sleep every %s does not make sense\n",argv[ii+1]);
@@ -257,6 +1279,106 @@ int main(int argc, char **argv)
       }
       ii ++;
     }
+    else if (!strcmp("-batch",argv[ii]))
+    {
+      settings.batch = atoi(argv[ii+1]);
+      if (settings.batch < 1 || settings.batch > MAX_BATCH)
+      {
+        fprintf(stderr,"### Batch size %s does not make sense (must be 1..%d)\n",
+                argv[ii+1],MAX_BATCH);
+        return 1;
+      }
+      ii ++;
+    }
+    else if (!strcmp("-gso",argv[ii]))
+    {
+      settings.gso = atoi(argv[ii+1]);
+      if (settings.gso < 1 || settings.gso > MAX_GSO_SEGMENTS)
+      {
+        fprintf(stderr,"### GSO segment count %s does not make sense (must be 1..%d)\n",
+                argv[ii+1],MAX_GSO_SEGMENTS);
+        return 1;
+      }
+      ii ++;
+    }
+    else if (!strcmp("-rate",argv[ii]))
+    {
+      rate = read_rate(argv[ii+1]);
+      if (rate == 0)
+      {
+        fprintf(stderr,"### Rate %s does not make sense\n",argv[ii+1]);
+        return 1;
+      }
+      ii ++;
+    }
+    else if (!strcmp("-burst",argv[ii]))
+    {
+      settings.burst = atoi(argv[ii+1]);
+      if (settings.burst < 1)
+      {
+        fprintf(stderr,"### Burst %s does not make sense\n",argv[ii+1]);
+        return 1;
+      }
+      ii ++;
+    }
+    else if (!strcmp("-spin",argv[ii]))
+    {
+      settings.spin = atoi(argv[ii+1]);
+      ii ++;
+    }
+    else if (!strcmp("-txtime",argv[ii]))
+    {
+      if (!strcmp("fq",argv[ii+1]))
+        settings.txtime_clock = CLOCK_MONOTONIC;
+      else if (!strcmp("etf",argv[ii+1]))
+        settings.txtime_clock = CLOCK_TAI;
+      else
+      {
+        fprintf(stderr,"### -txtime must be followed by fq or etf, not %s\n",
+                argv[ii+1]);
+        return 1;
+      }
+      settings.use_txtime = 1;
+      ii ++;
+    }
+    else if (!strcmp("-timestamp",argv[ii]))
+    {
+      if (!strcmp("realtime",argv[ii+1]))
+        settings.send_clock = SEND_CLOCK_REALTIME;
+      else if (!strcmp("tai",argv[ii+1]))
+        settings.send_clock = SEND_CLOCK_TAI;
+      else
+      {
+        fprintf(stderr,"### -timestamp must be followed by realtime or tai,"
+                " not %s\n",argv[ii+1]);
+        return 1;
+      }
+      ii ++;
+    }
+    else if (!strcmp("-lead",argv[ii]))
+    {
+      settings.lead = atoi(argv[ii+1]);
+      ii ++;
+    }
+    else if (!strcmp("-stream",argv[ii]))
+    {
+      streams[num_streams].port = 88;
+      if (read_stream(argv[ii+1],&streams[num_streams]))
+        return 1;
+      num_streams ++;
+      ii ++;
+    }
+    else if (!strcmp("-threads",argv[ii]))
+    {
+      num_workers = atoi(argv[ii+1]);
+      if (num_workers < 1)
+      {
+        fprintf(stderr,"### Thread count %s does not make sense\n",argv[ii+1]);
+        return 1;
+      }
+      pin = 1;
+      ii ++;
+    }
     else
     {
       fprintf(stderr,"### Unexpected argument %s\n",argv[ii]);
@@ -265,49 +1387,90 @@ int main(int argc, char **argv)
     ii++;
   }
 
-  socket = connect_udp_socket(hostname,port,multicast_if);
-  if (socket < 0) return 1;
+  for (ii = 0; ii < num_streams; ii++)
+  {
+    streams[ii].id = ii;
+    if (num_streams > 1)
+      snprintf(streams[ii].label,sizeof(streams[ii].label),"Stream %d: ",ii);
+    if (streams[ii].mult == 0)
+      streams[ii].mult = mult;
+    if (streams[ii].rate == 0)
+      streams[ii].rate = rate;
+    if (settings.use_txtime && streams[ii].rate == 0)
+    {
+      fprintf(stderr,"### -txtime needs -rate, to know when to send each packet\n");
+      return 1;
+    }
+  }
+  if (settings.use_txtime && settings.gso > 1)
+  {
+    // The send time would apply to the whole GSO send, not each packet
+    fprintf(stderr,"### -txtime cannot be combined with -gso\n");
+    return 1;
+  }
 
-  data_len = mult*TS_PACKET_SIZE;
-  printf("Transmitting with packet size %d (%ld*%d)\n",data_len,mult,TS_PACKET_SIZE);
-  printf("Delaying %lu microseconds between packets\n",delay);
-  memset(data,0xFF,data_len);
-  gettimeofday(&then, NULL);
-  for (packet_number = 0; ; packet_number ++)
-  {
-    data[0] =  packet_number        % 0xFF;
-    data[1] = (packet_number >>  8) % 0xFF;
-    data[2] = (packet_number >> 16) % 0xFF;
-    data[3] = (packet_number >> 24) % 0xFF;
-    write_socket_data(socket,data,data_len,packet_number);
-    if (delay > 0)
-    {
-      static int sleep_count = 1;
-      sleep_count ++;
-      if (sleep_count > every)
-      {
-        usleep(delay);
-        sleep_count = 1;
-      }
+  // Share the streams out between the threads
+  if (num_workers > num_streams)
+    num_workers = num_streams;
+  workers = calloc(num_workers,sizeof(struct worker));
+  if (workers == NULL)
+  {
+    fprintf(stderr,"### Unable to allocate %d threads\n",num_workers);
+    return 1;
+  }
+  for (ii = 0; ii < num_workers; ii++)
+  {
+    workers[ii].settings = &settings;
+    workers[ii].streams = calloc(num_streams,sizeof(struct stream *));
+    if (workers[ii].streams == NULL)
+    {
+      fprintf(stderr,"### Unable to allocate %d threads\n",num_workers);
+      return 1;
     }
-#define REPORT_EVERY        10000
-#define US_PER_SECOND       1000000
-#define FLOAT_US_PER_SECOND 1000000.0
-    if (packet_number > 0 && packet_number % REPORT_EVERY == 0)
+  }
+  for (ii = 0; ii < num_streams; ii++)
+  {
+    struct worker *worker = &workers[ii % num_workers];
+    if (worker->num_streams > 0 &&
+        (streams[ii].rate == 0 || worker->streams[0]->rate == 0))
     {
-      unsigned long elapsed;
-      gettimeofday(&now, NULL);
-      elapsed = (now.tv_sec - then.tv_sec) * US_PER_SECOND +
-        (now.tv_usec - then.tv_usec);
-      printf("%d packets transmitted in %.2f seconds",
-             REPORT_EVERY,elapsed/FLOAT_US_PER_SECOND);
-      printf(" (i.e. %.2f kilobytes/second, %.2f megabits/second)\n",
-             (mult*TS_PACKET_SIZE*REPORT_EVERY/1024) / (elapsed/FLOAT_US_PER_SECOND),
-             (mult*TS_PACKET_SIZE*REPORT_EVERY*8/(1024*1024)) / (elapsed/FLOAT_US_PER_SECOND));
-      then = now;
+      fprintf(stderr,"### Stream %d shares a thread with stream %d, so both"
+              " need a rate (or use more threads)\n",
+              ii,worker->streams[0]->id);
+      return 1;
     }
+    worker->streams[worker->num_streams++] = &streams[ii];
   }
+  if (pin)
+    choose_cpus(workers,num_workers);
+  else
+    workers[0].cpu = -1;
+
+  for (ii = 0; ii < num_streams; ii++)
+    if (setup_stream(&streams[ii],&settings))
+      return 1;
 
-  close(socket);
+  if (num_workers > 1)
+    printf("Sending %d streams from %d threads\n",num_streams,num_workers);
+  for (ii = 0; ii < num_workers; ii++)
+    if (workers[ii].cpu >= 0)
+      printf("Thread %d is on CPU %d\n",ii,workers[ii].cpu);
+
+  if (num_streams == 1)
+  {
+    run_worker(&workers[0]);  // which never returns
+    return 0;
+  }
+
+  for (ii = 0; ii < num_workers; ii++)
+  {
+    int err = pthread_create(&workers[ii].thread,NULL,run_worker,&workers[ii]);
+    if (err)
+    {
+      fprintf(stderr,"### Unable to start thread %d: %s\n",ii,strerror(err));
+      return 1;
+    }
+  }
+  report_aggregate(streams,num_streams);  // which never returns
   return 0;
 }
@@ -4,6 +4,8 @@
 // Author: Tony J Ibbs
 // Date: 2005-03-31
 
+#define _GNU_SOURCE      // for recvmmsg, CLOCK_TAI, pthread_setaffinity_np
+
 #include <errno.h>
 #include <stdio.h>
 #include <string.h>
@@ -11,10 +13,39 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <arpa/inet.h>   // inet_ntoa
 #include <netdb.h>
 #include <unistd.h>      // open, close
+#include <sys/time.h>    // gettimeofday
+#include <sys/uio.h>     // struct iovec
+#include <netinet/udp.h> // UDP_GRO
+#include <time.h>        // clock_gettime
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>       // sched_getaffinity
+#if defined(__linux__)
+#include <linux/net_tstamp.h> // SOF_TIMESTAMPING_xxx
+#include <linux/errqueue.h>   // struct scm_timestamping
+#include <linux/filter.h>     // struct sock_filter
+#endif
+
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+#ifndef SOL_UDP
+#define SOL_UDP IPPROTO_UDP
+#endif
+
+// The most a single (maximum size) UDP datagram can hold, which is also
+// the most the kernel will coalesce into one buffer for us
+#define MAX_GRO_BYTES 65535
+
+// ...and the most datagrams it will coalesce into one (UDP_GRO_CNT_MAX),
+// whatever their size
+#define MAX_GRO_SEGMENTS 64
 
-static int udp_listen_socket(char *hostname, int port)
+static int udp_listen_socket(char *hostname, int port, int reuseport)
 {
   struct hostent *hp;
   int sock;
@@ -62,6 +93,15 @@ static int udp_listen_socket(char *hostname, int port)
     printf("Address is unicast\n");
   }
 
+  // So that other sockets (in our other threads) can share the port
+  if (reuseport && setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, (char *) &one,
+                              sizeof(one)) < 0)
+  {
+    perror("setsockopt: reuseport");
+    close(sock);
+    return -1;
+  }
+
   if (bind(sock, (struct sockaddr *)&ipaddr, sizeof(ipaddr)) < 0)
   {
     perror("bind");
@@ -89,11 +129,1351 @@ static int udp_listen_socket(char *hostname, int port)
   return sock;
 }
 
+/*
+ * Get the packet number from the first four bytes of a packet
+ * (least significant byte first), as written by udpserve
+ */
+static inline unsigned int get_packet_number(unsigned char data[])
+{
+  return (unsigned int)data[0]       | (unsigned int)data[1] << 8 |
+         (unsigned int)data[2] << 16 | (unsigned int)data[3] << 24;
+}
+
+/*
+ * Keeping track of packet numbers
+ *
+ * We remember which of the last WINDOW_SIZE packet numbers (up to the
+ * highest we've seen) have arrived, in a bitmap. A packet that falls out of
+ * the bottom of the window without having arrived is lost. One that arrives
+ * while still in the window, but after a higher numbered packet, is late
+ * (and how late tells us how far packets are being reordered), and one
+ * that arrives twice is a duplicate. This takes the same memory however
+ * many packets there are, and (amortised) constant time for each.
+ *
+ * Packet numbers are compared modulo 2**32, so the counter wrapping round
+ * is just counted. A jump of more than RESTART_DISTANCE, either way, is
+ * taken to mean the sender has started again - as is a packet from before
+ * the window that is followed by the packet after it. So is a packet number
+ * less than WINDOW_SIZE we have already seen (and so, a sender that started
+ * again not long after it first started), followed by the packet after it,
+ * also already seen.
+ */
+#define WINDOW_SIZE       1024   // must be a multiple of 64
+#define WINDOW_WORDS      (WINDOW_SIZE / 64)
+#define RESTART_DISTANCE  (1 << 20)
+#define REORDER_BUCKETS   10     // 1, 2-3, 4-7, ..., 512-1023 packets late
+
+// What track_packet() made of a packet
+#define SEQ_FIRST      0
+#define SEQ_NEXT       1  // the one after the highest so far
+#define SEQ_GAP        2  // after the highest so far, but skipping some
+#define SEQ_LATE       3
+#define SEQ_TOO_LATE   4  // so late it was already counted as lost
+#define SEQ_DUPLICATE  5
+#define SEQ_RESTART    6
+
+struct sequence
+{
+  int           had_first_packet;
+  uint32_t      highest;          // the highest packet number so far
+  uint64_t      window[WINDOW_WORDS];
+  int           suspect_restart;  // might the last packet have been a restart?
+  uint32_t      suspect;          // if so, the packet number after it
+  int           suspect_was;      // and what we took it for (SEQ_xxx)
+  unsigned long total_packets;
+  unsigned long lost;
+  unsigned long late;
+  unsigned long too_late;
+  unsigned long duplicates;
+  unsigned long wraps;            // times the packet number wrapped round
+  unsigned long restarts;
+  unsigned long reorder[REORDER_BUCKETS];
+  unsigned long wrong_size;       // packets not of the size we expected
+};
+
+/*
+ * Set (or clear) the bits for packet numbers `from` .. `from+count-1`
+ * (`count` being no more than WINDOW_SIZE).
+ *
+ * Returns how many of them were set beforehand.
+ */
+static unsigned int mark_range(struct sequence *seq,
+                               uint32_t         from,
+                               uint32_t         count,
+                               int              set)
+{
+  unsigned int  was_set = 0;
+  while (count > 0)
+  {
+    uint32_t  pos = from % WINDOW_SIZE;
+    uint32_t  bit = pos % 64;
+    uint32_t  num = (64 - bit < count ? 64 - bit : count);
+    uint64_t  mask = (num == 64 ? ~(uint64_t)0
+                                : (((uint64_t)1 << num) - 1) << bit);
+    uint64_t *word = &seq->window[pos / 64];
+    was_set += __builtin_popcountll(*word & mask);
+    if (set)
+      *word |= mask;
+    else
+      *word &= ~mask;
+    from += num;
+    count -= num;
+  }
+  return was_set;
+}
+
+/*
+ * Has packet `number` (which must be in the window) arrived?
+ */
+static int packet_seen(struct sequence *seq,
+                       uint32_t         number)
+{
+  uint32_t  pos = number % WINDOW_SIZE;
+  return (seq->window[pos / 64] >> (pos % 64)) & 1;
+}
+
+/*
+ * Start afresh with packet `number`, as if everything before it had arrived
+ */
+static void start_window(struct sequence *seq,
+                         uint32_t         number)
+{
+  memset(seq->window,0xFF,sizeof(seq->window));
+  seq->highest = number;
+  seq->had_first_packet = 1;
+}
+
+/*
+ * Move the top of the window on by `distance` packets. Any packets that
+ * fall out of the bottom that haven't arrived are lost, as are any that
+ * are skipped over entirely. The new packet numbers start off missing.
+ */
+static void advance_window(struct sequence *seq,
+                           uint32_t         distance)
+{
+  uint32_t  from = seq->highest + 1;
+  uint32_t  count = distance;
+  if (count > WINDOW_SIZE)
+  {
+    seq->lost += count - WINDOW_SIZE;
+    from += count - WINDOW_SIZE;
+    count = WINDOW_SIZE;
+  }
+  seq->lost += count - mark_range(seq,from,count,0);
+  if (seq->highest + distance < seq->highest)
+    seq->wraps ++;
+  seq->highest += distance;
+}
+
+/*
+ * Note the arrival of packet `number`. If `distance` is not NULL, it is
+ * set to how many packets were skipped (for SEQ_GAP), or how late the
+ * packet was (for SEQ_LATE and SEQ_TOO_LATE).
+ *
+ * Returns what we made of it (SEQ_xxx).
+ */
+static int track_packet(struct sequence *seq,
+                        uint32_t         number,
+                        uint32_t        *distance)
+{
+  int32_t  diff = (int32_t)(number - seq->highest);
+  uint32_t dummy;
+  if (distance == NULL)
+    distance = &dummy;
+
+  seq->total_packets ++;
+  if (!seq->had_first_packet)
+  {
+    start_window(seq,number);
+    return SEQ_FIRST;
+  }
+  else if (diff > RESTART_DISTANCE || diff < -RESTART_DISTANCE ||
+           (seq->suspect_restart && number == seq->suspect && diff < 0 &&
+            (-diff >= WINDOW_SIZE || packet_seen(seq,number))))
+  {
+    // The packet before wasn't late, or a duplicate, after all
+    if (seq->suspect_restart && number == seq->suspect)
+    {
+      if (seq->suspect_was == SEQ_TOO_LATE)
+        seq->too_late --;
+      else
+        seq->duplicates --;
+    }
+    // Anything still missing from before isn't going to turn up now
+    seq->lost += WINDOW_SIZE - mark_range(seq,seq->highest + 1,WINDOW_SIZE,1);
+    seq->restarts ++;
+    seq->suspect_restart = 0;
+    start_window(seq,number);
+    return SEQ_RESTART;
+  }
+
+  seq->suspect_restart = 0;
+  if (diff > 0)
+  {
+    advance_window(seq,diff);
+    mark_range(seq,number,1,1);
+    *distance = diff - 1;
+    return (diff == 1 ? SEQ_NEXT : SEQ_GAP);
+  }
+  else if (diff == 0)
+  {
+    seq->duplicates ++;
+    return SEQ_DUPLICATE;
+  }
+
+  *distance = -diff;
+  if (-diff >= WINDOW_SIZE)
+  {
+    seq->too_late ++;
+    seq->suspect_restart = 1;
+    seq->suspect = number + 1;
+    seq->suspect_was = SEQ_TOO_LATE;
+    return SEQ_TOO_LATE;
+  }
+  else if (mark_range(seq,number,1,1))
+  {
+    seq->duplicates ++;
+    if (number < WINDOW_SIZE)
+    {
+      seq->suspect_restart = 1;
+      seq->suspect = number + 1;
+      seq->suspect_was = SEQ_DUPLICATE;
+    }
+    return SEQ_DUPLICATE;
+  }
+  else
+  {
+    seq->late ++;
+    seq->reorder[31 - __builtin_clz(-diff)] ++;
+    return SEQ_LATE;
+  }
+}
+
+/*
+ * Check the packet numbers of a batch of `count` packets.
+ *
+ * Normally, the packets all follow on from the last one we saw, which we
+ * can check for in one pass without any branches, and then mark them all
+ * as arrived at once. Otherwise, we go through them one by one.
+ */
+static void check_batch(struct sequence *seq,
+                        unsigned int     numbers[],
+                        int              count)
+{
+  unsigned long gaps;
+  int           ii;
+
+  if (count == 0)
+    return;
+  if (!seq->had_first_packet || count > WINDOW_SIZE)
+  {
+    for (ii = 0; ii < count; ii++)
+      track_packet(seq,numbers[ii],NULL);
+    return;
+  }
+
+  gaps = (numbers[0] != seq->highest + 1);
+  for (ii = 1; ii < count; ii++)
+    gaps += (numbers[ii] != numbers[ii-1] + 1);
+
+  if (gaps == 0)
+  {
+    seq->suspect_restart = 0;
+    advance_window(seq,count);
+    mark_range(seq,numbers[0],count,1);
+    seq->total_packets += count;
+  }
+  else
+  {
+    for (ii = 0; ii < count; ii++)
+      track_packet(seq,numbers[ii],NULL);
+  }
+}
+
+/*
+ * Print out what we know about the packet numbers
+ */
+static void report_sequence(struct sequence *seq)
+{
+  int  ii;
+  printf("Total number of packets received: %lu\n",seq->total_packets);
+  printf("Number of packets lost:           %lu\n",seq->lost);
+  printf("Number of packets late:           %lu\n",seq->late);
+  if (seq->late)
+  {
+    printf("  of which, by");
+    for (ii = 0; ii < REORDER_BUCKETS; ii++)
+      if (seq->reorder[ii])
+        printf(" %d..%d: %lu",1 << ii,(2 << ii) - 1,seq->reorder[ii]);
+    printf("\n");
+  }
+  if (seq->too_late)
+    printf("Number too late (counted lost):   %lu\n",seq->too_late);
+  printf("Number of duplicate packets:      %lu\n",seq->duplicates);
+  if (seq->wraps)
+    printf("Packet number wrapped round:      %lu times\n",seq->wraps);
+  if (seq->restarts)
+    printf("Sender restarted:                 %lu times\n",seq->restarts);
+  if (seq->wrong_size)
+    printf("Packets of unexpected size:       %lu\n",seq->wrong_size);
+}
+
+/*
+ * Ask the kernel to coalesce consecutive datagrams into one buffer for us
+ * (UDP generic receive offload). It then tells us how big each of the
+ * original datagrams was with a control message (see gro_segment_size()).
+ *
+ * Returns 0 if all went well, 1 if something went wrong.
+ */
+static int enable_gro(int sock)
+{
+  const int one = 1;
+  if (setsockopt(sock,SOL_UDP,UDP_GRO,&one,sizeof(one)) < 0)
+  {
+    perror("setsockopt: UDP_GRO");
+    return 1;
+  }
+  printf("Using UDP GRO\n");
+  return 0;
+}
+
+// Room for the control messages giving the GRO segment size and the
+// arrival time
+union msg_control
+{
+  char            buf[CMSG_SPACE(sizeof(int)) +
+                      CMSG_SPACE(3 * sizeof(struct timespec))];
+  struct cmsghdr  align;
+};
+
+/*
+ * Find out how big each of the datagrams coalesced into a message was.
+ *
+ * Returns the size, or `len` (the size of the whole message) if the
+ * kernel didn't say (so it is just one datagram).
+ */
+static int gro_segment_size(struct msghdr *msg,
+                            int            len)
+{
+  struct cmsghdr *cmsg;
+  for (cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL; cmsg = CMSG_NXTHDR(msg,cmsg))
+  {
+    if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO)
+    {
+      int size;
+      memcpy(&size,CMSG_DATA(cmsg),sizeof(size));
+      if (size > 0)
+        return size;
+    }
+  }
+  return len;
+}
+
+/*
+ * Latency and jitter
+ *
+ * If udpserve is asked to (with '-timestamp'), it puts the time each packet
+ * was sent into its header. We ask the kernel to tell us when each packet
+ * arrived - either when the kernel saw it (SO_TIMESTAMPNS), or when the
+ * network card did (SO_TIMESTAMPING, if the card and driver support it,
+ * and it has been turned on with something like 'hwstamp_ctl -i eth0 -r 1')
+ * - and from the two work out the one way delay, and the interarrival
+ * jitter as in RFC 3550. Of course, the delay only makes sense if the two
+ * machines' clocks are synchronised (and for hardware timestamps, the
+ * card's clock as well, e.g., with phc2sys).
+ */
+#define TIMESTAMP_NONE      0
+#define TIMESTAMP_SOFTWARE  1
+#define TIMESTAMP_HARDWARE  2
+
+// What udpserve says about the clock used for its send timestamps
+#define SEND_CLOCK_REALTIME 1
+#define SEND_CLOCK_TAI      2
+
+#define HEADER_SIZE         16  // with a send timestamp
+
+/*
+ * Histograms
+ *
+ * Values (in nanoseconds) are counted in buckets, 16 for each power of two,
+ * so each bucket is within about 6% of the values counted in it, and any
+ * 64 bit value fits.
+ */
+#define HIST_SUB_BITS  4
+#define HIST_BUCKETS   (64 << HIST_SUB_BITS)
+
+struct histogram
+{
+  uint64_t  count;
+  uint64_t  min, max;
+  double    sum;
+  uint64_t  buckets[HIST_BUCKETS];
+};
+
+static int hist_bucket(uint64_t value)
+{
+  int  msb;
+  if (value < (1 << HIST_SUB_BITS))
+    return value;
+  msb = 63 - __builtin_clzll(value);
+  return ((msb - HIST_SUB_BITS + 1) << HIST_SUB_BITS) +
+    ((value >> (msb - HIST_SUB_BITS)) & ((1 << HIST_SUB_BITS) - 1));
+}
+
+// The smallest value that goes into `bucket`
+static uint64_t hist_value(int bucket)
+{
+  int  power = bucket >> HIST_SUB_BITS;
+  int  sub   = bucket & ((1 << HIST_SUB_BITS) - 1);
+  if (power == 0)
+    return bucket;
+  return (uint64_t)((1 << HIST_SUB_BITS) + sub) << (power - 1);
+}
+
+static void hist_add(struct histogram *hist,
+                     uint64_t          value)
+{
+  if (hist->count == 0 || value < hist->min)
+    hist->min = value;
+  if (value > hist->max)
+    hist->max = value;
+  hist->count ++;
+  hist->sum += value;
+  hist->buckets[hist_bucket(value)] ++;
+}
+
+static void hist_merge(struct histogram *total,
+                       struct histogram *hist)
+{
+  int  ii;
+  if (hist->count == 0)
+    return;
+  if (total->count == 0 || hist->min < total->min)
+    total->min = hist->min;
+  if (hist->max > total->max)
+    total->max = hist->max;
+  total->count += hist->count;
+  total->sum += hist->sum;
+  for (ii = 0; ii < HIST_BUCKETS; ii++)
+    total->buckets[ii] += hist->buckets[ii];
+}
+
+// The value below which (about) `fraction` of the values lie
+static uint64_t hist_percentile(struct histogram *hist,
+                                double            fraction)
+{
+  uint64_t  wanted = (uint64_t)(fraction * hist->count);
+  uint64_t  seen = 0;
+  int       ii;
+  for (ii = 0; ii < HIST_BUCKETS; ii++)
+  {
+    seen += hist->buckets[ii];
+    if (seen > wanted)
+    {
+      uint64_t  value = hist_value(ii);
+      return (value < hist->min ? hist->min : value);
+    }
+  }
+  return hist->max;
+}
+
+static void hist_print(char             *name,
+                       struct histogram *hist)
+{
+  printf("  %s min/mean/p50/p99/p99.9/max %.1f/%.1f/%.1f/%.1f/%.1f/%.1f us\n",
+         name,hist->min / 1000.0,hist->sum / hist->count / 1000.0,
+         hist_percentile(hist,0.5) / 1000.0,
+         hist_percentile(hist,0.99) / 1000.0,
+         hist_percentile(hist,0.999) / 1000.0,
+         hist->max / 1000.0);
+}
+
+struct latency
+{
+  int               mode;          // TIMESTAMP_xxx
+  int64_t           tai_offset;    // CLOCK_TAI - CLOCK_REALTIME
+  int               have_last;
+  int64_t           last_transit;  // arrival - send time of the last packet
+  double            jitter;        // RFC 3550 estimate, ns
+  uint64_t          negative;      // packets that arrived before being sent
+  uint64_t          no_time;       // packets without both times
+  struct histogram  delay;         // one way delay, since the last report
+  struct histogram  ipdv;          // |D(i-1,i)|, since the last report
+  struct histogram  total_delay;
+  struct histogram  total_ipdv;
+};
+
+/*
+ * Ask the kernel to timestamp each packet as it arrives
+ *
+ * Returns 0 if all went well, 1 if something went wrong.
+ */
+static int enable_timestamps(int             sock,
+                             struct latency *latency)
+{
+  struct timespec  real, tai;
+#if defined(__linux__)
+  if (latency->mode == TIMESTAMP_HARDWARE)
+  {
+    int flags = SOF_TIMESTAMPING_RX_HARDWARE | SOF_TIMESTAMPING_RAW_HARDWARE |
+                SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+    if (setsockopt(sock,SOL_SOCKET,SO_TIMESTAMPING,&flags,sizeof(flags)) < 0)
+    {
+      perror("setsockopt: SO_TIMESTAMPING");
+      return 1;
+    }
+    printf("Using hardware receive timestamps (software if not available)\n");
+  }
+  else
+#endif
+  {
+    const int one = 1;
+    if (setsockopt(sock,SOL_SOCKET,SO_TIMESTAMPNS,&one,sizeof(one)) < 0)
+    {
+      perror("setsockopt: SO_TIMESTAMPNS");
+      return 1;
+    }
+    printf("Using software receive timestamps\n");
+  }
+
+  // The kernel timestamps are CLOCK_REALTIME, so we need this if the
+  // sender is using TAI
+  clock_gettime(CLOCK_REALTIME,&real);
+  clock_gettime(CLOCK_TAI,&tai);
+  latency->tai_offset = ((int64_t)tai.tv_sec - real.tv_sec) * 1000000000 +
+    (tai.tv_nsec - real.tv_nsec);
+  return 0;
+}
+
+/*
+ * Find out when the kernel says a message arrived.
+ *
+ * Returns the (CLOCK_REALTIME) time in nanoseconds, or 0 if it didn't say.
+ */
+static uint64_t arrival_time(struct msghdr *msg)
+{
+  struct cmsghdr *cmsg;
+  for (cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL; cmsg = CMSG_NXTHDR(msg,cmsg))
+  {
+    struct timespec  ts;
+    if (cmsg->cmsg_level != SOL_SOCKET)
+      continue;
+    if (cmsg->cmsg_type == SCM_TIMESTAMPNS)
+    {
+      memcpy(&ts,CMSG_DATA(cmsg),sizeof(ts));
+      return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    }
+#if defined(__linux__)
+    else if (cmsg->cmsg_type == SCM_TIMESTAMPING)
+    {
+      // [0] is the software timestamp, [2] the hardware one
+      struct scm_timestamping  stamps;
+      memcpy(&stamps,CMSG_DATA(cmsg),sizeof(stamps));
+      ts = stamps.ts[2];
+      if (ts.tv_sec == 0 && ts.tv_nsec == 0)
+        ts = stamps.ts[0];
+      return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    }
+#endif
+  }
+  return 0;
+}
+
+/*
+ * Note the delay of a packet that arrived at (CLOCK_REALTIME) time
+ * `arrived`, if it says when it was sent.
+ */
+static void record_latency(struct latency *latency,
+                           unsigned char   packet[],
+                           int             len,
+                           uint64_t        arrived)
+{
+  uint64_t  sent = 0;
+  int64_t   transit;
+  int       ii;
+
+  if (len < HEADER_SIZE || arrived == 0 || packet[7] != 0 ||
+      (packet[6] != SEND_CLOCK_REALTIME && packet[6] != SEND_CLOCK_TAI))
+  {
+    latency->no_time ++;
+    return;
+  }
+  for (ii = 15; ii >= 8; ii--)
+    sent = (sent << 8) | packet[ii];
+  if (packet[6] == SEND_CLOCK_TAI)
+    arrived += latency->tai_offset;
+
+  transit = (int64_t)(arrived - sent);
+  if (transit < 0)
+    latency->negative ++;
+  else
+    hist_add(&latency->delay,transit);
+
+  // RFC 3550, section 6.4.1 and appendix A.8
+  if (latency->have_last)
+  {
+    int64_t  d = transit - latency->last_transit;
+    if (d < 0)
+      d = -d;
+    hist_add(&latency->ipdv,d);
+    latency->jitter += (d - latency->jitter) / 16.0;
+  }
+  latency->have_last = 1;
+  latency->last_transit = transit;
+}
+
+/*
+ * Report on the latency since the last report, and start again
+ */
+static void report_latency(struct latency *latency)
+{
+  if (latency->delay.count > 0)
+    hist_print("one way delay",&latency->delay);
+  if (latency->ipdv.count > 0)
+  {
+    printf("  jitter (RFC 3550) %.1f us\n",latency->jitter / 1000.0);
+    hist_print("|D|",&latency->ipdv);
+  }
+  if (latency->negative > 0)
+    printf("  %llu packets arrived before they were sent"
+           " - are the clocks synchronised?\n",
+           (unsigned long long)latency->negative);
+  if (latency->no_time > 0)
+    printf("  %llu packets without both send and arrival times\n",
+           (unsigned long long)latency->no_time);
+  hist_merge(&latency->total_delay,&latency->delay);
+  hist_merge(&latency->total_ipdv,&latency->ipdv);
+  memset(&latency->delay,0,sizeof(latency->delay));
+  memset(&latency->ipdv,0,sizeof(latency->ipdv));
+  latency->negative = latency->no_time = 0;
+}
+
+#define REPORT_US     1000000
+
+/*
+ * The counts we report on, for the packets from one sender (or all of them)
+ */
+struct counts
+{
+  unsigned long packets;
+  unsigned long lost;
+  unsigned long late;
+  unsigned long duplicates;
+  unsigned long too_late;
+  unsigned long wraps;
+  unsigned long restarts;
+  unsigned long wrong_size;
+};
+
+static void get_counts(struct sequence *seq,
+                       struct counts   *counts)
+{
+  counts->packets = seq->total_packets;
+  counts->lost = seq->lost;
+  counts->late = seq->late;
+  counts->duplicates = seq->duplicates;
+  counts->too_late = seq->too_late;
+  counts->wraps = seq->wraps;
+  counts->restarts = seq->restarts;
+  counts->wrong_size = seq->wrong_size;
+}
+
+static void add_counts(struct counts *total,
+                       struct counts *counts)
+{
+  total->packets += counts->packets;
+  total->lost += counts->lost;
+  total->late += counts->late;
+  total->duplicates += counts->duplicates;
+  total->too_late += counts->too_late;
+  total->wraps += counts->wraps;
+  total->restarts += counts->restarts;
+  total->wrong_size += counts->wrong_size;
+}
+
+/*
+ * Print out what has happened between `last` and `now`, `seconds` apart
+ * (but no newline)
+ */
+static void print_counts(struct counts *now,
+                         struct counts *last,
+                         double         seconds,
+                         int            packet_size)
+{
+  unsigned long packets = now->packets - last->packets;
+  printf("%lu packets in %.2f seconds (%.0f packets/second, %.2f megabits/second),"
+         " %lu lost, %lu late, %lu duplicates",
+         packets,seconds,packets / seconds,
+         (double)packets * packet_size * 8 / (1024*1024) / seconds,
+         now->lost - last->lost,now->late - last->late,
+         now->duplicates - last->duplicates);
+  if (now->too_late > last->too_late)
+    printf(", %lu too late",now->too_late - last->too_late);
+  if (now->wraps > last->wraps)
+    printf(", packet number wrapped");
+  if (now->restarts > last->restarts)
+    printf(", sender restarted");
+  if (now->wrong_size)
+    printf(", %lu of the wrong size so far",now->wrong_size);
+}
+
+/*
+ * Everything we need to read packets in batches, with recvmmsg
+ */
+struct receiver
+{
+  int                 packet_size;
+  int                 batch;
+  int                 gro;
+  int                 buffer_size;
+  int                 per_message;  // most packet numbers one message can hold
+  unsigned char      *data;
+  struct mmsghdr     *msgs;
+  struct iovec       *iovecs;
+  union msg_control  *control;    // NULL if we don't want control messages
+  struct sockaddr_in *addresses;  // NULL if we don't care who sent them
+  unsigned int       *numbers;    // room for all the packet numbers in a batch
+};
+
+/*
+ * Get ready to read up to `batch` messages at a time, each of them
+ * `packet_size` bytes - or, with `gro`, up to MAX_GRO_BYTES.
+ *
+ * Returns 0 if all went well, 1 if something went wrong.
+ */
+static int setup_receiver(struct receiver *receiver,
+                          int              packet_size,
+                          int              batch,
+                          int              gro,
+                          int              want_control,
+                          int              want_addresses)
+{
+  int  ii;
+
+  memset(receiver,0,sizeof(*receiver));
+  receiver->packet_size = packet_size;
+  receiver->batch = batch;
+  receiver->gro = gro;
+  receiver->buffer_size = (gro ? MAX_GRO_BYTES : packet_size);
+  receiver->per_message = (gro ? MAX_GRO_SEGMENTS : 1);
+  receiver->data = malloc((size_t)batch * receiver->buffer_size);
+  receiver->msgs = calloc(batch,sizeof(struct mmsghdr));
+  receiver->iovecs = calloc(batch,sizeof(struct iovec));
+  receiver->numbers = calloc((size_t)batch * receiver->per_message,
+                             sizeof(unsigned int));
+  if (gro || want_control)
+    receiver->control = calloc(batch,sizeof(union msg_control));
+  if (want_addresses)
+    receiver->addresses = calloc(batch,sizeof(struct sockaddr_in));
+  if (receiver->data == NULL || receiver->msgs == NULL ||
+      receiver->iovecs == NULL || receiver->numbers == NULL ||
+      ((gro || want_control) && receiver->control == NULL) ||
+      (want_addresses && receiver->addresses == NULL))
+  {
+    fprintf(stderr,"### Unable to allocate %d buffers of %d bytes\n",
+            batch,receiver->buffer_size);
+    return 1;
+  }
+  for (ii = 0; ii < batch; ii++)
+  {
+    receiver->iovecs[ii].iov_base = &receiver->data[ii*receiver->buffer_size];
+    receiver->iovecs[ii].iov_len = receiver->buffer_size;
+    receiver->msgs[ii].msg_hdr.msg_iov = &receiver->iovecs[ii];
+    receiver->msgs[ii].msg_hdr.msg_iovlen = 1;
+  }
+  return 0;
+}
+
+static void free_receiver(struct receiver *receiver)
+{
+  free(receiver->data);
+  free(receiver->msgs);
+  free(receiver->iovecs);
+  free(receiver->numbers);
+  free(receiver->control);
+  free(receiver->addresses);
+}
+
+/*
+ * Wait for at least one message, then read as many as are there, up to
+ * `count`.
+ *
+ * Returns how many were read, or -1 if something went wrong.
+ */
+static int read_messages(struct receiver *receiver,
+                         int              sock,
+                         int              count)
+{
+  int  ii;
+  for (;;)
+  {
+    // The kernel overwrites these each time
+    for (ii = 0; ii < count; ii++)
+    {
+      struct msghdr *hdr = &receiver->msgs[ii].msg_hdr;
+      if (receiver->control != NULL)
+      {
+        hdr->msg_control = receiver->control[ii].buf;
+        hdr->msg_controllen = sizeof(receiver->control[ii].buf);
+      }
+      if (receiver->addresses != NULL)
+      {
+        hdr->msg_name = &receiver->addresses[ii];
+        hdr->msg_namelen = sizeof(receiver->addresses[ii]);
+      }
+    }
+    count = recvmmsg(sock,receiver->msgs,count,MSG_WAITFORONE,NULL);
+    if (count != -1 || errno != EINTR)
+      return count;
+  }
+}
+
+/*
+ * Split message `index` into packets (if the kernel coalesced them), and
+ * put their packet numbers into `numbers`, counting any of the wrong size
+ * in `seq`, and measuring their delay if `latency` is not NULL.
+ *
+ * At most `per_message` numbers are stored. The kernel shouldn't give us
+ * more segments than that, but if it does, the extra packets are just
+ * not checked (and so will show up as lost).
+ *
+ * Returns how many packet numbers were found.
+ */
+static int split_message(struct receiver *receiver,
+                         int              index,
+                         unsigned int     numbers[],
+                         struct sequence *seq,
+                         struct latency  *latency)
+{
+  unsigned char *buffer = &receiver->data[index*receiver->buffer_size];
+  struct msghdr *hdr = &receiver->msgs[index].msg_hdr;
+  int            len = receiver->msgs[index].msg_len;
+  int            segment = (receiver->gro ? gro_segment_size(hdr,len) : len);
+  int            offset;
+  int            count = 0;
+  uint64_t       arrived = (latency ? arrival_time(hdr) : 0);
+  for (offset = 0; offset < len; offset += segment)
+  {
+    int this_len = (len - offset < segment ? len - offset : segment);
+    seq->wrong_size += (this_len != receiver->packet_size);
+    if (this_len >= 4 && count < receiver->per_message)
+      numbers[count++] = get_packet_number(&buffer[offset]);
+    if (latency)
+      record_latency(latency,&buffer[offset],this_len,arrived);
+  }
+  return count;
+}
+
+/*
+ * Read packets in batches of `batch`, with recvmmsg, and report every so
+ * often (rather than for every packet).
+ *
+ * If `gro` is true, each message may be several packets, coalesced by the
+ * kernel, and is split up again before checking.
+ *
+ * If `latency` is not NULL, the delay and jitter of each packet are also
+ * measured, and reported on with everything else.
+ *
+ * Returns 0 if all went well, 1 if something went wrong.
+ */
+static int receive_batches(int              sock,
+                           int              packet_size,
+                           int              batch,
+                           int              gro,
+                           unsigned long    max,
+                           struct sequence *seq,
+                           struct latency  *latency)
+{
+  struct receiver receiver;
+  int             ii;
+  int             result = 0;
+  struct counts   last;
+  struct timeval  then, now;
+
+  if (setup_receiver(&receiver,packet_size,batch,gro,latency != NULL,0))
+    return 1;
+
+  get_counts(seq,&last);
+  gettimeofday(&then, NULL);
+  for (;;)
+  {
+    int count = batch;
+    int num_numbers = 0;
+    if (max != 0 && max - seq->total_packets < (unsigned long)batch)
+      count = max - seq->total_packets;
+
+    count = read_messages(&receiver,sock,count);
+    if (count == -1)
+    {
+      perror("Error in recvmmsg");
+      result = 1;
+      break;
+    }
+    for (ii = 0; ii < count; ii++)
+      num_numbers += split_message(&receiver,ii,&receiver.numbers[num_numbers],
+                                   seq,latency);
+    check_batch(seq,receiver.numbers,num_numbers);
+    if (max != 0 && seq->total_packets >= max)
+      break;
+
+    gettimeofday(&now, NULL);
+    if ((now.tv_sec - then.tv_sec) * 1000000 + (now.tv_usec - then.tv_usec)
+        >= REPORT_US)
+    {
+      struct counts counts;
+      get_counts(seq,&counts);
+      print_counts(&counts,&last,(now.tv_sec - then.tv_sec) +
+                   (now.tv_usec - then.tv_usec) / 1000000.0,packet_size);
+      printf("\n");
+      if (latency)
+        report_latency(latency);
+      last = counts;
+      then = now;
+    }
+  }
+  free_receiver(&receiver);
+  return result;
+}
+
+/*
+ * Receiving with several threads
+ *
+ * Each thread has its own socket, all bound to the same port with
+ * SO_REUSEPORT, so the kernel shares the packets out between them - by
+ * default, by hashing the sender's address and port, so each sender goes
+ * to the same thread. Alternatively, we can tell the kernel to choose the
+ * thread by the stream id udpserve puts in each packet (see steer_by_stream()).
+ *
+ * Each thread keeps track of each flow (sender and stream id) it sees, and
+ * every so often publishes its counts, which the main thread reads and
+ * reports on. The only thing shared is those counts, so no locking is needed.
+ */
+#define MAX_FLOWS  64    // per thread
+
+struct flow
+{
+  _Atomic int      used;      // set once the rest of the key is filled in
+  uint32_t         address;   // (network order)
+  uint16_t         port;      // (network order)
+  uint16_t         stream_id;
+  // Only used by the receiving thread
+  struct sequence  seq;
+  int              dirty;     // changed since we last published
+  // Published by the receiving thread, for the main thread
+  _Atomic unsigned long packets, lost, late, duplicates, too_late, wraps,
+                        restarts, wrong_size;
+  // Only used by the main thread
+  struct counts    last;
+};
+
+struct receive_thread
+{
+  int                    index;
+  int                    cpu;        // -1 if not pinned
+  int                    sock;
+  pthread_t              thread;
+  struct receiver        receiver;
+  struct flow            flows[MAX_FLOWS];
+  _Atomic unsigned long  untracked;  // packets from flows we had no room for
+  _Atomic int            failed;
+};
+
+/*
+ * Ask the kernel to give packets with stream id N to the (N % num_threads)th
+ * socket in the group, using a classic BPF program, which sees the UDP
+ * payload.
+ *
+ * Returns 0 if all went well, 1 if something went wrong.
+ */
+static int steer_by_stream(int sock,
+                           int num_threads)
+{
+#if defined(__linux__) && defined(SO_ATTACH_REUSEPORT_CBPF)
+  struct sock_filter code[] = {
+    { BPF_LD  | BPF_B   | BPF_ABS, 0, 0, 5 },           // A = high byte of id
+    { BPF_ALU | BPF_LSH | BPF_K,   0, 0, 8 },           // A <<= 8
+    { BPF_MISC| BPF_TAX,           0, 0, 0 },           // X = A
+    { BPF_LD  | BPF_B   | BPF_ABS, 0, 0, 4 },           // A = low byte of id
+    { BPF_ALU | BPF_OR  | BPF_X,   0, 0, 0 },           // A |= X
+    { BPF_ALU | BPF_MOD | BPF_K,   0, 0, num_threads }, // A %= num_threads
+    { BPF_RET | BPF_A,             0, 0, 0 },           // use socket A
+  };
+  struct sock_fprog prog = { sizeof(code) / sizeof(code[0]), code };
+  if (setsockopt(sock,SOL_SOCKET,SO_ATTACH_REUSEPORT_CBPF,&prog,sizeof(prog)) < 0)
+  {
+    perror("setsockopt: SO_ATTACH_REUSEPORT_CBPF");
+    return 1;
+  }
+  printf("Steering packets to threads by stream id\n");
+  return 0;
+#else
+  fprintf(stderr,"### SO_ATTACH_REUSEPORT_CBPF is not supported on this system\n");
+  return 1;
+#endif
+}
+
+static void pin_to_cpu(int  cpu)
+{
+#if defined(__linux__)
+  cpu_set_t  set;
+  int        err;
+  if (cpu < 0)
+    return;
+  CPU_ZERO(&set);
+  CPU_SET(cpu,&set);
+  err = pthread_setaffinity_np(pthread_self(),sizeof(set),&set);
+  if (err)
+    fprintf(stderr,"!!! Warning: unable to pin thread to CPU %d: %s\n",
+            cpu,strerror(err));
+#endif
+}
+
+/*
+ * Find the flow for a packet from `address` with stream id `stream_id`,
+ * adding it if it's new.
+ *
+ * Returns the flow, or NULL if there's no room for another.
+ */
+static struct flow *find_flow(struct receive_thread *thread,
+                              struct sockaddr_in    *address,
+                              uint16_t               stream_id)
+{
+  uint32_t  hash = (address->sin_addr.s_addr ^ address->sin_port ^
+                    stream_id * 0x9E3779B1) % MAX_FLOWS;
+  int       ii;
+  for (ii = 0; ii < MAX_FLOWS; ii++)
+  {
+    struct flow *flow = &thread->flows[(hash + ii) % MAX_FLOWS];
+    if (!atomic_load_explicit(&flow->used,memory_order_relaxed))
+    {
+      flow->address = address->sin_addr.s_addr;
+      flow->port = address->sin_port;
+      flow->stream_id = stream_id;
+      atomic_store_explicit(&flow->used,1,memory_order_release);
+      return flow;
+    }
+    if (flow->address == address->sin_addr.s_addr &&
+        flow->port == address->sin_port && flow->stream_id == stream_id)
+      return flow;
+  }
+  return NULL;
+}
+
+static void publish_flow(struct flow *flow)
+{
+  struct sequence *seq = &flow->seq;
+  atomic_store_explicit(&flow->packets,seq->total_packets,memory_order_relaxed);
+  atomic_store_explicit(&flow->lost,seq->lost,memory_order_relaxed);
+  atomic_store_explicit(&flow->late,seq->late,memory_order_relaxed);
+  atomic_store_explicit(&flow->duplicates,seq->duplicates,memory_order_relaxed);
+  atomic_store_explicit(&flow->too_late,seq->too_late,memory_order_relaxed);
+  atomic_store_explicit(&flow->wraps,seq->wraps,memory_order_relaxed);
+  atomic_store_explicit(&flow->restarts,seq->restarts,memory_order_relaxed);
+  atomic_store_explicit(&flow->wrong_size,seq->wrong_size,memory_order_relaxed);
+  flow->dirty = 0;
+}
+
+static void read_flow(struct flow   *flow,
+                      struct counts *counts)
+{
+  counts->packets = atomic_load_explicit(&flow->packets,memory_order_relaxed);
+  counts->lost = atomic_load_explicit(&flow->lost,memory_order_relaxed);
+  counts->late = atomic_load_explicit(&flow->late,memory_order_relaxed);
+  counts->duplicates = atomic_load_explicit(&flow->duplicates,memory_order_relaxed);
+  counts->too_late = atomic_load_explicit(&flow->too_late,memory_order_relaxed);
+  counts->wraps = atomic_load_explicit(&flow->wraps,memory_order_relaxed);
+  counts->restarts = atomic_load_explicit(&flow->restarts,memory_order_relaxed);
+  counts->wrong_size = atomic_load_explicit(&flow->wrong_size,memory_order_relaxed);
+}
+
+/*
+ * Read packets on one thread's socket, forever (or until something goes
+ * wrong), checking the packet numbers of each flow separately.
+ */
+static void *run_receive_thread(void *arg)
+{
+  struct receive_thread *thread = arg;
+  struct receiver       *receiver = &thread->receiver;
+  int                    ii;
+
+  pin_to_cpu(thread->cpu);
+  for (;;)
+  {
+    struct flow *flow = NULL;
+    int          num_numbers = 0;
+    int          count = read_messages(receiver,thread->sock,receiver->batch);
+    if (count == -1)
+    {
+      perror("Error in recvmmsg");
+      atomic_store(&thread->failed,1);
+      break;
+    }
+
+    // Check runs of packets from the same flow together (normally, the
+    // whole batch)
+    for (ii = 0; ii < count; ii++)
+    {
+      unsigned char *data = &receiver->data[ii*receiver->buffer_size];
+      uint16_t       stream_id = (receiver->msgs[ii].msg_len >= 6 ?
+                                  data[4] | data[5] << 8 : 0);
+      struct flow   *this_flow = flow;
+      if (flow == NULL ||
+          flow->address != receiver->addresses[ii].sin_addr.s_addr ||
+          flow->port != receiver->addresses[ii].sin_port ||
+          flow->stream_id != stream_id)
+      {
+        this_flow = find_flow(thread,&receiver->addresses[ii],stream_id);
+        if (flow != NULL)
+        {
+          check_batch(&flow->seq,receiver->numbers,num_numbers);
+          flow->dirty = 1;
+        }
+        num_numbers = 0;
+        flow = this_flow;
+      }
+      if (flow == NULL)
+      {
+        atomic_fetch_add_explicit(&thread->untracked,1,memory_order_relaxed);
+        continue;
+      }
+      num_numbers += split_message(receiver,ii,&receiver->numbers[num_numbers],
+                                   &flow->seq,NULL);
+    }
+    if (flow != NULL)
+    {
+      check_batch(&flow->seq,receiver->numbers,num_numbers);
+      flow->dirty = 1;
+    }
+
+    for (ii = 0; ii < MAX_FLOWS; ii++)
+      if (thread->flows[ii].dirty)
+        publish_flow(&thread->flows[ii]);
+  }
+  return NULL;
+}
+
+/*
+ * Report on all the threads' flows, every so often, until we've had `max`
+ * packets (if that's not 0), or a thread gives up.
+ *
+ * Returns 0 if all went well, 1 if something went wrong.
+ */
+static int report_threads(struct receive_thread threads[],
+                          int                   num_threads,
+                          int                   packet_size,
+                          unsigned long         max)
+{
+  struct counts  last_total;
+  struct timeval then, now;
+  int            ii, jj;
+
+  memset(&last_total,0,sizeof(last_total));
+  gettimeofday(&then, NULL);
+  for (;;)
+  {
+    struct counts  total;
+    unsigned long  untracked = 0;
+    int            num_flows = 0;
+    int            failed = 0;
+    double         seconds;
+
+    usleep(REPORT_US);
+    gettimeofday(&now, NULL);
+    seconds = (now.tv_sec - then.tv_sec) + (now.tv_usec - then.tv_usec) / 1000000.0;
+    memset(&total,0,sizeof(total));
+    for (ii = 0; ii < num_threads; ii++)
+      for (jj = 0; jj < MAX_FLOWS; jj++)
+        if (atomic_load_explicit(&threads[ii].flows[jj].used,memory_order_acquire))
+          num_flows ++;
+
+    for (ii = 0; ii < num_threads; ii++)
+    {
+      failed |= atomic_load(&threads[ii].failed);
+      untracked += atomic_load_explicit(&threads[ii].untracked,memory_order_relaxed);
+      for (jj = 0; jj < MAX_FLOWS; jj++)
+      {
+        struct flow   *flow = &threads[ii].flows[jj];
+        struct counts  counts;
+        struct in_addr addr;
+        if (!atomic_load_explicit(&flow->used,memory_order_acquire))
+          continue;
+        read_flow(flow,&counts);
+        if (num_flows > 1)
+        {
+          addr.s_addr = flow->address;
+          printf("  %s:%u stream %u (thread %d): ",inet_ntoa(addr),
+                 ntohs(flow->port),flow->stream_id,ii);
+          print_counts(&counts,&flow->last,seconds,packet_size);
+          printf("\n");
+        }
+        flow->last = counts;
+        add_counts(&total,&counts);
+      }
+    }
+    printf("%s",(num_flows > 1 ? "All flows: " : ""));
+    print_counts(&total,&last_total,seconds,packet_size);
+    if (untracked > 0)
+      printf(", %lu packets from untracked flows (more than %d on a thread)",
+             untracked,MAX_FLOWS);
+    printf("\n");
+    last_total = total;
+    then = now;
+
+    if (failed || (max != 0 && total.packets >= max))
+    {
+      printf("Total number of packets received: %lu\n",total.packets);
+      printf("Number of packets lost:           %lu\n",total.lost);
+      printf("Number of packets late:           %lu\n",total.late);
+      if (total.too_late)
+        printf("Number too late (counted lost):   %lu\n",total.too_late);
+      printf("Number of duplicate packets:      %lu\n",total.duplicates);
+      if (total.restarts)
+        printf("Sender restarted:                 %lu times\n",total.restarts);
+      if (total.wrong_size)
+        printf("Packets of unexpected size:       %lu\n",total.wrong_size);
+      return failed;
+    }
+  }
+}
+
+/*
+ * Receive with `num_threads` threads (see above)
+ *
+ * Returns 0 if all went well, 1 if something went wrong.
+ */
+static int receive_threaded(char          *hostname,
+                            int            port,
+                            int            num_threads,
+                            int            steer,
+                            int            packet_size,
+                            int            batch,
+                            int            gro,
+                            unsigned long  max)
+{
+  struct receive_thread *threads;
+  cpu_set_t              allowed;
+  int                    cpu = -1;
+  int                    ii;
+
+  threads = calloc(num_threads,sizeof(struct receive_thread));
+  if (threads == NULL)
+  {
+    fprintf(stderr,"### Unable to allocate %d threads\n",num_threads);
+    return 1;
+  }
+  if (sched_getaffinity(0,sizeof(allowed),&allowed) == -1)
+    CPU_ZERO(&allowed);
+
+  for (ii = 0; ii < num_threads; ii++)
+  {
+    struct receive_thread *thread = &threads[ii];
+    thread->index = ii;
+    thread->sock = udp_listen_socket(hostname,port,1);
+    if (thread->sock < 0)
+      return 1;
+    if (gro && enable_gro(thread->sock))
+      return 1;
+    if (setup_receiver(&thread->receiver,packet_size,batch,gro,0,1))
+      return 1;
+
+    // One CPU each, in turn, from those we're allowed to use
+    thread->cpu = -1;
+    if (CPU_COUNT(&allowed) > 0)
+    {
+      do
+        cpu = (cpu + 1) % CPU_SETSIZE;
+      while (!CPU_ISSET(cpu,&allowed));
+      thread->cpu = cpu;
+    }
+  }
+  // The program applies to the whole group of sockets
+  if (steer && steer_by_stream(threads[0].sock,num_threads))
+    return 1;
+
+  for (ii = 0; ii < num_threads; ii++)
+  {
+    int err = pthread_create(&threads[ii].thread,NULL,run_receive_thread,
+                             &threads[ii]);
+    if (err)
+    {
+      fprintf(stderr,"### Unable to start thread %d: %s\n",ii,strerror(err));
+      return 1;
+    }
+    if (threads[ii].cpu >= 0)
+      printf("Thread %d is on CPU %d\n",ii,threads[ii].cpu);
+  }
+  return report_threads(threads,num_threads,packet_size,max);
+}
+
+/*
+ * Check the packet number tracking against some made up sequences of
+ * packet numbers, each given as runs of `first` .. `last`.
+ *
+ * Returns 0 if they all came out as expected, 1 if not.
+ */
+struct tracker_case
+{
+  const char    *name;
+  uint32_t       runs[8][2];   // ended by a run of 0 .. 0
+  unsigned long  lost, late, too_late, duplicates, restarts;
+};
+
+static int test_tracker(void)
+{
+  static const struct tracker_case cases[] = {
+    {"in order",           {{0,2999}},                       0,0,0,0,0},
+    {"lost, late and duplicate",
+     {{0,99},{101,199},{201,200},{202,299},{299,2999}},     1,1,0,1,0},
+    {"far jump",           {{0,99},{5000000,5002999}},       0,0,0,0,1},
+    {"restart after the window",   {{0,2999},{0,2999}},      0,0,0,0,1},
+    {"restart within the window",  {{0,499},{0,2999}},       0,0,0,0,1},
+    {"one packet too late",
+     {{0,1999},{500,500},{2000,2999}},                       0,0,1,0,0},
+  };
+  int failed = 0;
+  int ii, jj;
+
+  for (ii = 0; ii < (int)(sizeof(cases)/sizeof(cases[0])); ii++)
+  {
+    const struct tracker_case *c = &cases[ii];
+    struct sequence seq;
+    memset(&seq,0,sizeof(seq));
+    for (jj = 0; jj < 8 && (c->runs[jj][0] || c->runs[jj][1]); jj++)
+    {
+      uint32_t first = c->runs[jj][0];
+      uint32_t last = c->runs[jj][1];
+      uint32_t num = first;
+      // A run can go downwards, to make packets arrive out of order
+      for (;;)
+      {
+        track_packet(&seq,num,NULL);
+        if (num == last)
+          break;
+        num += (first <= last ? 1 : -1);
+      }
+    }
+    if (seq.lost != c->lost || seq.late != c->late ||
+        seq.too_late != c->too_late || seq.duplicates != c->duplicates ||
+        seq.restarts != c->restarts)
+    {
+      printf("!!! %s: lost %lu, late %lu, too late %lu, duplicates %lu,"
+             " restarts %lu (expected %lu, %lu, %lu, %lu, %lu)\n",
+             c->name,seq.lost,seq.late,seq.too_late,seq.duplicates,
+             seq.restarts,c->lost,c->late,c->too_late,c->duplicates,
+             c->restarts);
+      failed = 1;
+    }
+    else
+      printf("%s: OK\n",c->name);
+  }
+  return failed;
+}
+
 int main(int argc, char **argv)
 {
 #define TS_PACKET_SIZE 188
 
-  char  *hostname;
+  char  *hostname = NULL;
   char  *colon;
   int    port;
   int    sock;
@@ -101,11 +1481,15 @@ int main(int argc, char **argv)
   int    mult = 1;
   int    packet_size;
   unsigned char data[100*TS_PACKET_SIZE];
-  unsigned int last_packet_number = 0;
-  int had_first_packet = 0;
-  unsigned int total_packets = 0;
-  unsigned int total_lost = 0;
+  struct sequence seq;
   int quiet = 0;
+  int batch = 0;
+  int gro = 0;
+  int threads = 0;
+  int steer = 0;
+  struct latency *latency = NULL;
+  int positional = 0;
+  int ii;
 #if 0
   unsigned long total_bytes = 0;
   unsigned long past_delay = 0;
@@ -114,49 +1498,137 @@ int main(int argc, char **argv)
   if (argc < 2)
   {
     fprintf(stderr,
-            "Usage: %s <ipaddr>[:<port>] [<mult>] [<max>] [q]\n\n"
+            "Usage: %s <ipaddr>[:<port>] [<mult>] [<max>] [q] [-batch <n>] [-gro] [-timestamps sw|hw]\n"
+            "       [-threads <n> [-steer]]\n"
+            "   or: %s -selftest\n\n"
             "<port> defaults to 88.\n"
             "<mult> is the packet size in units of 188 (so data is <mult>*188 bytes)\n"
             "<max> is the number of packets to read before stopping\n"
             "(if not given, or 0, read forever)\n"
-            "'q' means don't give individual error messages for dropped packets\n",
-            argv[0]);
+            "'q' means don't give individual error messages for dropped packets\n"
+            "'-batch' means read up to <n> packets at a time (with recvmmsg), and\n"
+            "report a summary every second, instead of on each packet\n"
+            "'-gro' means let the kernel coalesce packets into (up to 64K byte)\n"
+            "buffers, which are split back into <mult>*188 byte packets for\n"
+            "checking. It implies '-batch' (by default, '-batch 1')\n"
+            "'-timestamps' means measure the one way delay and jitter of each\n"
+            "packet, from the send time udpserve puts in it (with '-timestamp')\n"
+            "and the arrival time the kernel ('sw') or network card ('hw') gives.\n"
+            "It also implies '-batch'\n"
+            "'-threads' means read with <n> threads, each on its own CPU, with\n"
+            "its own socket on the same port (SO_REUSEPORT). The packet numbers\n"
+            "from each sender and stream id are checked separately. '-steer'\n"
+            "means share packets between the threads by stream id, rather than\n"
+            "by sender. It implies '-batch', and can't be used with '-timestamps'\n"
+            "'-selftest' checks the packet number tracking, and exits\n",
+            argv[0],argv[0]);
     return 1;
   }
+  else if (!strcmp("-selftest",argv[1]))
+    return test_tracker();
 
-  hostname = argv[1];
-
-  if (argc > 2)
+  for (ii = 1; ii < argc; ii++)
   {
-    mult = atoi(argv[2]);
-    if (mult < 0)
+    if (!strcmp("-batch",argv[ii]) && ii+1 < argc)
     {
-      printf("Packet size multiplier %d does not make sense\n",mult);
-      return 1;
+      batch = atoi(argv[ii+1]);
+      if (batch < 1 || batch > 1024)
+      {
+        printf("Batch size %d does not make sense (must be 1..1024)\n",batch);
+        return 1;
+      }
+      ii ++;
+      continue;
     }
-  }
-  packet_size = mult * TS_PACKET_SIZE;
-
-  if (argc > 3)
-  {
-    max = atoi(argv[3]);
-    if (max < 0)
+    else if (!strcmp("-gro",argv[ii]))
     {
-      printf("Maximum number of packets %d does not make sense\n",max);
-      return 1;
+      gro = 1;
+      if (batch == 0)
+        batch = 1;
+      continue;
     }
-  }
-
-  if (argc > 4)
-  {
-    if (argv[4][0] == 'q')
-      quiet = 1;
-    else
+    else if (!strcmp("-timestamps",argv[ii]) && ii+1 < argc)
     {
-      fprintf(stderr,"Unrecognised '%s'\n",argv[4]);
+      latency = calloc(1,sizeof(struct latency));
+      if (latency == NULL)
+      {
+        fprintf(stderr,"### Unable to allocate latency histograms\n");
+        return 1;
+      }
+      if (!strcmp("sw",argv[ii+1]))
+        latency->mode = TIMESTAMP_SOFTWARE;
+      else if (!strcmp("hw",argv[ii+1]))
+        latency->mode = TIMESTAMP_HARDWARE;
+      else
+      {
+        fprintf(stderr,"-timestamps must be followed by sw or hw, not %s\n",
+                argv[ii+1]);
+        return 1;
+      }
+      if (batch == 0)
+        batch = 1;
+      ii ++;
+      continue;
+    }
+    else if (!strcmp("-threads",argv[ii]) && ii+1 < argc)
+    {
+      threads = atoi(argv[ii+1]);
+      if (threads < 1)
+      {
+        printf("Thread count %d does not make sense\n",threads);
+        return 1;
+      }
+      if (batch == 0)
+        batch = 1;
+      ii ++;
+      continue;
+    }
+    else if (!strcmp("-steer",argv[ii]))
+    {
+      steer = 1;
+      continue;
+    }
+    switch (positional++)
+    {
+    case 0:
+      hostname = argv[ii];
+      break;
+    case 1:
+      mult = atoi(argv[ii]);
+      if (mult < 1 || mult > 100)
+      {
+        printf("Packet size multiplier %d does not make sense\n",mult);
+        return 1;
+      }
+      break;
+    case 2:
+      max = atoi(argv[ii]);
+      if (max < 0)
+      {
+        printf("Maximum number of packets %d does not make sense\n",max);
+        return 1;
+      }
+      break;
+    case 3:
+      if (argv[ii][0] == 'q')
+        quiet = 1;
+      else
+      {
+        fprintf(stderr,"Unrecognised '%s'\n",argv[ii]);
+        return 1;
+      }
+      break;
+    default:
+      fprintf(stderr,"Unrecognised '%s'\n",argv[ii]);
       return 1;
     }
   }
+  if (hostname == NULL)
+  {
+    fprintf(stderr,"No <ipaddr> given\n");
+    return 1;
+  }
+  packet_size = mult * TS_PACKET_SIZE;
 
   if ((colon = strchr(hostname, ':')))
   {
@@ -166,8 +1638,46 @@ int main(int argc, char **argv)
   else
     port = 88;
 
-  sock = udp_listen_socket(hostname,port);
+  if (threads > 0)
+  {
+    if (latency)
+    {
+      fprintf(stderr,"-timestamps cannot be combined with -threads\n");
+      return 1;
+    }
+    return receive_threaded(hostname,port,threads,steer,packet_size,
+                            batch,gro,max);
+  }
+  else if (steer)
+  {
+    fprintf(stderr,"-steer needs -threads\n");
+    return 1;
+  }
+
+  sock = udp_listen_socket(hostname,port,0);
   if (sock < 0) return 1;
+  if (gro && enable_gro(sock))
+    return 1;
+  if (latency && enable_timestamps(sock,latency))
+    return 1;
+
+  memset(&seq,0,sizeof(seq));
+  if (batch > 0)
+  {
+    int result = receive_batches(sock,packet_size,batch,gro,max,&seq,latency);
+    report_sequence(&seq);
+    if (latency)
+    {
+      report_latency(latency);
+      if (latency->total_delay.count > 0)
+        hist_print("overall one way delay",&latency->total_delay);
+      if (latency->total_ipdv.count > 0)
+        hist_print("overall |D|",&latency->total_ipdv);
+      free(latency);
+    }
+    close(sock);
+    return result;
+  }
 
   for (;;)
   {
@@ -175,7 +1685,9 @@ int main(int argc, char **argv)
     long   delay_wanted;
 #endif
     unsigned int this_packet_number = 0;
-    size_t len = recv(sock, data, packet_size, MSG_WAITALL);
+    unsigned int expected;
+    uint32_t     distance;
+    ssize_t len = recv(sock, data, packet_size, MSG_WAITALL);
     if (len < 0)
     {
       perror("Error in recv");
@@ -189,38 +1701,42 @@ int main(int argc, char **argv)
 
     if (len != packet_size)
     {
-      printf("Read packet of unexpected size %d (expected %d)\n",len,packet_size);
+      printf("Read packet of unexpected size %d (expected %d)\n",(int)len,packet_size);
+      seq.wrong_size ++;
     }
 
-    this_packet_number = data[3];
-    this_packet_number = (this_packet_number << 8) | data[2];
-    this_packet_number = (this_packet_number << 8) | data[1];
-    this_packet_number = (this_packet_number << 8) | data[0];
+    this_packet_number = get_packet_number(data);
 
     if (!quiet)
-      printf("%6d: got packet %08u",total_packets+1,this_packet_number);
+      printf("%6lu: got packet %08u",seq.total_packets+1,this_packet_number);
 
-    if (!had_first_packet)
+    expected = seq.highest + 1;
+    switch (track_packet(&seq,this_packet_number,&distance))
     {
-      had_first_packet = 1;
-      if (!quiet)
-        printf(" (first packet)");
-    }
-    else
-    {
-      if (this_packet_number != (last_packet_number + 1))
-      {
-          if (!quiet)
-            printf(", expected packet %08u (missed %3d)",
-                   last_packet_number+1,this_packet_number - (last_packet_number+1));
-          total_lost += (this_packet_number - (last_packet_number+1));
-      }
+    case SEQ_FIRST:
+      if (!quiet) printf(" (first packet)");
+      break;
+    case SEQ_GAP:
+      if (!quiet) printf(", expected packet %08u (missed %3u)",expected,distance);
+      break;
+    case SEQ_LATE:
+      if (!quiet) printf(" (late, by %u)",distance);
+      break;
+    case SEQ_TOO_LATE:
+      if (!quiet) printf(" (late, by %u - already counted as lost)",distance);
+      break;
+    case SEQ_DUPLICATE:
+      if (!quiet) printf(" (duplicate)");
+      break;
+    case SEQ_RESTART:
+      if (!quiet) printf(", expected packet %08u (sender restarted?)",expected);
+      break;
+    default:
+      break;
     }
     if (!quiet)
       printf("\n");
-    last_packet_number = this_packet_number;
-    total_packets ++;
-    if (max != 0 && total_packets >= max)
+    if (max != 0 && seq.total_packets >= (unsigned long)max)
       break;
 
 #if 0
@@ -236,8 +1752,7 @@ int main(int argc, char **argv)
     }
 #endif
   }
-  printf("Total number of packets received: %d\n",total_packets);
-  printf("Minimum number of packets lost:   %d\n",total_lost);
+  report_sequence(&seq);
 
   close(sock);
   return 0;